@@ -0,0 +1,454 @@
+/**
+ * libmsntp
+ * http://snarfed.org/libmsntp
+ *
+ * Copyright 2005, Ryan Barrett <libmsntp@ryanb.org>
+ *
+ * This includes the batch forms of the packet checking, unpacking and packing
+ * in main.c, used by the batched server. They do exactly what check_packet()
+ * (in op_server mode), unpack_ntp() and pack_ntp() do to each packet, but work
+ * on many packets at once.
+ *
+ * On x86-64 there are SSE4.1 and AVX2 versions, chosen at run time from what
+ * the CPU supports. The checks load the first word and the reference timestamp
+ * of four (or eight) packets into one register and test all of the header
+ * fields together, and the timestamps are byte-swapped two (or four) at a time
+ * with byte shuffles. Everything else uses the plain C versions, which are
+ * also the reference for what the vector ones must do.
+ */
+
+#include "header.h"
+
+#define CODEC
+#include "kludges.h"
+#undef CODEC
+
+#ifndef SIMD_MISSING
+#include <immintrin.h>
+#endif
+
+
+
+/* The implementations in use, chosen by choose_codec() on first use.  Several
+server threads may race to choose, but they all choose the same thing. */
+
+static void (*check_impl) (char *, const unsigned char *, int, const int *,
+    int) = NULL;
+static void (*unpack_impl) (ntp_data *, const unsigned char *, int,
+    const int *, int, ntp_stamp) = NULL;
+static void (*pack_impl) (unsigned char *, int, const ntp_data *, int) = NULL;
+
+
+
+static unsigned long load_word (const unsigned char *field) {
+
+/* Load 32 bits in host order, without assuming alignment. */
+
+    uint32_t x;
+
+    memcpy(&x,field,4);
+    return x;
+}
+
+
+
+static int check_one (const unsigned char *packet, int length) {
+
+/* The server-side checks from check_packet(), on the raw packet.  This returns
+0 for a request to answer, 1 for a bad packet and 2 for an ignored broadcast. */
+
+    int mode = packet[0]&0x07, version = (packet[0]>>3)&0x07;
+
+    if (length < NTP_PACKET_MIN || length > NTP_PACKET_MAX) return 1;
+    if (mode == NTP_BROADCAST) return 2;
+    if ((mode != NTP_CLIENT && mode != NTP_ACTIVE) || (packet[0]>>6) != 0 ||
+            version < 1 || version > NTP_VERSION_MAX ||
+            packet[1] > NTP_STRATUM_MAX)
+        return 1;
+    if (packet[1] != 0 && packet[1] != NTP_STRATUM_MAX &&
+            get_stamp(&packet[NTP_REFERENCE]) == 0)
+        return 1;
+    return 0;
+}
+
+
+
+static void unpack_header (ntp_data *data, const unsigned char *packet,
+    ntp_stamp current) {
+
+/* Unpack everything but the timestamps, as unpack_ntp() does. */
+
+    data->current = current;
+    data->status = (packet[0] >> 6);
+    data->version = (packet[0] >> 3)&0x07;
+    data->mode = packet[0]&0x07;
+    data->stratum = packet[1];
+    data->polling = packet[2];
+    data->precision = packet[3];
+    data->dispersion = ((unsigned long)packet[NTP_DISP_FIELD]<<24|
+        (unsigned long)packet[NTP_DISP_FIELD+1]<<16|
+        (unsigned long)packet[NTP_DISP_FIELD+2]<<8|
+        (unsigned long)packet[NTP_DISP_FIELD+3])/NTP_SHORT;
+}
+
+
+
+static unsigned long pack_header (const ntp_data *data) {
+
+/* The first word of a packet, as pack_ntp() builds it, in host order.  This is
+used only by the vector code, which is little-endian. */
+
+    return (unsigned long)((data->status<<6)|(data->version<<3)|data->mode)|
+        (unsigned long)data->stratum<<8|(unsigned long)data->polling<<16|
+        (unsigned long)data->precision<<24;
+}
+
+
+
+static void check_scalar (char *verdicts, const unsigned char *packets,
+    int length, const int *lengths, int number) {
+    int k;
+
+    for (k = 0; k < number; ++k)
+        verdicts[k] = (char)check_one(packets+k*length,lengths[k]);
+}
+
+
+
+static void unpack_scalar (ntp_data *data, const unsigned char *packets,
+    int length, const int *slots, int number, ntp_stamp current) {
+    const unsigned char *packet;
+    int k;
+
+    for (k = 0; k < number; ++k) {
+        packet = packets+slots[k]*length;
+        unpack_header(&data[k],packet,current);
+        data[k].reference = get_stamp(&packet[NTP_REFERENCE]);
+        data[k].originate = get_stamp(&packet[NTP_ORIGINATE]);
+        data[k].receive = get_stamp(&packet[NTP_RECEIVE]);
+        data[k].transmit = get_stamp(&packet[NTP_TRANSMIT]);
+    }
+}
+
+
+
+static void pack_scalar (unsigned char *packets, int length,
+    const ntp_data *data, int number) {
+    int k;
+
+    for (k = 0; k < number; ++k)
+        pack_ntp(packets+k*length,length,(ntp_data *)&data[k]);
+}
+
+
+
+#ifndef SIMD_MISSING
+
+/* Reverse the bytes of each 64-bit half, i.e. convert two big-endian
+timestamps to host order or back. */
+
+#define SWAP_STAMPS 7,6,5,4,3,2,1,0,15,14,13,12,11,10,9,8
+
+
+
+__attribute__((target("sse4.1")))
+static void check_sse (char *verdicts, const unsigned char *packets,
+    int length, const int *lengths, int number) {
+
+/* Four packets at a time.  Each lane holds the first word of one packet
+(status, version, mode, stratum) and the OR of the two halves of its reference
+stamp. */
+
+    const __m128i zero = _mm_setzero_si128(), one = _mm_set1_epi32(1),
+        seven = _mm_set1_epi32(7);
+    const unsigned char *p;
+    __m128i word, ref, len, mode, version, stratum, good, bad, verdict;
+    int k, x;
+
+    for (k = 0; k+4 <= number; k += 4) {
+        p = packets+k*length;
+        word = _mm_setr_epi32(load_word(p),load_word(p+length),
+            load_word(p+2*length),load_word(p+3*length));
+        ref = _mm_setr_epi32(
+            load_word(p+NTP_REFERENCE)|load_word(p+NTP_REFERENCE+4),
+            load_word(p+length+NTP_REFERENCE)|
+                load_word(p+length+NTP_REFERENCE+4),
+            load_word(p+2*length+NTP_REFERENCE)|
+                load_word(p+2*length+NTP_REFERENCE+4),
+            load_word(p+3*length+NTP_REFERENCE)|
+                load_word(p+3*length+NTP_REFERENCE+4));
+        len = _mm_loadu_si128((const __m128i *)&lengths[k]);
+        mode = _mm_and_si128(word,seven);
+        version = _mm_and_si128(_mm_srli_epi32(word,3),seven);
+        stratum = _mm_and_si128(_mm_srli_epi32(word,8),_mm_set1_epi32(0xff));
+
+        good = _mm_or_si128(_mm_cmpeq_epi32(mode,_mm_set1_epi32(NTP_CLIENT)),
+            _mm_cmpeq_epi32(mode,_mm_set1_epi32(NTP_ACTIVE)));
+        good = _mm_and_si128(good,_mm_cmpeq_epi32(
+            _mm_and_si128(word,_mm_set1_epi32(0xc0)),zero));
+        good = _mm_and_si128(good,_mm_cmpgt_epi32(version,zero));
+        good = _mm_and_si128(good,_mm_cmplt_epi32(version,
+            _mm_set1_epi32(NTP_VERSION_MAX+1)));
+        good = _mm_and_si128(good,_mm_cmplt_epi32(stratum,
+            _mm_set1_epi32(NTP_STRATUM_MAX+1)));
+        bad = _mm_andnot_si128(_mm_or_si128(_mm_cmpeq_epi32(stratum,zero),
+                _mm_cmpeq_epi32(stratum,_mm_set1_epi32(NTP_STRATUM_MAX))),
+            _mm_cmpeq_epi32(ref,zero));
+        good = _mm_andnot_si128(bad,good);
+
+        verdict = _mm_blendv_epi8(one,_mm_set1_epi32(2),
+            _mm_cmpeq_epi32(mode,_mm_set1_epi32(NTP_BROADCAST)));
+        verdict = _mm_blendv_epi8(verdict,zero,good);
+        bad = _mm_or_si128(
+            _mm_cmplt_epi32(len,_mm_set1_epi32(NTP_PACKET_MIN)),
+            _mm_cmpgt_epi32(len,_mm_set1_epi32(NTP_PACKET_MAX)));
+        verdict = _mm_blendv_epi8(verdict,one,bad);
+        verdict = _mm_packus_epi16(_mm_packs_epi32(verdict,verdict),zero);
+        x = _mm_cvtsi128_si32(verdict);
+        memcpy(&verdicts[k],&x,4);
+    }
+    check_scalar(&verdicts[k],packets+k*length,length,&lengths[k],number-k);
+}
+
+
+
+__attribute__((target("sse4.1")))
+static void unpack_sse (ntp_data *data, const unsigned char *packets,
+    int length, const int *slots, int number, ntp_stamp current) {
+
+/* Two timestamps per shuffle: reference and originate, receive and transmit. */
+
+    const __m128i swap = _mm_setr_epi8(SWAP_STAMPS);
+    const unsigned char *packet;
+    __m128i a, b;
+    int k;
+
+    for (k = 0; k < number; ++k) {
+        packet = packets+slots[k]*length;
+        unpack_header(&data[k],packet,current);
+        a = _mm_shuffle_epi8(
+            _mm_loadu_si128((const __m128i *)&packet[NTP_REFERENCE]),swap);
+        b = _mm_shuffle_epi8(
+            _mm_loadu_si128((const __m128i *)&packet[NTP_RECEIVE]),swap);
+        data[k].reference = (ntp_stamp)_mm_cvtsi128_si64(a);
+        data[k].originate = (ntp_stamp)_mm_extract_epi64(a,1);
+        data[k].receive = (ntp_stamp)_mm_cvtsi128_si64(b);
+        data[k].transmit = (ntp_stamp)_mm_extract_epi64(b,1);
+    }
+}
+
+
+
+__attribute__((target("sse4.1")))
+static void pack_sse (unsigned char *packets, int length,
+    const ntp_data *data, int number) {
+
+/* Three stores per packet: the header (and zeros), then the zero reference
+stamp with the originate stamp, then the receive and transmit stamps. */
+
+    const __m128i swap = _mm_setr_epi8(SWAP_STAMPS);
+    unsigned char *packet;
+    int k;
+
+    for (k = 0; k < number; ++k) {
+        packet = packets+k*length;
+        _mm_storeu_si128((__m128i *)packet,
+            _mm_cvtsi32_si128((int)pack_header(&data[k])));
+        _mm_storeu_si128((__m128i *)&packet[NTP_REFERENCE],_mm_shuffle_epi8(
+            _mm_set_epi64x((long long)data[k].originate,0),swap));
+        _mm_storeu_si128((__m128i *)&packet[NTP_RECEIVE],_mm_shuffle_epi8(
+            _mm_set_epi64x((long long)data[k].transmit,
+                (long long)data[k].receive),swap));
+        if (length > NTP_PACKET_MIN)
+            memset(&packet[NTP_PACKET_MIN],0,(size_t)(length-NTP_PACKET_MIN));
+    }
+}
+
+
+
+__attribute__((target("avx2")))
+static void check_avx2 (char *verdicts, const unsigned char *packets,
+    int length, const int *lengths, int number) {
+
+/* Eight packets at a time, as check_sse(), but gathering the words directly
+from the packets. */
+
+    const __m256i zero = _mm256_setzero_si256(), one = _mm256_set1_epi32(1),
+        seven = _mm256_set1_epi32(7);
+    const unsigned char *p;
+    __m256i offsets, word, ref, len, mode, version, stratum, good, bad,
+        verdict;
+    __m128i half;
+    int k, x;
+
+    offsets = _mm256_mullo_epi32(_mm256_setr_epi32(0,1,2,3,4,5,6,7),
+        _mm256_set1_epi32(length));
+    for (k = 0; k+8 <= number; k += 8) {
+        p = packets+k*length;
+        word = _mm256_i32gather_epi32((const int *)p,offsets,1);
+        ref = _mm256_or_si256(
+            _mm256_i32gather_epi32((const int *)&p[NTP_REFERENCE],offsets,1),
+            _mm256_i32gather_epi32((const int *)&p[NTP_REFERENCE+4],offsets,
+                1));
+        len = _mm256_loadu_si256((const __m256i *)&lengths[k]);
+        mode = _mm256_and_si256(word,seven);
+        version = _mm256_and_si256(_mm256_srli_epi32(word,3),seven);
+        stratum = _mm256_and_si256(_mm256_srli_epi32(word,8),
+            _mm256_set1_epi32(0xff));
+
+        good = _mm256_or_si256(
+            _mm256_cmpeq_epi32(mode,_mm256_set1_epi32(NTP_CLIENT)),
+            _mm256_cmpeq_epi32(mode,_mm256_set1_epi32(NTP_ACTIVE)));
+        good = _mm256_and_si256(good,_mm256_cmpeq_epi32(
+            _mm256_and_si256(word,_mm256_set1_epi32(0xc0)),zero));
+        good = _mm256_and_si256(good,_mm256_cmpgt_epi32(version,zero));
+        good = _mm256_and_si256(good,_mm256_cmpgt_epi32(
+            _mm256_set1_epi32(NTP_VERSION_MAX+1),version));
+        good = _mm256_and_si256(good,_mm256_cmpgt_epi32(
+            _mm256_set1_epi32(NTP_STRATUM_MAX+1),stratum));
+        bad = _mm256_andnot_si256(_mm256_or_si256(
+                _mm256_cmpeq_epi32(stratum,zero),
+                _mm256_cmpeq_epi32(stratum,_mm256_set1_epi32(NTP_STRATUM_MAX))),
+            _mm256_cmpeq_epi32(ref,zero));
+        good = _mm256_andnot_si256(bad,good);
+
+        verdict = _mm256_blendv_epi8(one,_mm256_set1_epi32(2),
+            _mm256_cmpeq_epi32(mode,_mm256_set1_epi32(NTP_BROADCAST)));
+        verdict = _mm256_blendv_epi8(verdict,zero,good);
+        bad = _mm256_or_si256(
+            _mm256_cmpgt_epi32(_mm256_set1_epi32(NTP_PACKET_MIN),len),
+            _mm256_cmpgt_epi32(len,_mm256_set1_epi32(NTP_PACKET_MAX)));
+        verdict = _mm256_blendv_epi8(verdict,one,bad);
+
+/* The packs work within 128-bit lanes, so each lane ends up with four of the
+verdicts in its first four bytes. */
+
+        verdict = _mm256_packus_epi16(_mm256_packs_epi32(verdict,verdict),
+            zero);
+        half = _mm256_castsi256_si128(verdict);
+        x = _mm_cvtsi128_si32(half);
+        memcpy(&verdicts[k],&x,4);
+        half = _mm256_extracti128_si256(verdict,1);
+        x = _mm_cvtsi128_si32(half);
+        memcpy(&verdicts[k+4],&x,4);
+    }
+    check_sse(&verdicts[k],packets+k*length,length,&lengths[k],number-k);
+}
+
+
+
+__attribute__((target("avx2")))
+static void unpack_avx2 (ntp_data *data, const unsigned char *packets,
+    int length, const int *slots, int number, ntp_stamp current) {
+
+/* All four timestamps are contiguous, so one load and one shuffle does them. */
+
+    const __m256i swap = _mm256_setr_epi8(SWAP_STAMPS,SWAP_STAMPS);
+    const unsigned char *packet;
+    ntp_stamp stamps[4];
+    int k;
+
+    for (k = 0; k < number; ++k) {
+        packet = packets+slots[k]*length;
+        unpack_header(&data[k],packet,current);
+        _mm256_storeu_si256((__m256i *)stamps,_mm256_shuffle_epi8(
+            _mm256_loadu_si256((const __m256i *)&packet[NTP_REFERENCE]),swap));
+        data[k].reference = stamps[0];
+        data[k].originate = stamps[1];
+        data[k].receive = stamps[2];
+        data[k].transmit = stamps[3];
+    }
+}
+
+
+
+__attribute__((target("avx2")))
+static void pack_avx2 (unsigned char *packets, int length,
+    const ntp_data *data, int number) {
+    const __m256i swap = _mm256_setr_epi8(SWAP_STAMPS,SWAP_STAMPS);
+    unsigned char *packet;
+    int k;
+
+    for (k = 0; k < number; ++k) {
+        packet = packets+k*length;
+        _mm_storeu_si128((__m128i *)packet,
+            _mm_cvtsi32_si128((int)pack_header(&data[k])));
+        _mm256_storeu_si256((__m256i *)&packet[NTP_REFERENCE],
+            _mm256_shuffle_epi8(_mm256_set_epi64x(
+                (long long)data[k].transmit,(long long)data[k].receive,
+                (long long)data[k].originate,0),swap));
+        if (length > NTP_PACKET_MIN)
+            memset(&packet[NTP_PACKET_MIN],0,(size_t)(length-NTP_PACKET_MIN));
+    }
+}
+
+#endif
+
+
+
+static void choose_codec (void) {
+
+/* Pick the best implementations that this CPU supports. */
+
+#ifndef SIMD_MISSING
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        unpack_impl = unpack_avx2;
+        pack_impl = pack_avx2;
+        check_impl = check_avx2;
+    } else if (__builtin_cpu_supports("sse4.1")) {
+        unpack_impl = unpack_sse;
+        pack_impl = pack_sse;
+        check_impl = check_sse;
+    } else
+#endif
+    {
+        unpack_impl = unpack_scalar;
+        pack_impl = pack_scalar;
+        check_impl = check_scalar;
+    }
+    if (verbose > 2)
+        fprintf(stderr,"Packet codec: %s\n",
+            (check_impl == check_scalar ? "scalar" :
+#ifndef SIMD_MISSING
+                check_impl == check_avx2 ? "AVX2" : "SSE4.1"));
+#else
+                "?"));
+#endif
+}
+
+
+
+extern void check_batch (char *verdicts, void *packets, int length,
+                         int *lengths, int number) {
+
+/* Check number packets, each in a slot of the given length, and set verdicts[k]
+to what check_packet() would return for slot k in op_server mode (but without
+the diagnostics): 0 to reply, 1 for a bad packet, 2 for a broadcast. */
+
+    if (check_impl == NULL) choose_codec();
+    check_impl(verdicts,packets,length,lengths,number);
+}
+
+
+
+extern void unpack_batch (ntp_data *data, void *packets, int length,
+                          int *slots, int number, ntp_stamp current) {
+
+/* Unpack packet slots[k] into data[k], as unpack_ntp() would, except that the
+time of arrival is given, rather than read separately for every packet. */
+
+    if (unpack_impl == NULL) choose_codec();
+    unpack_impl(data,packets,length,slots,number,current);
+}
+
+
+
+extern void pack_batch (void *packets, int length, ntp_data *data,
+                        int number) {
+
+/* Pack data[k] into slot k of packets, as pack_ntp() would. */
+
+    if (pack_impl == NULL) choose_codec();
+    pack_impl(packets,length,data,number);
+}
@@ -40,13 +40,9 @@ int serve(int port) {
 
   printf("Listening for SNTP clients on port %d...", port);
 
-  while (1) {
-    ret = msntp_serve();
-    if (ret > 0 || ret < -1)
-      return ret;
-  }
-
+  ret = msntp_serve_forever();
   msntp_stop_server();
+  return ret;
 }
 
 int get(char *hostname, int port) {
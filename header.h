@@ -10,6 +10,7 @@ No changes should be needed for any system that is even remotely like Unix. */
 
 #include <ctype.h>
 #include <errno.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -18,7 +19,22 @@ No changes should be needed for any system that is even remotely like Unix. */
 
 
 #define VERSION         "1.6a"         /* Just the version string */
-#define MAX_SOCKETS        10          /* Maximum number of addresses */
+#define MAX_SOCKETS        64          /* Maximum addresses or server threads */
+#define BATCH_MAX          64          /* Maximum packets per server batch */
+#define CACHE_LINE         64          /* Bytes; for padding per-thread data */
+
+/* The last error is kept per thread, so that clients in different threads can
+each tell what went wrong for them.  C11 and GCC both have a way of saying so;
+anything else gets one for the process, as before. */
+
+#if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L && \
+        !defined(__STDC_NO_THREADS__)
+    #define THREAD_LOCAL _Thread_local
+#elif defined(__GNUC__)
+    #define THREAD_LOCAL __thread
+#else
+    #define THREAD_LOCAL
+#endif
 
 #ifndef LOCKNAME
     #define LOCKNAME "/etc/msntp.pid"  /* Stores the pid */
@@ -29,6 +45,133 @@ No changes should be needed for any system that is even remotely like Unix. */
 
 
 
+/* NTP definitions.  Note that these assume 8-bit bytes - sigh.  There is
+little point in parameterising everything, as it is neither feasible nor
+useful.  It would be very useful if more fields could be defined as
+unspecified.  The NTP packet-handling routines contain a lot of extra
+assumptions.  They are shared by main.c and codec.c. */
+
+#define JAN_1970   2208988800.0        /* 1970 - 1900 in seconds */
+#define NTP_SCALE  4294967296.0        /* 2^32, of course! */
+#define NTP_SHORT       65536.0        /* 2^16, for 16.16 fields */
+
+#define NTP_PACKET_MIN       48        /* Without authentication */
+#define NTP_PACKET_MAX       68        /* With authentication (ignored) */
+#define NTP_DISP_FIELD        8        /* Offset of dispersion field */
+#define NTP_REFERENCE        16        /* Offset of reference timestamp */
+#define NTP_ORIGINATE        24        /* Offset of originate timestamp */
+#define NTP_RECEIVE          32        /* Offset of receive timestamp */
+#define NTP_TRANSMIT         40        /* Offset of transmit timestamp */
+
+#define NTP_LI_FUDGE          0        /* The current 'status' */
+#define NTP_VERSION           3        /* The current version */
+#define NTP_VERSION_MAX       4        /* The maximum valid version */
+#define NTP_STRATUM          15        /* The current stratum as a server */
+#define NTP_STRATUM_MAX      15        /* The maximum valid stratum */
+#define NTP_POLLING           8        /* The current 'polling interval' */
+#define NTP_PRECISION         0        /* The current 'precision' - 1 sec. */
+
+#define NTP_ACTIVE            1        /* NTP symmetric active request */
+#define NTP_PASSIVE           2        /* NTP symmetric passive response */
+#define NTP_CLIENT            3        /* NTP client request */
+#define NTP_SERVER            4        /* NTP server response */
+#define NTP_BROADCAST         5        /* NTP server broadcast */
+
+typedef uint64_t ntp_stamp;    /* Seconds since 1900 in NTP's 32.32 format */
+
+
+
+/* The unpacked NTP data structure, with all the fields even remotely relevant
+to SNTP.  The timestamps are kept in the packet's own 32.32 fixed-point form, so
+that they can be compared exactly, and are converted to seconds only when the
+arithmetic is done. */
+
+typedef struct NTP_DATA {
+    unsigned char status, version, mode, stratum, polling, precision;
+    double dispersion;
+    ntp_stamp reference, originate, receive, transmit, current;
+} ntp_data;
+
+
+
+/* The state of a client's exchange with a server: the requests sent so far,
+for matching the responses, and the best estimate yet.  run_client() keeps one
+for all of its servers, and each msntp_query has its own, so that they can be
+stepped through one packet at a time.  The settings are copied in when the
+exchange starts, from an msntp_ctx or the globals.  In burst mode, requests are
+sent several at a time, spacing microseconds apart, and the replies taken as
+they come.  Each reply is waited for up to waiting milliseconds, and the whole
+exchange must be over by the deadline, in monotonic nanoseconds, which counts
+from before the server is looked up.  When hedging, a request that is slow to
+be answered is sent again, and the two count as one; hedges says how many such
+duplicates there have been, and twins links each copy to the other.  The worst
+dispersion seen is kept here rather than in the global, so that exchanges in
+different threads do not share anything, and so is the round trip of the latest
+reply. */
+
+#define COUNT_MAX          25          /* Do NOT increase this! */
+
+typedef struct CLIENT_QUERY {
+    int operation, count, waiting, burst, spacing, hedging, attempts, accepts,
+        rejects, flushes, hedges, latest;
+    double minerr, offset, error, dispersion, roundtrip;
+    int64_t deadline;
+    ntp_stamp outgoing[2*COUNT_MAX],   /* Transmission timestamps */
+        departures[2*COUNT_MAX];       /* The kernel's, if known, or 0 */
+    int twins[2*COUNT_MAX];            /* 1 + the other copy's, or 0 */
+} client_query;
+
+/* The client settings of the reentrant functions, which are the same as the
+globals set up by the other ones, except that the times are in milliseconds.
+The last error of each call is kept here as well as in the thread's. */
+
+struct msntp_ctx {
+    int count, delay, waiting, burst, spacing, hedging, error;
+    double minerr;
+    const char *message;
+};
+
+
+
+/* The server statistics, kept per socket (and so per server thread) and added
+up only when asked for.  Each block fills whole cache lines, so that threads
+never write to the same one, and only its own thread writes to it, so it needs
+no locking.  But the counters are read and written whole, with relaxed atomics,
+so that other threads can read them at any time. */
+
+typedef union SERVER_STATS {
+    struct {
+        uint64_t accepted, rejected, broadcasts, send_failures,
+            bytes_received, bytes_sent, service_ns, batches, limited;
+    } counts;
+    char padding[2*CACHE_LINE];
+} server_stats;
+
+#ifdef __GNUC__
+#define STAT_READ(which,name) \
+    __atomic_load_n(&server_counters[which].counts.name,__ATOMIC_RELAXED)
+#define STAT_ADD(which,name,value) \
+    __atomic_store_n(&server_counters[which].counts.name, \
+        STAT_READ(which,name)+(value),__ATOMIC_RELAXED)
+#else
+#define STAT_READ(which,name) (server_counters[which].counts.name)
+#define STAT_ADD(which,name,value) \
+    (server_counters[which].counts.name += (value))
+#endif
+
+/* The time each reply took, from the arrival of its request to just before it
+was sent, is counted in a histogram per socket in the same way.  There are four
+buckets for each power of two nanoseconds, so quantiles are good to about 12%,
+up to the last, which collects anything over 2^40 ns, about 18 minutes. */
+
+#define LATENCY_BUCKETS   160
+
+typedef struct SERVER_LATENCY {
+    uint64_t buckets[LATENCY_BUCKETS];
+} server_latency;
+
+
+
 /* Defined in main.c */
 
 #define op_client           1          /* Behave as a challenge client */
@@ -36,6 +179,18 @@ No changes should be needed for any system that is even remotely like Unix. */
 #define op_listen           3          /* Behave as a listening client */
 #define op_broadcast        4          /* Behave as a broadcast server */
 
+#define action_display      1          /* Just display the result */
+#define action_reset        2          /* Reset using 'settimeofday' */
+#define action_adjust       3          /* Reset using 'adjtime' */
+#define action_broadcast    4          /* Behave as a server, broadcasting */
+#define action_server       5          /* Behave as a server for clients */
+#define action_query        6          /* Query a daemon savefile */
+#define action_monitor      7          /* Only publish it (libmsntp) */
+
+#define changes_clock(a) ((a) == action_reset || (a) == action_adjust)
+
+#define WINDOW_MAX       4096          /* Packets kept by the daemon */
+
 extern const char *argv0;
 
 extern int verbose, operation;
@@ -44,11 +199,55 @@ extern const char *lockname;
 
 extern void fatal (int errnum, const char *message, const char *insert);
 
+extern ntp_stamp get_stamp (const unsigned char *field);
+
+extern void put_stamp (unsigned char *field, ntp_stamp stamp);
+
+extern void pack_ntp (unsigned char *packet, int length, ntp_data *data);
+
+extern int64_t query_deadline (const struct msntp_ctx *ctx);
+
+extern void start_query (client_query *query, const struct msntp_ctx *ctx,
+    int64_t deadline);
+
+extern int query_left (const client_query *query);
+
+extern int query_request (int which, client_query *query,
+    unsigned char *transmit);
+
+extern int query_burst (client_query *query);
+
+extern int query_duplicate (int which, client_query *query,
+    unsigned char *transmit);
+
+extern int query_reply (int which, client_query *query, unsigned char *receive,
+    int length, ntp_stamp arrival);
+
+extern int finish_query (client_query *query);
+
+extern server_stats server_counters[MAX_SOCKETS];
+
+extern double server_started;
+
+extern server_latency server_latencies[MAX_SOCKETS];
+
+extern void record_latency (int which, uint64_t nanos);
+
+extern uint64_t latency_quantile (double fraction);
+
+extern void reset_server_stats (void);
+
 
 
 /* Defined in unix.c */
 
-extern void do_nothing (int seconds);
+extern int set_waking (int enable);
+
+extern void wake_up (void);
+
+extern int can_wake (void);
+
+extern int do_nothing (int seconds);
 
 extern int ftty (FILE *file);
 
@@ -74,16 +273,147 @@ extern int write_socket (int which, void *packet, int length);
 extern int read_socket (int which, void *packet, int length, int waiting,
                         int *written);
 
+extern int read_socket_batch (int which, void *packets, int length,
+                              int *lengths, int max, int waiting,
+                              int *received);
+
+extern int write_socket_batch (int which, void *packets, int length,
+                               int *slots, int number);
+
+extern ntp_stamp socket_arrival (int which, int slot);
+
+extern ntp_stamp socket_departure (int which);
+
+extern void socket_departures (int which, ntp_stamp *stamps, int number);
+
+extern uint64_t socket_peer (int which, int slot);
+
+extern int socket_descriptor (int which);
+
 extern int flush_socket (int which, int *count);
 
 extern int close_socket (int which);
 
 
 
+/* Defined in codec.c */
+
+extern void check_batch (char *verdicts, void *packets, int length,
+                         int *lengths, int number);
+
+extern void unpack_batch (ntp_data *data, void *packets, int length,
+                          int *slots, int number, ntp_stamp current);
+
+extern void pack_batch (void *packets, int length, ntp_data *data,
+                        int number);
+
+
+
+/* Defined in limit.c */
+
+extern int limit_packet (int which, int slot, unsigned char *request,
+                         int length, ntp_stamp now, unsigned char *reply);
+
+extern void limit_close (int which);
+
+
+
+/* Defined in uring.c */
+
+extern int uring_open (int which, int descriptor);
+
+extern int uring_active (int which);
+
+extern int uring_descriptor (int which);
+
+extern int uring_read_batch (int which, void *packets, int length,
+                             int *lengths, int max, int waiting,
+                             int *received);
+
+extern ntp_stamp uring_arrival (int which, int slot);
+
+extern uint64_t uring_peer (int which, int slot);
+
+extern int uring_write_batch (int which, void *packets, int length,
+                              int *slots, int number);
+
+extern void uring_close (int which);
+
+
+
+/* Defined in query.c */
+
+struct msntp_query;
+
+extern int open_query (struct msntp_query **result, char *hostname, int port,
+                       const struct msntp_ctx *ctx, int64_t deadline);
+
+extern int query_readable (struct msntp_query *query);
+
+extern int query_timer (struct msntp_query *query);
+
+extern int query_timeout (struct msntp_query *query);
+
+extern int query_descriptor (struct msntp_query *query);
+
+extern int query_result (struct msntp_query *query, double *offset,
+                         double *error);
+
+extern void close_query (struct msntp_query *query);
+
+struct msntp_session;
+
+extern int open_session (struct msntp_session **result, char *hostname,
+                         int port, const struct msntp_ctx *ctx);
+
+extern int session_query (struct msntp_query **result,
+                          struct msntp_session *session);
+
+extern int session_offset (struct msntp_session *session, double *offset,
+                           double *error);
+
+extern void close_session (struct msntp_session *session);
+
+extern int sample_servers (const struct msntp_ctx *ctx, char *hostnames[],
+                           int nhosts, int port, int64_t deadline,
+                           double *offsets, double *errors, int *results,
+                           double *offset, double *error);
+
+
+
+/* Defined in shm.c */
+
+extern int shm_attach (const char *name);
+
+extern void shm_publish (int valid, double when, double offset, double error,
+    double drift, double drifterr);
+
+extern void shm_detach (void);
+
+
+
 /* Defined in timing.c */
 
 extern double current_time (double offset);
 
+extern ntp_stamp current_stamp (void);
+
+extern ntp_stamp convert_timespec (const struct timespec *value);
+
+extern void read_clock (struct timespec *current);
+
+extern int64_t current_nanos (void);
+
+extern int64_t monotonic_nanos (void);
+
+extern int millis_left (int64_t deadline);
+
+extern int64_t convert_nanos (double value);
+
+extern void split_nanos (int64_t value, struct timespec *result);
+
 extern time_t convert_time (double value, int *millisecs);
 
 extern int adjust_time (double difference, int immediate, double ignore);
+
+extern double slew_left (void);
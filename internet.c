@@ -3,9 +3,9 @@
 
 This includes all of the code needed to handle Internet addressing.  It is way
 outside current POSIX, unfortunately.  It should be easy to convert to a system
-that uses another mechanism.  The signal handling is not necessary for its
-function, but is an attempt to avoid the program hanging when the name server
-is inaccessible. */
+that uses another mechanism.  Names are looked up by a separate thread, so that
+the caller can give up when the name server is inaccessible, and the answers
+are remembered for a while, so that most queries do not wait for it at all. */
 
 
 
@@ -14,122 +14,321 @@ is inaccessible. */
 
 #include <netdb.h>
 #include <arpa/inet.h>
+#include <pthread.h>
 
 #define INTERNET
 #include "kludges.h"
 #undef INTERNET
 
 /* defined in libmsntp.c */
-extern int libmsntp_port;
+extern int libmsntp_dns_ttl;
 
 
-/* There needs to be some disgusting grobble for handling timeouts, which is
-identical to the grobble in socket.c. */
 
-static jmp_buf jump_buffer;
+/* The cache of looked up names.  getaddrinfo() does not say how long its
+answers are good for, so they are kept for a fixed time, and then for as long
+again while a fresh lookup runs in the background, so that a working server
+never has to wait for the DNS.  Failures are not kept.  A slot whose lookup is
+still running belongs to its thread, and is never reused until it finishes, so
+a query that gives up on a slow name server leaves the answer for the next. */
 
-static void jump_handler (int sig) {
-    longjmp(jump_buffer,1);
+#define RESOLVE_SLOTS      32          /* Names remembered */
+#define RESOLVE_NAME      256          /* Longest name plus one */
+
+typedef struct RESOLVE_ENTRY {
+    char name[RESOLVE_NAME];           /* Empty for an unused slot */
+    struct sockaddr_storage address;   /* The first answer, without a port */
+    int length, status, error;         /* From getaddrinfo() and errno */
+    int pending;                       /* Set while a thread looks it up */
+    int64_t fetched, used;             /* In monotonic nanoseconds */
+} resolve_entry;
+
+static resolve_entry resolved[RESOLVE_SLOTS];
+static pthread_mutex_t resolve_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t resolve_done;
+static pthread_once_t resolve_once = PTHREAD_ONCE_INIT;
+
+
+
+static void resolve_init (void) {
+
+/* The waits are measured on the monotonic clock, where it exists. */
+
+    pthread_condattr_t attributes;
+
+    pthread_condattr_init(&attributes);
+#ifdef CLOCK_MONOTONIC
+    pthread_condattr_setclock(&attributes,CLOCK_MONOTONIC);
+#endif
+    pthread_cond_init(&resolve_done,&attributes);
+    pthread_condattr_destroy(&attributes);
 }
 
-static int clear_alarm (void) {
-    int k;
 
-    k = errno;
-    alarm(0);
+
+static void *resolve_worker (void *argument) {
+
+/* Look up the name in one slot of the cache, in its own thread. */
+
+    resolve_entry *entry = argument;
+    struct addrinfo hints, *found = NULL;
+    char name[RESOLVE_NAME];
+    int64_t now;
+    int status, error;
+
+    pthread_mutex_lock(&resolve_lock);
+    memcpy(name,entry->name,sizeof(name));
+    pthread_mutex_unlock(&resolve_lock);
+
+    memset(&hints,0,sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
     errno = 0;
-    if (signal(SIGALRM,SIG_DFL) == SIG_ERR) {
-        fatal(errno,"unable to reset signal handler",NULL);
-        return errno;
+    status = getaddrinfo(name,NULL,&hints,&found);
+    error = errno;
+
+/* A failed refresh leaves the old answer to be used until it runs out. */
+
+    pthread_mutex_lock(&resolve_lock);
+    now = monotonic_nanos();
+    if (status != 0 && entry->status == 0 &&
+            now-entry->fetched < (int64_t)libmsntp_dns_ttl*2000000000) {
+        entry->pending = 0;
+        pthread_cond_broadcast(&resolve_done);
+        pthread_mutex_unlock(&resolve_lock);
+        return NULL;
     }
-    errno = k;
-
-    return 0;
+    entry->status = status;
+    entry->error = error;
+    if (status == 0 && found->ai_addrlen > sizeof(entry->address))
+        entry->status = EAI_FAMILY;
+    else if (status == 0) {
+        memset(&entry->address,0,sizeof(entry->address));
+        memcpy(&entry->address,found->ai_addr,found->ai_addrlen);
+        entry->length = (int)found->ai_addrlen;
+    }
+    entry->fetched = now;
+    entry->pending = 0;
+    pthread_cond_broadcast(&resolve_done);
+    pthread_mutex_unlock(&resolve_lock);
+    if (found != NULL) freeaddrinfo(found);
+    return NULL;
 }
 
 
 
-int find_address (struct in_addr *address, struct in_addr *anywhere,
-    struct in_addr *everywhere, int *port, char *hostname, int timespan) {
+static int resolve_start (resolve_entry *entry) {
 
-/* Locate the specified NTP server and return its Internet address and port 
-number. */
+/* Start a thread to look up the name in a slot, with the lock held. */
 
-    unsigned long ipaddr;
-    struct in_addr nowhere[1];
-    struct hostent *host;
-    struct servent *service;
+    pthread_attr_t attributes;
+    pthread_t thread;
+    int ret;
 
-/* Set up the reserved Internet addresses, attempting not to assume that
-addresses are 32 bits. */
+    pthread_attr_init(&attributes);
+    pthread_attr_setdetachstate(&attributes,PTHREAD_CREATE_DETACHED);
+    entry->pending = 1;
+    if ((ret = pthread_create(&thread,&attributes,resolve_worker,entry)) != 0)
+        entry->pending = 0;
+    pthread_attr_destroy(&attributes);
+    return ret;
+}
 
-    local_to_address(nowhere,INADDR_LOOPBACK);
-    local_to_address(anywhere,INADDR_ANY);
-    local_to_address(everywhere,INADDR_BROADCAST);
 
-/* In libmsntp, as opposed to msntp, the caller specifies the port. Therefore,
-we don't look it up with getservbyname() or default to NTP port 123. The
-msntp_port global var is set by the libmsntp wrapper functions. */
 
-    *port = htons((unsigned short)libmsntp_port);
+static int resolve_name (const char *hostname, struct sockaddr_storage *address,
+    int *length, int timespan) {
 
-/* Check the address, if any.  This assumes that the DNS is reliable, or is at
-least checked by someone else.  But it doesn't assume that it is accessible, so
-it needs to set up a timeout. */
+/* Find the address for a name, from the cache if possible and otherwise by
+waiting up to timespan milliseconds for a lookup.  A negative timespan means
+not to wait at all, but to take any good answer there is, however old, while a
+new one is looked up.  This returns 0 or an error, like find_address(). */
 
-    if (hostname == NULL)
-        *address = *anywhere;
-    else {
-        if (setjmp(jump_buffer)) {
-            fatal(EMSNTP_INTERNAL,
-                  "unable to set up access to NTP server %s",hostname);
+    resolve_entry *entry = NULL, *spare = NULL;
+    struct timespec deadline;
+    int64_t now, ttl = (int64_t)libmsntp_dns_ttl*1000000000, limit;
+    int k, ret = 0;
+
+    if (strlen(hostname) >= RESOLVE_NAME) {
+        fatal(EMSNTP_IP_ADDRESS,"host name too long",NULL);
+        return EMSNTP_IP_ADDRESS;
+    }
+    pthread_once(&resolve_once,resolve_init);
+    limit = monotonic_nanos()+(int64_t)timespan*1000000;
+    deadline.tv_sec = (time_t)(limit/1000000000);
+    deadline.tv_nsec = (long)(limit%1000000000);
+    pthread_mutex_lock(&resolve_lock);
+
+/* Find the name, or the slot to put it in: an unused one or else the one used
+least recently.  This starts again if the slot is taken over for another name
+while waiting, which it can be once the lookup has finished. */
+
+again:
+    now = monotonic_nanos();
+    entry = spare = NULL;
+    for (k = 0; k < RESOLVE_SLOTS && entry == NULL; ++k)
+        if (strcmp(resolved[k].name,hostname) == 0)
+            entry = &resolved[k];
+        else if (! resolved[k].pending && (spare == NULL ||
+                resolved[k].name[0] == 0 ||
+                (spare->name[0] != 0 && resolved[k].used < spare->used)))
+            spare = &resolved[k];
+    if (entry == NULL) {
+        if (spare == NULL) {
+            pthread_mutex_unlock(&resolve_lock);
+            fatal(EMSNTP_INTERNAL,"too many host name lookups in progress",
+                NULL);
             return EMSNTP_INTERNAL;
         }
-        errno = 0;
-        if (signal(SIGALRM,jump_handler) == SIG_ERR) {
-            fatal(errno,"unable to set up signal handler",NULL);
-            return errno;
+        entry = spare;
+        strcpy(entry->name,hostname);
+        entry->status = EAI_AGAIN;
+        entry->fetched = now-2*ttl-1;
+    }
+    entry->used = now;
+
+/* Use a good answer if it is fresh enough, refreshing it if it is getting old,
+and otherwise wait for a new one. */
+
+    if (entry->status == 0 && (now-entry->fetched < 2*ttl || timespan < 0)) {
+        if (now-entry->fetched >= ttl && ! entry->pending)
+            resolve_start(entry);
+    } else {
+        if (! entry->pending && (ret = resolve_start(entry)) != 0) {
+            pthread_mutex_unlock(&resolve_lock);
+            fatal(ret,"unable to start host name lookup",NULL);
+            return ret;
         }
-        alarm((unsigned int)timespan);
-
-/* Look up the Internet name or IP number. */
-
-        if (! isdigit(hostname[0])) {
-            errno = 0;
-            host = gethostbyname(hostname);
-        } else {
-            if ((ipaddr = inet_addr(hostname)) == (unsigned long)-1) {
-                fatal(EMSNTP_IP_ADDRESS,"invalid IP number %s",hostname);
-                return EMSNTP_IP_ADDRESS;
-            }
-            network_to_address(address,ipaddr);
-            errno = 0;
-            host = gethostbyaddr((void *)address,sizeof(struct in_addr),
-                AF_INET);
+        while (entry->pending && ret != ETIMEDOUT &&
+                strcmp(entry->name,hostname) == 0)
+            ret = pthread_cond_timedwait(&resolve_done,&resolve_lock,&deadline);
+        if (strcmp(entry->name,hostname) != 0 && ret != ETIMEDOUT)
+            goto again;
+        if (entry->pending || strcmp(entry->name,hostname) != 0) {
+            pthread_mutex_unlock(&resolve_lock);
+            fatal(EMSNTP_IP_ADDRESS,"timed out looking up host name",NULL);
+            return EMSNTP_IP_ADDRESS;
         }
+    }
+
+/* Copy out the answer, or the reason that there isn't one. */
+
+    if ((ret = entry->status) == 0) {
+        memcpy(address,&entry->address,sizeof(*address));
+        *length = entry->length;
+    } else
+        k = entry->error;
+    pthread_mutex_unlock(&resolve_lock);
+    if (ret == EAI_SYSTEM) {
+        fatal(k,"unable to locate IP address/number",NULL);
+        return k;
+    } else if (ret == EAI_FAMILY) {
+        fatal(EMSNTP_AF_INET,
+              "the address does not seem to be an Internet one",NULL);
+        return EMSNTP_AF_INET;
+    } else if (ret != 0) {
+        fatal(EMSNTP_IP_ADDRESS,gai_strerror(ret),NULL);
+        return EMSNTP_IP_ADDRESS;
+    }
+    return 0;
+}
 
-/* Now clear the timer and check the result. */
 
-        clear_alarm();
-        if (host == NULL) {
-            fatal(errno,"unable to locate IP address/number",NULL);
-            return errno;
-        }
-        if (host->h_length != sizeof(struct in_addr)) {
-            fatal(EMSNTP_AF_INET,
-                  "the address does not seem to be an Internet one",NULL);
-            return EMSNTP_AF_INET;
-        }
-        *address = *((struct in_addr **)host->h_addr_list)[0];
+
+int wildcard_address (struct sockaddr_storage *address, int *length,
+    int family, int port, int broadcast) {
+
+/* Set up the address to listen on for the given family, or the IPv4 broadcast
+address, with the given port (in host format). */
+
+    struct sockaddr_in *in4 = (struct sockaddr_in *)address;
+    struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)address;
+
+    memset(address,0,sizeof(*address));
+    if (family == AF_INET6 && ! broadcast) {
+        in6->sin6_family = AF_INET6;
+        in6->sin6_port = htons((unsigned short)port);
+        in6->sin6_addr = in6addr_any;
+        *length = sizeof(struct sockaddr_in6);
+    } else {
+        in4->sin_family = AF_INET;
+        in4->sin_port = htons((unsigned short)port);
+        in4->sin_addr.s_addr = htonl(broadcast ? INADDR_BROADCAST : INADDR_ANY);
+        *length = sizeof(struct sockaddr_in);
+    }
+    return 0;
+}
+
+
+
+int find_address (struct sockaddr_storage *address, int *length,
+    char *hostname, int port, int timespan) {
+
+/* Locate the specified NTP server and return its Internet address and port
+number, for either version of IP.  Without a hostname, this is the wildcard
+address that servers listen on. */
+
+    struct addrinfo hints, *found;
+    char text[INET6_ADDRSTRLEN];
+    int ret;
+
+/* In libmsntp, as opposed to msntp, the caller specifies the port. Therefore,
+we don't look it up with getservbyname() or default to NTP port 123.  It comes
+from the libmsntp wrapper functions, usually by way of libmsntp_port. */
+
+    if (hostname == NULL)
+        return wildcard_address(address,length,AF_INET6,port,0);
+
+/* Numeric addresses of either version need no lookup at all, and are handled
+at once.  Anything else goes through the cache.  This assumes that the DNS is
+reliable, or is at least checked by someone else.  But it doesn't assume that
+it is accessible, and waits no longer than timespan milliseconds for it, or not
+at all if timespan is negative (see resolve_name()). */
+
+    memset(&hints,0,sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = AI_NUMERICHOST;
+    if ((ret = getaddrinfo(hostname,NULL,&hints,&found)) == EAI_NONAME) {
+        if (ret = resolve_name(hostname,address,length,timespan))
+            return ret;
+    } else if (ret != 0) {
+        fatal(EMSNTP_IP_ADDRESS,gai_strerror(ret),NULL);
+        return EMSNTP_IP_ADDRESS;
+    } else if (found->ai_addrlen > sizeof(*address)) {
+        freeaddrinfo(found);
+        fatal(EMSNTP_AF_INET,
+              "the address does not seem to be an Internet one",NULL);
+        return EMSNTP_AF_INET;
+    } else {
+        memset(address,0,sizeof(*address));
+        memcpy(address,found->ai_addr,found->ai_addrlen);
+        *length = (int)found->ai_addrlen;
+        freeaddrinfo(found);
+    }
+    if (address->ss_family != AF_INET && address->ss_family != AF_INET6) {
+        fatal(EMSNTP_AF_INET,
+              "the address does not seem to be an Internet one",NULL);
+        return EMSNTP_AF_INET;
+    }
+    if (address->ss_family == AF_INET6)
+        ((struct sockaddr_in6 *)address)->sin6_port =
+            htons((unsigned short)port);
+    else
+        ((struct sockaddr_in *)address)->sin_port =
+            htons((unsigned short)port);
 
 /* Note that in libmsntp, "reserved" IP addresses such as 127.0.0.1 are
 allowed, for greater flexibility. */
 
-        if (verbose)
-            fprintf(stderr,
-                "%s: using NTP server %s (%s) port %d\n",
-                argv0,host->h_name,inet_ntoa(*address), ntohs(*port));
-    }
+    if (verbose)
+        fprintf(stderr,"%s: using NTP server %s (%s) port %d\n",
+            argv0,hostname,
+            (inet_ntop(address->ss_family,(address->ss_family == AF_INET6 ?
+                (void *)&((struct sockaddr_in6 *)address)->sin6_addr :
+                (void *)&((struct sockaddr_in *)address)->sin_addr),
+                text,sizeof(text)) != NULL ? text : "?"),
+            port);
 
     return 0;
 }
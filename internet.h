@@ -2,17 +2,12 @@
     Copyright (C) 1996 The University of Cambridge
 
 This includes all of the 'Internet' headers and definitions used across
-modules, including those for handling timeouts.  No changes should be needed
-for any version of Unix with Internet (IP version 5) addressing, but would be
-for other addressing domains.  It needs <sys/socket.h> only because AF_INET is
-needed by gethostbyaddr and is defined there rather than in <netdb.h>, for some
-damn-fool reason. */
+modules.  Addresses are kept in a struct sockaddr_storage, so that the same
+code handles IP versions 4 and 6, and only internet.c and socket.c need to know
+which is which. */
 
 
 
-#include <setjmp.h>
-#include <signal.h>
-
 #include <unistd.h>
 #include <sys/types.h>
 #include <netinet/in.h>
@@ -20,13 +15,8 @@ damn-fool reason. */
 
 
 
-/* It is most unclear whether these should be here or in kludges.h, as they are
-kludges to keep 32-bit address dependencies out of the main body of internet.c,
-to allow for the much heralded arrival of IP version 6.  It will be interesting
-to see whether the universal availability of 64-bit integers arrives first. */
-
-#define local_to_address(x,y) ((x)->s_addr = htonl((unsigned long)y))
-#define network_to_address(x,y) ((x)->s_addr = (y))
+/* The much heralded arrival of IP version 6 happened after all, but slightly
+later than the universal availability of 64-bit integers. */
 
 #define NTP_PORT htons((unsigned short)123)    /* If not in /etc/services */
 #define port_to_integer(x) (ntohs((unsigned short)(x)))
@@ -35,5 +25,23 @@ to see whether the universal availability of 64-bit integers arrives first. */
 
 /* Defined in internet.c */
 
-extern int find_address (struct in_addr *address, struct in_addr *anywhere,
-    struct in_addr *everwhere, int *port, char *hostname, int timespan);
+extern int find_address (struct sockaddr_storage *address, int *length,
+    char *hostname, int port, int timespan);
+
+extern int wildcard_address (struct sockaddr_storage *address, int *length,
+    int family, int port, int broadcast);
+
+
+
+/* Defined in socket.c */
+
+extern ntp_stamp arrival_stamp (struct msghdr *message);
+
+extern int address_size (const struct sockaddr_storage *address);
+
+extern int client_stamping (int descriptor);
+
+extern void collect_departures (int descriptor, unsigned long first,
+    unsigned long last, ntp_stamp *departures, int size);
+
+extern uint64_t address_key (const struct sockaddr_storage *address);
@@ -60,3 +60,62 @@ it is defined.  The differences are not relevant to this program. */
 #ifndef EWOULDBLOCK
 #define EWOULDBLOCK        EAGAIN
 #endif
+
+
+
+/* recvmmsg and sendmmsg are Linux extensions, so the batched server code falls
+back to one system call per packet elsewhere.  This can also be forced with a
+flag setting in Makefile. */
+
+#if !defined(__linux__) && !defined(MMSG_MISSING)
+#define MMSG_MISSING
+#endif
+
+
+
+/* Similarly, io_uring exists only on Linux, and needs <linux/io_uring.h> from
+5.19 or later.  Add -DURING_MISSING in Makefile for older Linux headers. */
+
+#if !defined(__linux__) && !defined(URING_MISSING)
+#define URING_MISSING
+#endif
+
+
+
+/* be64toh and htobe64 come from <endian.h>, which is in glibc and the BSDs but
+not POSIX.  Elsewhere, set -DENDIAN_MISSING in Makefile and the packet code
+will use shifts instead. */
+
+#if !defined(__linux__) && !defined(ENDIAN_MISSING)
+#define ENDIAN_MISSING
+#endif
+
+
+
+/* Kernel transmit and receive timestamps for clients use SO_TIMESTAMPING and
+the error queue, which are Linux-specific.  Without them, or with
+-DTIMESTAMPING_MISSING in Makefile, clients read the clock themselves. */
+
+#if !defined(__linux__) && !defined(TIMESTAMPING_MISSING)
+#define TIMESTAMPING_MISSING
+#endif
+
+
+
+/* SO_BUSY_POLL and its friends are Linux-specific too.  Elsewhere, or with
+-DBUSY_POLL_MISSING in Makefile, busy-polling servers just spin on their
+sockets. */
+
+#if !defined(__linux__) && !defined(BUSY_POLL_MISSING)
+#define BUSY_POLL_MISSING
+#endif
+
+
+
+/* The vector packet code in codec.c uses GCC's target attributes and x86-64
+intrinsics.  Anything else uses the plain C code, which can also be forced with
+-DSIMD_MISSING in Makefile. */
+
+#if !(defined(__x86_64__) && defined(__GNUC__)) && !defined(SIMD_MISSING)
+#define SIMD_MISSING
+#endif
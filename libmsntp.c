@@ -13,10 +13,22 @@
  * libmsntp.a. For more information on building libmsntp, see the README file.
  */
 
+#define _GNU_SOURCE                    /* For pthread_setaffinity_np */
+
 #include "libmsntp.h"
 #include "header.h"
 
 #include <sys/time.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+#include <poll.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <unistd.h>
 #include <limits.h>
 #include <stdio.h>
 #include <string.h>
@@ -27,16 +39,61 @@ extern int errno;
 
 
 /* defined in main.c */
-extern int operation, verbose, action, period, count, delay, waiting;
+extern int operation, verbose, action, period, count, samples, delay, waiting;
 extern double minerr, maxerr, prompt, dispersion;
 
+extern FILE *savefile;
+
 extern int run_client(char *hostnames[], int nhosts, double *offset);
+extern int run_daemon(char *hostnames[], int nhosts, int initial);
+extern double reset_clock(double offset, double error, int daemon);
+extern void publish_stats(double when, double offset, double error,
+                          double drift, double drifterr);
 extern int run_server();
+extern int run_server_batch(int which, int max, int timeout);
 
 /* globals */
 int libmsntp_port;  /* used by internet.c; not assumed to be 16 bits */
-int libmsntp_errno;
-const char *libmsntp_strerror;
+int libmsntp_reuseport;  /* used by socket.c; one server socket per thread */
+int libmsntp_backend = MSNTP_BACKEND_CLASSIC;  /* used by socket.c */
+double libmsntp_rate = 0.0;  /* used by limit.c; 0 for no rate limit */
+double libmsntp_burst = 0.0;
+int libmsntp_rate_response = MSNTP_RATE_DROP;
+int libmsntp_eviction = MSNTP_EVICT_OLDEST;
+int libmsntp_rate_slots = 0;
+int libmsntp_busy_poll = 0;  /* used by socket.c; spin budget in us, or 0 */
+int libmsntp_busy_cpu = -1;  /* CPU for busy-polling servers, -1 for any */
+int libmsntp_dns_ttl = 300;  /* used by internet.c; seconds to cache names */
+int libmsntp_pipeline = 0;  /* used by main.c; clients send bursts */
+int libmsntp_spacing = 0;  /* microseconds between the requests in a burst */
+int libmsntp_timeout = 15000;  /* used by main.c; milliseconds for each call */
+int libmsntp_wait = 3000;  /* milliseconds to wait for each reply */
+int libmsntp_hedging = 0;  /* used by main.c; clients resend slow requests */
+THREAD_LOCAL int libmsntp_errno;  /* the calling thread's last error */
+THREAD_LOCAL const char *libmsntp_strerror;
+
+/* server worker threads, one per socket, started by msntp_start_server_mt */
+static pthread_t workers[MAX_SOCKETS];
+static int nworkers = 0;
+static int worker_errors[MAX_SOCKETS];
+static const char *worker_messages[MAX_SOCKETS];
+
+/* wakes servers sleeping in poll when they should stop: an eventfd on Linux,
+ * otherwise the two ends of a pipe. it stays readable once signalled. */
+static int stop_descriptors[2] = { -1, -1 };
+static volatile sig_atomic_t server_stopping = 0;  /* for spinning servers */
+
+/* the epoll instance used by msntp_serve_epoll, created on first use */
+static int epoll_descriptor = -1;
+
+/* the daemon thread started by msntp_daemon_start, its own copies of the
+ * server names, and the error that stopped it, if any */
+static pthread_t daemon_thread;
+static int daemon_running = 0;
+static char *daemon_hosts[MAX_SOCKETS];
+static int daemon_nhosts = 0;
+static int daemon_error = 0;
+static const char *daemon_message = NULL;
 
 
 /* helper functions */
@@ -53,26 +110,358 @@ void setup(char *hostname, int port) {
     minerr = 0.1;
     maxerr = 5.0;
     count = 5;
-    delay = 15;
-    waiting = delay / count;
+    /* the clients use the milliseconds, and the rest these, rounded up */
+    delay = (libmsntp_timeout + 999) / 1000;
+    waiting = (libmsntp_wait + 999) / 1000;
     prompt = (double)INT_MAX;
     verbose = 0;
 }
 
 /**
  * Takes a double parameter representing seconds since the epoch and returns
- * the corresponding timeval. The parameter may have a fractional part.
+ * the corresponding timeval. The parameter may have a fractional part, and
+ * may be negative, in which case tv_sec is negative and tv_usec is not.
  */
 struct timeval convert_timeval(double value) {
     struct timeval tv;
-    int millisecs;
+    struct timespec ts;
 
-    tv.tv_sec = convert_time(value, &millisecs);
-    tv.tv_usec = millisecs;
+    split_nanos(convert_nanos(value), &ts);
+    tv.tv_sec = ts.tv_sec;
+    tv.tv_usec = ts.tv_nsec / 1000;
     return tv;
 }
 
 
+/**
+ * Creates the descriptor that msntp_stop_serving and msntp_stop_server signal
+ * to wake up sleeping servers, if it doesn't exist yet, and clears it.
+ */
+int open_stop() {
+    char drain[8];
+
+    server_stopping = 0;
+    if (stop_descriptors[0] >= 0) {
+        while (read(stop_descriptors[0], drain, sizeof(drain)) > 0)
+            ;
+        return 0;
+    }
+
+    errno = 0;
+#ifdef __linux__
+    stop_descriptors[0] = stop_descriptors[1] =
+        eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (stop_descriptors[0] < 0) {
+#else
+    if (pipe(stop_descriptors) < 0 ||
+            fcntl(stop_descriptors[0], F_SETFL, O_NONBLOCK) < 0 ||
+            fcntl(stop_descriptors[1], F_SETFL, O_NONBLOCK) < 0) {
+#endif
+        fatal(errno, "unable to create server stop descriptor", NULL);
+        return errno;
+    }
+    return 0;
+}
+
+/**
+ * Wakes up every server thread sleeping in wait_for_requests, now and until
+ * open_stop is called again.
+ */
+void signal_stop() {
+    uint64_t one = 1;
+
+    server_stopping = 1;
+    if (stop_descriptors[1] >= 0)
+        while (write(stop_descriptors[1], &one, sizeof(one)) < 0 &&
+               errno == EINTR)
+            ;
+}
+
+/**
+ * Closes the stop descriptor.
+ */
+void close_stop() {
+    if (stop_descriptors[0] >= 0) {
+        if (stop_descriptors[1] != stop_descriptors[0])
+            close(stop_descriptors[1]);
+        close(stop_descriptors[0]);
+    }
+    stop_descriptors[0] = stop_descriptors[1] = -1;
+}
+
+/**
+ * Sleeps in the kernel for up to timeout_ms milliseconds, or indefinitely if
+ * it is negative, until server socket which has requests waiting or the stop
+ * descriptor is signalled. Returns 1 if there are requests, 0 if it timed out
+ * or was interrupted, -1 if the server should stop, or an errno value.
+ */
+int wait_for_requests(int which, int timeout_ms) {
+    struct pollfd fds[2];
+    int ret;
+
+    fds[0].fd = socket_descriptor(which);
+    fds[0].events = POLLIN;
+    fds[1].fd = stop_descriptors[0];
+    fds[1].events = POLLIN;
+    fds[0].revents = fds[1].revents = 0;
+
+    errno = 0;
+    ret = poll(fds, 2, timeout_ms);
+    if (ret < 0 && errno != EINTR) {
+        fatal(errno, "poll failed", NULL);
+        return errno;
+    } else if (ret <= 0) {
+        return 0;
+    } else if (fds[1].revents) {
+        return -1;
+    } else if (fds[0].revents & (POLLERR | POLLNVAL)) {
+        fatal(EMSNTP_INTERNAL, "server socket is not usable", NULL);
+        return EMSNTP_INTERNAL;
+    }
+    return 1;
+}
+
+/**
+ * Pins the calling thread to the given CPU, counting modulo the number of
+ * online CPUs. Does nothing where that isn't supported.
+ */
+void pin_thread(int cpu) {
+#ifdef __linux__
+    cpu_set_t cpus;
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (ncpus > 0) {
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu % ncpus, &cpus);
+        pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    }
+#endif
+}
+
+/**
+ * Spins on server socket which for busy-poll mode, handling requests as soon
+ * as they arrive, until the spin budget passes without any or the server is
+ * stopped. A negative budget spins until it is stopped. Returns 0 when the
+ * budget runs out, -1 if the server should stop, or an error.
+ */
+int spin_for_requests(int which) {
+    int64_t budget = (int64_t)libmsntp_busy_poll * 1000, idle;
+    int ret;
+
+    idle = current_nanos();
+    while (!server_stopping) {
+        if ((ret = run_server_batch(which, BATCH_MAX, -1)) == 0)
+            idle = current_nanos();
+        else if (ret != -1)
+            return ret;
+        else if (budget >= 0 && current_nanos() - idle >= budget)
+            return 0;
+    }
+    return -1;
+}
+
+/**
+ * Serves requests on server socket which until the server is stopped or an
+ * error occurs. It handles everything that is queued, then either spins for
+ * more, in busy-poll mode, or sleeps in the kernel until some arrive. Returns
+ * -1 once it has been stopped, or an error.
+ */
+int serve_loop(int which) {
+    int ret;
+
+    while (1) {
+        if (libmsntp_busy_poll != 0) {
+            if ((ret = spin_for_requests(which)) != 0)
+                return ret;
+        } else {
+            while ((ret = run_server_batch(which, BATCH_MAX, -1)) == 0)
+                ;
+            if (ret != -1)
+                return ret;
+        }
+        if ((ret = wait_for_requests(which, -1)) < 0 || ret > 1)
+            return ret;
+    }
+}
+
+/**
+ * The body of each server worker thread. Serves requests on its own socket,
+ * pinned to its own CPU, until msntp_stop_server is called or a fatal error
+ * occurs, which is kept, with its message, for msntp_stop_server to return.
+ */
+void *serve_worker(void *arg) {
+    int which = (int)(long)arg;
+    int ret;
+
+    pin_thread((libmsntp_busy_cpu >= 0 ? libmsntp_busy_cpu : 0) + which);
+    if ((ret = serve_loop(which)) != -1) {
+        worker_errors[which] = ret;
+        worker_messages[which] = libmsntp_strerror;
+    }
+    return NULL;
+}
+
+
+/**
+ * Queries several servers at once, with the settings in ctx or the globals if
+ * it is NULL, and converts the results for msntp_get_offset_multi.
+ */
+int sample_multi(struct msntp_ctx *ctx, char *hostnames[], int n, int port,
+                 struct timespec *offset, double *error,
+                 struct timespec *offsets, double *errors, int *results) {
+    int ret, i, status[MAX_SOCKETS];
+    double offset_d, error_d, offsets_d[MAX_SOCKETS];
+
+    ret = sample_servers(ctx, hostnames, n, port, query_deadline(ctx),
+                         offsets_d, errors, status, &offset_d, &error_d);
+    for (i = 0; i < n; i++) {
+        if (offsets && status[i] == 0)
+            split_nanos(convert_nanos(offsets_d[i]), &offsets[i]);
+        if (results)
+            results[i] = status[i];
+    }
+    if (ret)
+        return ret;
+    split_nanos(convert_nanos(offset_d), offset);
+    if (error)
+        *error = error_d;
+    return 0;
+}
+
+/**
+ * Fills in a context with the same settings as setup() and no error.
+ */
+void default_ctx(struct msntp_ctx *ctx) {
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->minerr = 0.1;
+    ctx->count = 5;
+    ctx->delay = 15000;
+    ctx->waiting = ctx->delay / ctx->count;
+}
+
+/**
+ * Records the result of a reentrant function in its context, as well as in
+ * the thread's error, and returns it.
+ */
+int ctx_result(struct msntp_ctx *ctx, int ret) {
+    ctx->error = ret;
+    ctx->message = (ret ? libmsntp_strerror : NULL);
+    return ret;
+}
+
+/**
+ * The reentrant equivalent of run_client, for one server. It uses the
+ * query code, which keeps all of its state in the query and the context.
+ */
+int run_client_r(struct msntp_ctx *ctx, char *hostname, int port,
+                 double *offset) {
+    double error;
+
+    assert(ctx && hostname && strlen(hostname) > 0);
+    return sample_servers(ctx, &hostname, 1, port, query_deadline(ctx), NULL,
+                          NULL, NULL, offset, &error);
+}
+
+/**
+ * Runs an exchange with one server that must be over within budget_ms
+ * milliseconds, lookup and all, with the settings in ctx, which it changes.
+ * No reply is waited for longer than a count'th of the budget, so that there
+ * is time to try again after a lost packet.
+ */
+int run_budget(struct msntp_ctx *ctx, char *hostname, int port, int budget_ms,
+               struct timespec *offset, double *error) {
+    int ret;
+    double offset_d, error_d;
+
+    assert(hostname && strlen(hostname) > 0);
+    if (budget_ms <= 0) {
+        fatal(EMSNTP_INTERNAL, "time budget out of range", NULL);
+        return EMSNTP_INTERNAL;
+    }
+    ctx->delay = budget_ms;
+    if (ctx->waiting > budget_ms / ctx->count)
+        ctx->waiting = (budget_ms >= ctx->count ? budget_ms / ctx->count : 1);
+    if (ret = sample_servers(ctx, &hostname, 1, port, query_deadline(ctx),
+                             NULL, NULL, NULL, &offset_d, &error_d))
+        return ret;
+    split_nanos(convert_nanos(offset_d), offset);
+    if (error)
+        *error = error_d;
+    return 0;
+}
+
+/**
+ * The daemon's first synchronization, which is like NTP's iburst: all of the
+ * servers are asked at once, in burst mode, and the result is used as the
+ * daemon would use its first estimate, before there is any drift to go on.
+ */
+int first_sync(char *hostnames[], int n, int port) {
+    struct msntp_ctx ctx;
+    int ret;
+    double offset, error;
+
+    default_ctx(&ctx);
+    ctx.count = count;
+    ctx.minerr = minerr;
+    ctx.delay = libmsntp_timeout;
+    ctx.waiting = libmsntp_wait;
+    ctx.burst = 1;
+    ctx.spacing = libmsntp_spacing;
+    ctx.hedging = libmsntp_hedging;
+    if (ret = sample_servers(&ctx, hostnames, n, port, query_deadline(&ctx),
+                             NULL, NULL, NULL, &offset, &error))
+        return ret;
+
+    /* reset_clock reports a failure to change the clock only through fatal */
+    if (changes_clock(action)) {
+        libmsntp_errno = 0;
+        offset -= reset_clock(offset, error, 1);
+        if (libmsntp_errno)
+            return libmsntp_errno;
+    }
+    publish_stats(current_time(JAN_1970), offset, error, 0.0, -1.0);
+    return 0;
+}
+
+/**
+ * The body of the daemon thread. Runs the daemon until msntp_daemon_stop
+ * wakes it up or it fails, starting it afresh whenever it gives up on its
+ * estimates, as the msntp program does. An error is kept for
+ * msntp_daemon_stop to return, and readers told that there is no estimate.
+ */
+void *daemon_worker(void *arg) {
+    int ret;
+
+    if ((ret = run_daemon(daemon_hosts, daemon_nhosts, 1)) == 0)
+        while ((ret = run_daemon(daemon_hosts, daemon_nhosts, 0)) == 0)
+            ;
+    if (ret != -1) {
+        daemon_error = ret;
+        daemon_message = libmsntp_strerror;
+        shm_publish(0, 0.0, 0.0, 0.0, 0.0, 0.0);
+    }
+    return NULL;
+}
+
+/**
+ * Releases everything that msntp_daemon_start set up for the daemon thread,
+ * once it has finished or if it couldn't be started.
+ */
+void close_daemon() {
+    int i;
+
+    for (i = 0; i < daemon_nhosts; ++i) {
+        close_socket(i);
+        free(daemon_hosts[i]);
+    }
+    daemon_nhosts = 0;
+    if (savefile != NULL)
+        fclose(savefile);
+    savefile = NULL;
+    set_waking(0);
+}
+
+
 /* public functions */
 int msntp_set_clock(char *hostname, int port) {
     int ret;
@@ -112,10 +501,500 @@ int msntp_get_time(char *hostname, int port, struct timeval *server_time) {
     return 0;
 }
 
+int msntp_get_offset_ns(char *hostname, int port, struct timespec *offset) {
+    int ret;
+    double offset_d;
+
+    setup(hostname, port);
+    operation = op_client;
+
+    if (ret = run_client(&hostname, 1, &offset_d))
+        return ret;
+    split_nanos(convert_nanos(offset_d), offset);
+    return 0;
+}
+
+int msntp_get_time_ts(char *hostname, int port, struct timespec *server_time) {
+    int ret;
+    double offset;
+
+    setup(hostname, port);
+    operation = op_client;
+
+    if (ret = run_client(&hostname, 1, &offset))
+        return ret;
+    /* in integer nanoseconds, since a double has only about 0.1us to spare */
+    split_nanos(current_nanos() + convert_nanos(offset), server_time);
+    return 0;
+}
+
+int msntp_get_offset_multi(char *hostnames[], int n, int port,
+                           struct timespec *offset, double *error,
+                           struct timespec *offsets, double *errors,
+                           int *results) {
+    assert(hostnames && n > 0 && n <= MAX_SOCKETS);
+    setup(hostnames[0], port);
+    operation = op_client;
+
+    return sample_multi(NULL, hostnames, n, port, offset, error, offsets,
+                        errors, results);
+}
+
+int msntp_get_offset_deadline(char *hostname, int port, int budget_ms,
+                              struct timespec *offset, double *error) {
+    struct msntp_ctx ctx;
+
+    assert(hostname && strlen(hostname) > 0);
+    setup(hostname, port);
+    default_ctx(&ctx);
+    ctx.waiting = libmsntp_wait;
+    ctx.burst = libmsntp_pipeline;
+    ctx.spacing = libmsntp_spacing;
+    ctx.hedging = libmsntp_hedging;
+    return run_budget(&ctx, hostname, port, budget_ms, offset, error);
+}
+
+int msntp_query_begin(char *hostname, int port, struct msntp_query **query,
+                      int *fd) {
+    int ret;
+
+    setup(hostname, port);
+    operation = op_client;
+
+    ret = open_query(query, hostname, port, NULL, query_deadline(NULL));
+    if (*query)
+        *fd = query_descriptor(*query);
+    return ret;
+}
+
+int msntp_query_on_readable(struct msntp_query *query) {
+    return query_readable(query);
+}
+
+int msntp_query_on_timer(struct msntp_query *query) {
+    return query_timer(query);
+}
+
+int msntp_query_timeout(struct msntp_query *query) {
+    return query_timeout(query);
+}
+
+int msntp_query_result(struct msntp_query *query, struct timespec *offset,
+                       double *error) {
+    int ret;
+    double offset_d;
+
+    if ((ret = query_result(query, &offset_d, error)) == 0)
+        split_nanos(convert_nanos(offset_d), offset);
+    return ret;
+}
+
+void msntp_query_end(struct msntp_query *query) {
+    close_query(query);
+}
+
+struct msntp_ctx *msntp_ctx_new(void) {
+    struct msntp_ctx *ctx;
+
+    if ((ctx = malloc(sizeof(*ctx))) == NULL)
+        return NULL;
+    default_ctx(ctx);
+    return ctx;
+}
+
+void msntp_ctx_free(struct msntp_ctx *ctx) {
+    free(ctx);
+}
+
+int msntp_set_burst_r(struct msntp_ctx *ctx, int enable, int spacing_us) {
+    if (spacing_us < 0 || spacing_us >= 1000000) {
+        fatal(EMSNTP_INTERNAL, "burst spacing out of range", NULL);
+        return ctx_result(ctx, EMSNTP_INTERNAL);
+    }
+    ctx->burst = (enable != 0);
+    ctx->spacing = spacing_us;
+    return ctx_result(ctx, 0);
+}
+
+int msntp_set_timeout_r(struct msntp_ctx *ctx, int timeout_ms, int wait_ms) {
+    if (timeout_ms <= 0 || wait_ms <= 0 || wait_ms > timeout_ms) {
+        fatal(EMSNTP_INTERNAL, "bad timeout settings", NULL);
+        return ctx_result(ctx, EMSNTP_INTERNAL);
+    }
+    ctx->delay = timeout_ms;
+    ctx->waiting = wait_ms;
+    return ctx_result(ctx, 0);
+}
+
+int msntp_set_hedging_r(struct msntp_ctx *ctx, int enable) {
+    ctx->hedging = (enable != 0);
+    return ctx_result(ctx, 0);
+}
+
+int msntp_set_clock_r(struct msntp_ctx *ctx, char *hostname, int port) {
+    int ret;
+    double offset;
+
+    if (ret = run_client_r(ctx, hostname, port, &offset))
+        return ctx_result(ctx, ret);
+    return ctx_result(ctx, adjust_time(offset, 1, 0));
+}
+
+int msntp_get_offset_r(struct msntp_ctx *ctx, char *hostname, int port,
+                       struct timeval *offset) {
+    int ret;
+    double offset_d;
+
+    if (ret = run_client_r(ctx, hostname, port, &offset_d))
+        return ctx_result(ctx, ret);
+    *offset = convert_timeval(offset_d);
+    return ctx_result(ctx, 0);
+}
+
+int msntp_get_time_r(struct msntp_ctx *ctx, char *hostname, int port,
+                     struct timeval *server_time) {
+    int ret;
+    double offset;
+
+    if (ret = run_client_r(ctx, hostname, port, &offset))
+        return ctx_result(ctx, ret);
+    *server_time = convert_timeval(current_time(offset));
+    return ctx_result(ctx, 0);
+}
+
+int msntp_get_offset_ns_r(struct msntp_ctx *ctx, char *hostname, int port,
+                          struct timespec *offset) {
+    int ret;
+    double offset_d;
+
+    if (ret = run_client_r(ctx, hostname, port, &offset_d))
+        return ctx_result(ctx, ret);
+    split_nanos(convert_nanos(offset_d), offset);
+    return ctx_result(ctx, 0);
+}
+
+int msntp_get_time_ts_r(struct msntp_ctx *ctx, char *hostname, int port,
+                        struct timespec *server_time) {
+    int ret;
+    double offset;
+
+    if (ret = run_client_r(ctx, hostname, port, &offset))
+        return ctx_result(ctx, ret);
+    split_nanos(current_nanos() + convert_nanos(offset), server_time);
+    return ctx_result(ctx, 0);
+}
+
+int msntp_get_offset_multi_r(struct msntp_ctx *ctx, char *hostnames[], int n,
+                             int port, struct timespec *offset, double *error,
+                             struct timespec *offsets, double *errors,
+                             int *results) {
+    assert(ctx && hostnames && n > 0 && n <= MAX_SOCKETS);
+    return ctx_result(ctx, sample_multi(ctx, hostnames, n, port, offset,
+                                        error, offsets, errors, results));
+}
+
+int msntp_get_offset_deadline_r(struct msntp_ctx *ctx, char *hostname,
+                                int port, int budget_ms,
+                                struct timespec *offset, double *error) {
+    struct msntp_ctx copy;
+
+    assert(ctx);
+    copy = *ctx;
+    return ctx_result(ctx, run_budget(&copy, hostname, port, budget_ms,
+                                      offset, error));
+}
+
+int msntp_query_begin_r(struct msntp_ctx *ctx, char *hostname, int port,
+                        struct msntp_query **query, int *fd) {
+    int ret;
+
+    assert(ctx && hostname && strlen(hostname) > 0);
+    ret = open_query(query, hostname, port, ctx, query_deadline(ctx));
+    if (*query)
+        *fd = query_descriptor(*query);
+    return ctx_result(ctx, ret);
+}
+
+int msntp_session_open(char *hostname, int port,
+                       struct msntp_session **session) {
+    struct msntp_ctx ctx;
+
+    assert(hostname && strlen(hostname) > 0);
+    default_ctx(&ctx);
+    return open_session(session, hostname, port, &ctx);
+}
+
+int msntp_session_open_r(struct msntp_ctx *ctx, char *hostname, int port,
+                         struct msntp_session **session) {
+    assert(ctx && hostname && strlen(hostname) > 0);
+    return ctx_result(ctx, open_session(session, hostname, port, ctx));
+}
+
+int msntp_session_get_offset(struct msntp_session *session,
+                             struct timespec *offset, double *error) {
+    int ret;
+    double offset_d, error_d;
+
+    if (ret = session_offset(session, &offset_d, &error_d))
+        return ret;
+    split_nanos(convert_nanos(offset_d), offset);
+    if (error)
+        *error = error_d;
+    return 0;
+}
+
+int msntp_session_query_begin(struct msntp_session *session,
+                              struct msntp_query **query, int *fd) {
+    int ret;
+
+    ret = session_query(query, session);
+    if (*query)
+        *fd = query_descriptor(*query);
+    return ret;
+}
+
+void msntp_session_close(struct msntp_session *session) {
+    close_session(session);
+}
+
+const char *msntp_strerror_r(struct msntp_ctx *ctx) {
+    if (ctx->error < 0) {
+        return ctx->message;
+    } else {
+        return strerror(ctx->error);
+    }
+}
+
+int msntp_set_dns_cache(int ttl_seconds) {
+    if (ttl_seconds < 0) {
+        fatal(EMSNTP_INTERNAL, "negative DNS cache time", NULL);
+        return EMSNTP_INTERNAL;
+    }
+    libmsntp_dns_ttl = ttl_seconds;
+    return 0;
+}
+
+int msntp_set_timeout(int timeout_ms, int wait_ms) {
+    if (timeout_ms <= 0 || wait_ms <= 0 || wait_ms > timeout_ms) {
+        fatal(EMSNTP_INTERNAL, "bad timeout settings", NULL);
+        return EMSNTP_INTERNAL;
+    }
+    libmsntp_timeout = timeout_ms;
+    libmsntp_wait = wait_ms;
+    return 0;
+}
+
+int msntp_set_hedging(int enable) {
+    libmsntp_hedging = (enable != 0);
+    return 0;
+}
+
+int msntp_shm_open(const char *name) {
+    assert(name && strlen(name) > 0);
+    return shm_attach(name);
+}
+
+void msntp_shm_close(void) {
+    shm_detach();
+}
+
+int msntp_daemon_start(char *hostnames[], int n,
+                       const struct msntp_daemon_opts *opts) {
+    struct msntp_daemon_opts settings;
+    int ret;
+
+    assert(hostnames && n > 0);
+    if (opts)
+        settings = *opts;
+    else
+        memset(&settings, 0, sizeof(settings));
+    if (settings.port == 0)
+        settings.port = 123;
+    if (settings.interval == 0)
+        settings.interval = 18000;
+    if (settings.count == 0)
+        settings.count = 5;
+    if (settings.minerr == 0.0)
+        settings.minerr = 0.1;
+    if (settings.maxerr == 0.0)
+        settings.maxerr = 5.0;
+    if (settings.window == 0)
+        settings.window = settings.count;
+    if (daemon_running) {
+        fatal(EMSNTP_INTERNAL, "the daemon is already running", NULL);
+        return EMSNTP_INTERNAL;
+    }
+    if (n > MAX_SOCKETS || settings.count < 5 || settings.count > COUNT_MAX ||
+            settings.minerr < 0.0 || settings.minerr >= settings.maxerr ||
+            settings.maxerr >= settings.interval || settings.window < 5 ||
+            settings.window > WINDOW_MAX ||
+            settings.action < MSNTP_DAEMON_MONITOR ||
+            settings.action > MSNTP_DAEMON_RESET) {
+        fatal(EMSNTP_INTERNAL, "bad daemon settings", NULL);
+        return EMSNTP_INTERNAL;
+    }
+
+    setup(hostnames[0], settings.port);
+    operation = op_client;
+    action = (settings.action == MSNTP_DAEMON_RESET ? action_reset :
+              settings.action == MSNTP_DAEMON_ADJUST ? action_adjust :
+              action_monitor);
+    count = settings.count;
+    samples = settings.window;
+    delay = waiting = settings.interval;
+    minerr = settings.minerr;
+    maxerr = settings.maxerr;
+
+    /* cancelling any adjustment in progress checks that we may make them */
+    if (changes_clock(action) && (ret = adjust_time(0.0, 0, maxerr)))
+        return ret;
+    errno = 0;
+    if (settings.savefile &&
+            (savefile = fopen(settings.savefile, "rb+")) == NULL &&
+            (savefile = fopen(settings.savefile, "wb+")) == NULL) {
+        fatal(errno, "unable to open the daemon save file", NULL);
+        return errno;
+    }
+    if ((ret = first_sync(hostnames, n, settings.port)) ||
+            (ret = set_waking(1))) {
+        close_daemon();
+        return ret;
+    }
+
+    for (daemon_nhosts = 0; daemon_nhosts < n; ++daemon_nhosts) {
+        if ((daemon_hosts[daemon_nhosts] =
+                 strdup(hostnames[daemon_nhosts])) == NULL) {
+            fatal(ENOMEM, "out of memory", NULL);
+            close_daemon();
+            return ENOMEM;
+        }
+    }
+    daemon_error = 0;
+    daemon_message = NULL;
+    if (ret = pthread_create(&daemon_thread, NULL, daemon_worker, NULL)) {
+        fatal(ret, "unable to start daemon thread", NULL);
+        close_daemon();
+        return ret;
+    }
+    daemon_running = 1;
+    return 0;
+}
+
+int msntp_daemon_stop(void) {
+    if (!daemon_running) {
+        fatal(EMSNTP_INTERNAL, "the daemon is not running", NULL);
+        return EMSNTP_INTERNAL;
+    }
+    wake_up();
+    pthread_join(daemon_thread, NULL);
+    daemon_running = 0;
+    shm_publish(0, 0.0, 0.0, 0.0, 0.0, 0.0);
+    close_daemon();
+    if (daemon_error)
+        fatal(daemon_error, daemon_message, NULL);
+    return daemon_error;
+}
+
+int msntp_set_burst(int enable, int spacing_us) {
+    if (spacing_us < 0 || spacing_us >= 1000000) {
+        fatal(EMSNTP_INTERNAL, "burst spacing out of range", NULL);
+        return EMSNTP_INTERNAL;
+    }
+    libmsntp_pipeline = (enable != 0);
+    libmsntp_spacing = spacing_us;
+    return 0;
+}
+
+int msntp_set_server_backend(int backend) {
+    if (backend != MSNTP_BACKEND_CLASSIC && backend != MSNTP_BACKEND_IO_URING) {
+        fatal(EMSNTP_INTERNAL, "unknown server backend", NULL);
+        return EMSNTP_INTERNAL;
+    }
+    libmsntp_backend = backend;
+    return 0;
+}
+
+int msntp_set_rate_limit(double rate, double burst, int response,
+                         int eviction, int table_size) {
+    if ((rate > 0.0 && burst < 1.0) ||
+            (response != MSNTP_RATE_DROP && response != MSNTP_RATE_KOD) ||
+            (eviction != MSNTP_EVICT_OLDEST && eviction != MSNTP_EVICT_NONE)) {
+        fatal(EMSNTP_INTERNAL, "bad rate limit settings", NULL);
+        return EMSNTP_INTERNAL;
+    }
+    libmsntp_rate = (rate > 0.0 ? rate : 0.0);
+    libmsntp_burst = burst;
+    libmsntp_rate_response = response;
+    libmsntp_eviction = eviction;
+    libmsntp_rate_slots = table_size;
+    return 0;
+}
+
+int msntp_set_busy_poll(int spin_us, int cpu) {
+    libmsntp_busy_poll = spin_us;
+    libmsntp_busy_cpu = (cpu >= 0 ? cpu : -1);
+    return 0;
+}
+
+int msntp_server_backend() {
+    if (socket_descriptor(0) < 0)
+        return libmsntp_backend;
+    return (uring_active(0) ? MSNTP_BACKEND_IO_URING : MSNTP_BACKEND_CLASSIC);
+}
+
 int msntp_start_server(int port) {
+    int ret;
+
+    setup("unused", port);
+    operation = op_server;
+    libmsntp_reuseport = 0;
+    reset_server_stats();
+    if (ret = open_stop())
+        return ret;
+    return open_socket(0, NULL, 1000 * delay);
+}
+
+int msntp_start_server_mt(int port, int nthreads) {
+    int ret, i;
+
+    if (nthreads <= 0)
+        nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads <= 0)
+        nthreads = 1;
+    if (nthreads > MAX_SOCKETS || nworkers > 0) {
+        fatal(EMSNTP_INTERNAL, "too many server threads or already started",
+              NULL);
+        return EMSNTP_INTERNAL;
+    }
+
     setup("unused", port);
     operation = op_server;
-    return open_socket(0, NULL, delay);
+    libmsntp_reuseport = 1;
+    reset_server_stats();
+    if (ret = open_stop())
+        return ret;
+    for (i = 0; i < nthreads; ++i) {
+        if (ret = open_socket(i, NULL, 1000 * delay)) {
+            while (i >= 0)
+                close_socket(i--);
+            close_stop();
+            return ret;
+        }
+    }
+
+    for (nworkers = 0; nworkers < nthreads; ++nworkers) {
+        worker_errors[nworkers] = 0;
+        worker_messages[nworkers] = NULL;
+        if (ret = pthread_create(&workers[nworkers], NULL, serve_worker,
+                                 (void *)(long)nworkers)) {
+            fatal(ret, "unable to start server thread", NULL);
+            for (i = nworkers; i < nthreads; ++i)
+                close_socket(i);
+            msntp_stop_server();
+            return ret;
+        }
+    }
+    return 0;
 }
 
 int msntp_serve() {
@@ -123,10 +1002,197 @@ int msntp_serve() {
     return run_server();
 }
 
+int msntp_serve_batch(int max_packets, int timeout_ms) {
+    operation = op_server;
+    return run_server_batch(0, max_packets, timeout_ms);
+}
+
+int msntp_serve_timeout(int timeout_ms) {
+    int ret;
+
+    operation = op_server;
+    if ((ret = wait_for_requests(0, timeout_ms)) == 1)
+        return msntp_server_on_readable();
+    return (ret <= 0 ? -1 : ret);
+}
+
+int msntp_serve_forever(void) {
+    char drain[8];
+    int ret;
+
+    operation = op_server;
+    if (libmsntp_busy_cpu >= 0)
+        pin_thread(libmsntp_busy_cpu);
+    if ((ret = serve_loop(0)) != -1)
+        return ret;
+
+    /* so that the server can be resumed */
+    while (read(stop_descriptors[0], drain, sizeof(drain)) > 0)
+        ;
+    server_stopping = 0;
+    return 0;
+}
+
+int msntp_stop_serving(void) {
+    if (stop_descriptors[1] < 0) {
+        fatal(EMSNTP_INTERNAL, "the server is not running", NULL);
+        return EMSNTP_INTERNAL;
+    }
+    signal_stop();
+    return 0;
+}
+
+int msntp_server_fd(void) {
+    return socket_descriptor(0);
+}
+
+int msntp_server_on_readable(void) {
+    int ret;
+
+    operation = op_server;
+    while ((ret = run_server_batch(0, BATCH_MAX, -1)) == 0)
+        ;
+    return (ret == -1 ? 0 : ret);
+}
+
+int msntp_serve_epoll(int timeout_ms) {
+#ifdef __linux__
+    struct epoll_event event;
+    int ret;
+
+    if (epoll_descriptor < 0) {
+        errno = 0;
+        if ((epoll_descriptor = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+            fatal(errno, "unable to create epoll instance", NULL);
+            return errno;
+        }
+        event.events = EPOLLIN | EPOLLET;
+        event.data.fd = socket_descriptor(0);
+        errno = 0;
+        if (epoll_ctl(epoll_descriptor, EPOLL_CTL_ADD, event.data.fd,
+                      &event) < 0) {
+            ret = errno;
+            close(epoll_descriptor);
+            epoll_descriptor = -1;
+            fatal(ret, "unable to add server socket to epoll instance", NULL);
+            return ret;
+        }
+    }
+
+    errno = 0;
+    ret = epoll_wait(epoll_descriptor, &event, 1, timeout_ms);
+    if (ret < 0 && errno != EINTR) {
+        fatal(errno, "epoll_wait failed", NULL);
+        return errno;
+    } else if (ret <= 0) {
+        return -1;
+    }
+    return msntp_server_on_readable();
+#else
+    fatal(EMSNTP_INTERNAL, "epoll is not supported", NULL);
+    return EMSNTP_INTERNAL;
+#endif
+}
+
 int msntp_stop_server (void) {
-    return close_socket(0);
+    int ret = 0, err, i;
+
+    if (epoll_descriptor >= 0) {
+        close(epoll_descriptor);
+        epoll_descriptor = -1;
+    }
+    if (nworkers == 0) {
+        close_stop();
+        return close_socket(0);
+    }
+
+    signal_stop();
+    for (i = 0; i < nworkers; ++i)
+        pthread_join(workers[i], NULL);
+    for (i = 0; i < nworkers; ++i) {
+        if (worker_errors[i] && !ret) {
+            ret = worker_errors[i];
+            fatal(worker_errors[i], worker_messages[i], NULL);
+        }
+        if ((err = close_socket(i)) && !ret)
+            ret = err;
+    }
+    nworkers = 0;
+    close_stop();
+    return ret;
 }
     
+int msntp_server_stats(struct msntp_server_stats *stats) {
+    int i;
+
+    if (!stats) {
+        fatal(EMSNTP_INTERNAL, "no statistics structure given", NULL);
+        return EMSNTP_INTERNAL;
+    }
+    memset(stats, 0, sizeof(*stats));
+    for (i = 0; i < MAX_SOCKETS; ++i) {
+        stats->accepted += STAT_READ(i, accepted);
+        stats->rejected += STAT_READ(i, rejected);
+        stats->broadcasts += STAT_READ(i, broadcasts);
+        stats->send_failures += STAT_READ(i, send_failures);
+        stats->bytes_received += STAT_READ(i, bytes_received);
+        stats->bytes_sent += STAT_READ(i, bytes_sent);
+        stats->service_ns += STAT_READ(i, service_ns);
+        stats->batches += STAT_READ(i, batches);
+        stats->limited += STAT_READ(i, limited);
+    }
+    stats->latency_p50_ns = latency_quantile(0.5);
+    stats->latency_p99_ns = latency_quantile(0.99);
+    if (server_started > 0.0)
+        stats->uptime = current_time(JAN_1970) - server_started;
+    return 0;
+}
+
+int msntp_server_stats_prometheus(char *buffer, int size) {
+    struct msntp_server_stats stats;
+
+    if (size < 0 || (size > 0 && !buffer)) {
+        fatal(EMSNTP_INTERNAL, "no buffer for statistics", NULL);
+        return EMSNTP_INTERNAL;
+    }
+    msntp_server_stats(&stats);
+    return snprintf(buffer, (size_t)size,
+        "# HELP msntp_server_requests_total SNTP packets, by outcome.\n"
+        "# TYPE msntp_server_requests_total counter\n"
+        "msntp_server_requests_total{result=\"accepted\"} %llu\n"
+        "msntp_server_requests_total{result=\"rejected\"} %llu\n"
+        "msntp_server_requests_total{result=\"broadcast\"} %llu\n"
+        "msntp_server_requests_total{result=\"limited\"} %llu\n"
+        "# HELP msntp_server_send_failures_total Replies not sent.\n"
+        "# TYPE msntp_server_send_failures_total counter\n"
+        "msntp_server_send_failures_total %llu\n"
+        "# HELP msntp_server_bytes_total Bytes of SNTP packets, by direction.\n"
+        "# TYPE msntp_server_bytes_total counter\n"
+        "msntp_server_bytes_total{direction=\"received\"} %llu\n"
+        "msntp_server_bytes_total{direction=\"sent\"} %llu\n"
+        "# HELP msntp_server_service_seconds_total Arrival to reply.\n"
+        "# TYPE msntp_server_service_seconds_total counter\n"
+        "msntp_server_service_seconds_total %.9f\n"
+        "# HELP msntp_server_batches_total Reads that returned packets.\n"
+        "# TYPE msntp_server_batches_total counter\n"
+        "msntp_server_batches_total %llu\n"
+        "# HELP msntp_server_latency_seconds Arrival to reply, by quantile.\n"
+        "# TYPE msntp_server_latency_seconds summary\n"
+        "msntp_server_latency_seconds{quantile=\"0.5\"} %.9f\n"
+        "msntp_server_latency_seconds{quantile=\"0.99\"} %.9f\n"
+        "msntp_server_latency_seconds_sum %.9f\n"
+        "msntp_server_latency_seconds_count %llu\n"
+        "# HELP msntp_server_uptime_seconds Time since the server started.\n"
+        "# TYPE msntp_server_uptime_seconds gauge\n"
+        "msntp_server_uptime_seconds %.3f\n",
+        stats.accepted, stats.rejected, stats.broadcasts, stats.limited,
+        stats.send_failures,
+        stats.bytes_received, stats.bytes_sent, 1.0e-9 * stats.service_ns,
+        stats.batches, 1.0e-9 * stats.latency_p50_ns,
+        1.0e-9 * stats.latency_p99_ns, 1.0e-9 * stats.service_ns,
+        stats.accepted, stats.uptime);
+}
+
 const char *msntp_strerror() {
     if (libmsntp_errno < 0) {
         return libmsntp_strerror;
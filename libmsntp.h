@@ -12,7 +12,13 @@
  * Errors can be handled programmatically by examing each function's return
  * value - if positive, it's an errno constant; if negative, it's one of the
  * EMSNTP_ constants defined immediately below. The msntp_strerror function
- * returns a human-readable string describing the last error encountered.
+ * returns a human-readable string describing the last error encountered in
+ * the calling thread.
+ *
+ * The client functions share their settings, so only one thread may use them
+ * at a time. The _r variants take an msntp_ctx instead, which holds all of the
+ * state of the calls made with it, so different threads can make them at
+ * once, each with its own context. There is only one server per process.
  *
  * To use libmsntp in your own programs, include libmsntp.h and link with
  * libmsntp.a. For more information on building libmsntp, see the README file.
@@ -22,6 +28,7 @@
 #define _LIBMSNTP_H
 
 #include <sys/time.h>
+#include <time.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -42,11 +49,84 @@ extern "C" {
 #define EMSNTP_NTP_INSANITY          -18
 
 
+/**
+ * What the daemon started by msntp_daemon_start does with its estimates: only
+ * publish them, with msntp_shm_open, or also discipline the local clock, by
+ * slewing it with adjtime or stepping it with settimeofday.
+ */
+#define MSNTP_DAEMON_MONITOR           0
+#define MSNTP_DAEMON_ADJUST            1
+#define MSNTP_DAEMON_RESET             2
+
+/**
+ * Settings for msntp_daemon_start. These are the msntp program's daemon mode
+ * options, and any that are left at zero take its defaults: port 123, an
+ * interval of 18000 seconds (5 hours), a count of 5, a minerr of 0.1 seconds
+ * and a maxerr of 5 seconds. It must be that minerr < maxerr < interval.
+ *
+ * The window is how many of the latest replies the drift is estimated from,
+ * which is count by default, and may be up to 4096. The estimate is updated
+ * with running sums, so a long window costs no more per reply than a short
+ * one, and averages out more noise, but takes longer to follow a change in
+ * the drift.
+ */
+struct msntp_daemon_opts {
+    int port;                           /* in host byte order */
+    int interval;                       /* seconds between requests */
+    int count;                          /* lost replies to put up with */
+    int action;                         /* MSNTP_DAEMON_MONITOR etc. */
+    double minerr;                      /* smallest correction to make */
+    double maxerr;                      /* largest error to put up with */
+    const char *savefile;               /* for restarting, or NULL */
+    int window;                         /* replies to estimate drift from */
+};
+
+
+/**
+ * Server I/O backends, for msntp_set_server_backend.
+ */
+#define MSNTP_BACKEND_CLASSIC          0
+#define MSNTP_BACKEND_IO_URING         1
+
+
+/**
+ * What the SNTP server does with requests over the rate limit, and what it does
+ * when its table of clients is full, for msntp_set_rate_limit.
+ */
+#define MSNTP_RATE_DROP                0
+#define MSNTP_RATE_KOD                 1
+
+#define MSNTP_EVICT_OLDEST             0
+#define MSNTP_EVICT_NONE               1
+
+
+/**
+ * SNTP server statistics, returned by msntp_server_stats. They are totals since
+ * the server was last started, over all of its threads.
+ */
+struct msntp_server_stats {
+    unsigned long long accepted;        /* requests answered */
+    unsigned long long rejected;        /* malformed or unexpected packets */
+    unsigned long long broadcasts;      /* broadcast packets ignored */
+    unsigned long long send_failures;   /* replies that could not be sent */
+    unsigned long long bytes_received;
+    unsigned long long bytes_sent;
+    unsigned long long service_ns;      /* total time from arrival to reply */
+    unsigned long long batches;         /* reads that returned packets */
+    unsigned long long limited;         /* packets stopped by the rate limit */
+    unsigned long long latency_p50_ns;  /* median time from arrival to reply */
+    unsigned long long latency_p99_ns;  /* 99th percentile of the same */
+    double uptime;                      /* seconds since the server started */
+};
+
+
 /**
  * Connects to an SNTP server and synchronizes the local clock to the server's
  * clock.
  *
- * The port should be in host byte order.
+ * In this and the other client functions, the hostname may be a name, which is
+ * looked up with getaddrinfo and may resolve to either version of IP, or a
+ * numeric IPv4 or IPv6 address. The port should be in host byte order.
  */
 int msntp_set_clock(char *hostname, int port);
 
@@ -69,10 +149,308 @@ int msntp_get_offset(char *hostname, int port, struct timeval *offset);
 int msntp_get_time(char *hostname, int port, struct timeval *server_time);
 
 /**
- * Starts the SNTP server. The port should be in host byte order.
+ * Like msntp_get_offset, but returns the offset as a struct timespec, to the
+ * nearest nanosecond. A negative offset has a negative tv_sec and a tv_nsec
+ * between 0 and 999999999, so -0.25s is { -1, 750000000 }. How much of that
+ * resolution is meaningful depends on the network and the server.
+ *
+ * The port should be in host byte order.
+ */
+int msntp_get_offset_ns(char *hostname, int port, struct timespec *offset);
+
+/**
+ * Like msntp_get_time, but returns the server's time as a struct timespec, to
+ * the nearest nanosecond. The local clock is read with
+ * clock_gettime(CLOCK_REALTIME) and the offset added in integer nanoseconds.
+ *
+ * The port should be in host byte order.
+ */
+int msntp_get_time_ts(char *hostname, int port, struct timespec *server_time);
+
+/**
+ * Queries several SNTP servers at once, rather than one after the other, so
+ * that each round of requests costs one round trip however many servers there
+ * are. Each server gets the same exchange as msntp_get_offset, on its own
+ * socket. The combined offset is the one with the smallest estimated error,
+ * which goes in error (in seconds) if that is not NULL; the call fails with
+ * EMSNTP_NTP_INCONSISTENCY if any other server disagrees with it by more than
+ * their errors allow.
+ *
+ * Each of offsets, errors and results may be NULL, or an array of n entries,
+ * which gets each server's offset, error and return value; the first two are
+ * only filled in for servers that returned 0. They are filled in even when the
+ * call fails, so with EMSNTP_NTP_INCONSISTENCY they show which servers
+ * disagree. The call succeeds if any server does. At most 64 servers may be
+ * given, all with the same port, in host byte order.
+ */
+int msntp_get_offset_multi(char *hostnames[], int n, int port,
+                           struct timespec *offset, double *error,
+                           struct timespec *offsets, double *errors,
+                           int *results);
+
+/**
+ * Like msntp_get_offset_ns, but returns within budget_ms milliseconds, which
+ * covers looking up the server, opening the socket and every retry, with the
+ * estimated error of the offset in seconds in error if that is not NULL. No
+ * reply is waited for longer than a fifth of the budget (or the wait set by
+ * msntp_set_timeout, if that is shorter), so that a lost packet leaves time to
+ * try again. If the budget runs out first, the call fails, usually with
+ * EMSNTP_TOO_FEW_RESPONSES, or EMSNTP_IP_ADDRESS if the lookup took it all.
+ */
+int msntp_get_offset_deadline(char *hostname, int port, int budget_ms,
+                              struct timespec *offset, double *error);
+
+/**
+ * An SNTP client exchange that is driven by the caller's own event loop,
+ * rather than by blocking. It goes through exactly the same steps as
+ * msntp_get_offset, sending one request at a time and waiting for the reply,
+ * but on its own socket, so any number of queries can run at once.
+ */
+struct msntp_query;
+
+/**
+ * Starts a query to an SNTP server, sending the first request, and returns the
+ * query and its socket descriptor. Add the descriptor to your poll, select or
+ * epoll set for reading, with msntp_query_timeout as the timeout, and call
+ * msntp_query_on_readable when it is readable and msntp_query_on_timer
+ * otherwise. The descriptor may also report an error condition, when the
+ * kernel has timestamped a request; either call clears that. The name is
+ * looked up as by the other client functions, so this only blocks if it is
+ * not cached.
+ *
+ * Returns 0 on success. If the query has been created but the first request
+ * could not be sent, it returns the error and the query must still be ended
+ * with msntp_query_end; otherwise *query is NULL. The port should be in host
+ * byte order.
+ */
+int msntp_query_begin(char *hostname, int port, struct msntp_query **query,
+                      int *fd);
+
+/**
+ * Reads any replies that have arrived on a query's socket, sending the next
+ * request if needed. It never blocks. Returns -1 while the query is still
+ * running, 0 when it has finished successfully, or an error.
+ */
+int msntp_query_on_readable(struct msntp_query *query);
+
+/**
+ * Counts the latest request of a query as lost if msntp_query_timeout has
+ * passed, and sends another if needed. Returns as msntp_query_on_readable.
+ */
+int msntp_query_on_timer(struct msntp_query *query);
+
+/**
+ * Returns the number of milliseconds until msntp_query_on_timer should be
+ * called, or -1 if the query has finished.
+ */
+int msntp_query_timeout(struct msntp_query *query);
+
+/**
+ * Returns the result of a finished query: the offset between the local time
+ * and the server's, as for msntp_get_offset_ns, and its estimated error in
+ * seconds. Returns 0 on success, -1 if the query is still running, or the
+ * error that ended it, in which case offset and error are not changed.
+ */
+int msntp_query_result(struct msntp_query *query, struct timespec *offset,
+                       double *error);
+
+/**
+ * Closes a query's socket and frees it. The query may still be running. It
+ * is safe to pass NULL.
+ */
+void msntp_query_end(struct msntp_query *query);
+
+/**
+ * Sets how long the client functions remember the address that a host name
+ * resolved to, in seconds; the default is 300. Names are looked up with
+ * getaddrinfo in a separate thread, and the caller waits for the answer only
+ * when there is no usable one in the cache. Once an answer is ttl_seconds
+ * old, it is still used for as long again while a fresh lookup runs in the
+ * background. Failed lookups are not remembered, and a lookup that takes too
+ * long is left running, so that its answer is there for the next call. Numeric
+ * addresses are never looked up. Zero turns the cache off.
+ */
+int msntp_set_dns_cache(int ttl_seconds);
+
+/**
+ * Turns burst mode on or off for the client functions; it is off by default.
+ * Normally a client sends a request, waits for the reply or a timeout, and
+ * only then sends the next, so five samples take five round trips. In burst
+ * mode it sends all of the requests it still needs back to back, spacing_us
+ * microseconds apart (like NTP's iburst, but with no gap by default), and
+ * takes the replies as they arrive. It stops as soon as it has a good enough
+ * estimate, which usually takes about one round trip, and sends another
+ * burst for any that are lost. Spacing must be less than a second.
+ */
+int msntp_set_burst(int enable, int spacing_us);
+
+/**
+ * Sets how long the client functions may take in all, in milliseconds, and how
+ * long each of them waits for a reply before counting it as lost and sending
+ * another request. The defaults are 15000 and 3000. The total covers looking
+ * up the server and opening the socket as well as the exchange, and all times
+ * are measured on the monotonic clock, so setting the clock does not upset
+ * them. The wait must be positive and no longer than the total.
+ */
+int msntp_set_timeout(int timeout_ms, int wait_ms);
+
+/**
+ * Turns hedging on or off for the client functions; it is off by default.
+ * When hedging, a client keeps the round trips of the last 32 replies from
+ * each of the last 16 servers it has used, and once it has 8 for a server, it
+ * sends a request again if there is no reply by the 95th percentile of them
+ * (but no sooner than 1ms), and takes whichever reply comes first. A lost or
+ * slow packet then costs about one more round trip, rather than the whole wait
+ * set by msntp_set_timeout, for about 5% more requests. Each duplicate uses
+ * up one of the ten attempts that an exchange may make.
+ *
+ * Several servers given to msntp_get_offset_multi are asked at once anyway, so
+ * each is hedged on its own.
+ */
+int msntp_set_hedging(int enable);
+
+/**
+ * Publishes the estimates of the daemon's discipline loop in the POSIX shared
+ * memory segment with the given name, such as "/msntp", creating it if need
+ * be, so that any number of processes on the host can read the corrected time
+ * with msntp_shm_now from msntp_shm.h, without libmsntp or the network. Each
+ * estimate gives the offset, drift and error as of when it was made, and the
+ * readers extrapolate from there. Only one segment may be open at a time.
+ *
+ * With glibc before 2.34, programs that use this or msntp_shm.h must be linked
+ * with -lrt as well.
+ */
+int msntp_shm_open(const char *name);
+
+/**
+ * Marks the published estimate invalid and stops publishing. The segment is
+ * left in place, for the next publisher.
+ */
+void msntp_shm_close(void);
+
+/**
+ * Starts msntp's daemon mode on a background thread, so that a long-running
+ * program can keep the time disciplined without running msntp itself. It
+ * queries the n servers in turn, every interval seconds, and estimates the
+ * local clock's offset and drift from the last window replies by weighted
+ * least squares. It then corrects the offset, and slews the clock in between
+ * requests to cancel out the drift, unless the action is MSNTP_DAEMON_MONITOR.
+ * Every estimate is published in shared memory if msntp_shm_open has been
+ * called. If opts has a savefile, the estimates are kept there too, and a
+ * daemon started again soon afterwards carries on from them.
+ *
+ * Before the thread is started, all of the servers are asked at once in burst
+ * mode (see msntp_set_burst), so that the clock is set, or the first estimate
+ * published, within a round trip or so, rather than after the daemon's first
+ * exchange. Any error in that, such as a server that can't be found or not
+ * being allowed to change the clock, is returned, and nothing is left running.
+ *
+ * The thread uses the same settings and sockets as the functions without an
+ * _r suffix, so only the reentrant functions, sessions and msntp_shm_now
+ * should be used while it runs. Only one daemon may run at a time.
+ */
+int msntp_daemon_start(char *hostnames[], int n,
+                       const struct msntp_daemon_opts *opts);
+
+/**
+ * Stops the daemon started by msntp_daemon_start, waiting for the thread to
+ * finish. A thread waiting for a reply notices within the reply wait set by
+ * msntp_set_timeout, however long the daemon's interval. The published
+ * estimate is marked invalid. Returns the error that stopped the daemon by
+ * itself, if it did, or 0 if it was still running.
+ * Like the msntp program, the daemon carries on through server outages,
+ * starting its estimates afresh after a long one, but stops on errors such as
+ * EMSNTP_NTP_INCONSISTENCY, when the servers' times can't be reconciled.
+ */
+int msntp_daemon_stop(void);
+
+/**
+ * Selects how the SNTP server does its I/O. MSNTP_BACKEND_CLASSIC (the
+ * default) uses ordinary socket calls. MSNTP_BACKEND_IO_URING uses io_uring on
+ * Linux, keeping a multishot receive armed on each server socket and queueing
+ * replies, so that a busy server makes close to one system call per batch of
+ * requests. If io_uring can't be used, the server silently falls back to the
+ * classic backend; msntp_server_backend says which one is actually in use.
+ *
+ * This takes effect at the next msntp_start_server or msntp_start_server_mt.
+ */
+int msntp_set_server_backend(int backend);
+
+/**
+ * Limits how often each client address may use the SNTP server, with a token
+ * bucket per address: rate requests per second on average, in bursts of up to
+ * burst requests. A rate of zero or less (the default) turns the limit off.
+ *
+ * Requests over the limit are checked before anything else, and are either
+ * dropped (MSNTP_RATE_DROP) or answered with a Kiss-o'-Death packet with the
+ * code RATE (MSNTP_RATE_KOD), which tells well-behaved clients to back off.
+ * Only packets that look like client requests get one, and it is no bigger
+ * than the request.
+ *
+ * The clients are kept in a fixed-size hash table of table_size entries
+ * (rounded up to a power of two; 16 bytes each) per server socket, so the
+ * memory used is bounded however many addresses send requests. IPv6 clients
+ * are counted by /64 prefix, since that is what a single site is given. When a
+ * client's neighbourhood of the table is full of active clients,
+ * MSNTP_EVICT_OLDEST makes room by forgetting the one seen least recently,
+ * and MSNTP_EVICT_NONE treats the new client as over the limit, which keeps
+ * established clients safe from floods of spoofed addresses. With
+ * msntp_start_server_mt, each thread has its own table, and the kernel may
+ * share one client's requests between threads, so the limit applies per
+ * thread.
+ *
+ * This takes effect at the next msntp_start_server or msntp_start_server_mt.
+ */
+int msntp_set_rate_limit(double rate, double burst, int response,
+                         int eviction, int table_size);
+
+/**
+ * Returns the I/O backend that the running SNTP server is using, or the
+ * selected one if the server isn't running.
+ */
+int msntp_server_backend();
+
+/**
+ * Selects the busy-poll server mode, which trades a dedicated CPU for lower and
+ * steadier reply latency. Instead of sleeping until requests arrive,
+ * msntp_serve_forever and msntp_start_server_mt's threads spin on non-blocking
+ * reads, with SO_BUSY_POLL and SO_PREFER_BUSY_POLL set on the sockets (where
+ * permitted) so that the kernel polls the network device instead of waiting
+ * for its interrupts. They keep spinning for spin_us microseconds after the
+ * last request, then sleep as usual until the next one; a negative spin_us
+ * spins until the server is stopped, and 0 (the default) turns the mode off.
+ * The io_uring backend is not used in this mode.
+ *
+ * If cpu is zero or more, msntp_serve_forever pins its thread to that CPU, and
+ * msntp_start_server_mt's threads are pinned to consecutive CPUs from there,
+ * which should be kept free of other work. msntp_server_stats reports the
+ * resulting latency.
+ *
+ * This takes effect at the next msntp_start_server or msntp_start_server_mt.
+ */
+int msntp_set_busy_poll(int spin_us, int cpu);
+
+/**
+ * Starts the SNTP server. It listens on a single dual-stack IPv6 socket, which
+ * also receives IPv4 requests as mapped addresses, or on an IPv4 socket if the
+ * system has no IPv6. The port should be in host byte order.
  */
 int msntp_start_server(int port);
 
+/**
+ * Starts a multi-threaded SNTP server. Opens nthreads sockets on the same port
+ * with SO_REUSEPORT, so that the kernel shares requests out between them, and
+ * starts a thread for each one that serves batches of requests until
+ * msntp_stop_server is called. Each thread has its own socket, reply addresses
+ * and packet buffers, and is pinned to its own CPU where possible. If nthreads
+ * is zero or negative, one thread is started per online CPU; at most 64 are
+ * allowed. msntp_serve and msntp_serve_batch should not be called while the
+ * threads are running.
+ *
+ * The port should be in host byte order.
+ */
+int msntp_start_server_mt(int port, int nthreads);
+
 /**
  * Handles incoming conections from SNTP clients. This call is non-blocking; it
  * will either accept and handle a single SNTP request, or time out and return.
@@ -81,16 +459,231 @@ int msntp_start_server(int port);
 int msntp_serve();
 
 /**
- * Stops the SNTP server. Should only be called after msntp_start_server.
+ * Handles a batch of incoming SNTP requests. Waits up to timeout_ms
+ * milliseconds for the first request, then reads up to max_packets requests
+ * that are already queued and sends all of the replies together, using
+ * recvmmsg and sendmmsg where available. Replies are the same as those sent by
+ * msntp_serve. Returns 0 if any requests were handled and -1 if it timed out.
+ * Should only be called after msntp_start_server.
+ */
+int msntp_serve_batch(int max_packets, int timeout_ms);
+
+/**
+ * Sleeps in the kernel for up to timeout_ms milliseconds until SNTP requests
+ * arrive, then handles everything that is queued, like
+ * msntp_server_on_readable.
+ * A negative timeout waits indefinitely. Returns 0 once the socket has become
+ * readable, even if nothing was then handled, because the packets were not
+ * requests or another thread took them first. Returns -1 if it timed out, was
+ * interrupted by a signal, or msntp_stop_serving has been called. Should only
+ * be called after msntp_start_server.
+ */
+int msntp_serve_timeout(int timeout_ms);
+
+/**
+ * Serves SNTP requests until msntp_stop_serving is called from another thread
+ * or a signal handler, sleeping in the kernel whenever there are none, so an
+ * idle server uses no CPU. Returns 0 once it has been stopped, after which it
+ * may be called again, or an error. Should only be called after
+ * msntp_start_server.
+ */
+int msntp_serve_forever();
+
+/**
+ * Makes msntp_serve_forever return, and msntp_serve_timeout return -1, as soon
+ * as they have finished with the requests in hand. It only writes to an eventfd
+ * (or a pipe, where there is no eventfd), so it is safe to call from any thread
+ * or from a signal handler. msntp_stop_server must still be called afterwards.
+ */
+int msntp_stop_serving();
+
+/**
+ * Returns the server's socket descriptor, so that it can be added to an
+ * application's own event loop (select, poll, epoll, etc.), or -1 if the
+ * server is not running. With the io_uring backend, this is the ring's
+ * descriptor, which becomes readable in the same way. Should only be called
+ * after msntp_start_server.
+ */
+int msntp_server_fd();
+
+/**
+ * Handles every SNTP request that is queued on the server's socket, without
+ * waiting. Call this when the descriptor returned by msntp_server_fd becomes
+ * readable. It reads until the socket would block, so it is safe to use with
+ * edge-triggered notifications. Returns 0 on success.
+ */
+int msntp_server_on_readable();
+
+/**
+ * Waits up to timeout_ms milliseconds for SNTP requests, using an internal
+ * edge-triggered epoll instance, and handles everything that is queued when
+ * they arrive. A negative timeout waits indefinitely. Returns 0 if any
+ * requests were handled and -1 if it timed out. Only available on Linux.
+ * Should only be called after msntp_start_server.
+ */
+int msntp_serve_epoll(int timeout_ms);
+
+/**
+ * Stops the SNTP server. Should only be called after msntp_start_server or
+ * msntp_start_server_mt. In the latter case, it waits for the server threads
+ * to finish, and returns the first error that any of them encountered.
  */
 int msntp_stop_server();
 
+/**
+ * Fills in stats with the SNTP server's statistics. The counters are kept by
+ * each server thread separately, without locks, and added up by this call, so
+ * it is cheap for the server and may be called from any thread at any time,
+ * including while msntp_start_server_mt's threads are running. The totals
+ * start from zero at msntp_start_server or msntp_start_server_mt, and are kept
+ * after msntp_stop_server. Dividing service_ns by accepted gives the average
+ * time a request spent in the server, from the kernel's receive timestamp
+ * (where available) to just before its reply was sent. The median and 99th
+ * percentile of that time come from a histogram, and are within about 12%.
+ */
+int msntp_server_stats(struct msntp_server_stats *stats);
+
+/**
+ * Writes the SNTP server's statistics to buffer in the Prometheus text
+ * exposition format, for a metrics endpoint. Like snprintf, it writes at most
+ * size bytes including the terminating NUL, and returns the length of the
+ * whole text, so a return value of size or more means that the output was
+ * truncated.
+ */
+int msntp_server_stats_prometheus(char *buffer, int size);
+
 /**
  * Returns a a detailed, human-readable string describing the last error
- * encountered.
+ * encountered in the calling thread.
  */
 const char *msntp_strerror();
 
+/**
+ * The settings and last error of the reentrant client functions, which are
+ * the _r variants of the ones above. They behave exactly like the originals,
+ * but they keep everything they need in the context and their own sockets,
+ * instead of in globals, so any number of threads can call them at once
+ * without locking, as long as each uses its own context. msntp_set_dns_cache
+ * applies to all of them; the address cache is shared and locked.
+ */
+struct msntp_ctx;
+
+/**
+ * Creates a context with the default settings, the same as the other client
+ * functions use. Returns NULL if there is no memory.
+ */
+struct msntp_ctx *msntp_ctx_new(void);
+
+/**
+ * Frees a context. It is safe to pass NULL.
+ */
+void msntp_ctx_free(struct msntp_ctx *ctx);
+
+/**
+ * Like msntp_set_burst, for calls with the given context only.
+ */
+int msntp_set_burst_r(struct msntp_ctx *ctx, int enable, int spacing_us);
+
+/**
+ * Like msntp_set_timeout, for calls with the given context only.
+ */
+int msntp_set_timeout_r(struct msntp_ctx *ctx, int timeout_ms, int wait_ms);
+
+/**
+ * Like msntp_set_hedging, for calls with the given context only. The record of
+ * round trips is shared by all of the contexts.
+ */
+int msntp_set_hedging_r(struct msntp_ctx *ctx, int enable);
+
+/**
+ * The reentrant client functions. Each one takes the same arguments as the
+ * one without _r, after the context, and returns the same values.
+ */
+int msntp_set_clock_r(struct msntp_ctx *ctx, char *hostname, int port);
+
+int msntp_get_offset_r(struct msntp_ctx *ctx, char *hostname, int port,
+                       struct timeval *offset);
+
+int msntp_get_time_r(struct msntp_ctx *ctx, char *hostname, int port,
+                     struct timeval *server_time);
+
+int msntp_get_offset_ns_r(struct msntp_ctx *ctx, char *hostname, int port,
+                          struct timespec *offset);
+
+int msntp_get_time_ts_r(struct msntp_ctx *ctx, char *hostname, int port,
+                        struct timespec *server_time);
+
+int msntp_get_offset_multi_r(struct msntp_ctx *ctx, char *hostnames[], int n,
+                             int port, struct timespec *offset, double *error,
+                             struct timespec *offsets, double *errors,
+                             int *results);
+
+int msntp_get_offset_deadline_r(struct msntp_ctx *ctx, char *hostname,
+                                int port, int budget_ms,
+                                struct timespec *offset, double *error);
+
+/**
+ * Like msntp_query_begin. The query copies the settings it needs, so the
+ * context may be used for other calls while it runs. The other msntp_query
+ * functions are reentrant already, for different queries.
+ */
+int msntp_query_begin_r(struct msntp_ctx *ctx, char *hostname, int port,
+                        struct msntp_query **query, int *fd);
+
+/**
+ * Returns a human-readable string describing the error of the last call made
+ * with the given context.
+ */
+const char *msntp_strerror_r(struct msntp_ctx *ctx);
+
+/**
+ * A client's standing connection to one SNTP server, for programs that ask it
+ * the time often. The other client functions look the server up, open a
+ * socket and close it again on every call, which costs more than the exchange
+ * itself on a fast network. A session keeps the server's address and a
+ * connected socket between queries, so they cost only the packets.
+ *
+ * The address is looked up again in the background once the address cache
+ * time (see msntp_set_dns_cache) has passed, and after any failed query, and
+ * the socket is reconnected if it has changed. If the socket itself fails,
+ * including when the server refuses the packets, it is reopened
+ * transparently. A session is not shared between threads, and runs one query
+ * at a time.
+ */
+struct msntp_session;
+
+/**
+ * Looks up an SNTP server and opens a session to it, with the default
+ * settings, or with those in ctx for the _r variant. Returns 0 on success,
+ * when *session is the new session; otherwise it is NULL. The port should be
+ * in host byte order.
+ */
+int msntp_session_open(char *hostname, int port,
+                       struct msntp_session **session);
+
+int msntp_session_open_r(struct msntp_ctx *ctx, char *hostname, int port,
+                         struct msntp_session **session);
+
+/**
+ * Like msntp_get_offset_ns, on a session, with the estimated error of the
+ * offset in seconds in error if that is not NULL.
+ */
+int msntp_session_get_offset(struct msntp_session *session,
+                             struct timespec *offset, double *error);
+
+/**
+ * Like msntp_query_begin, on a session. The query must be ended with
+ * msntp_query_end before the next one is begun or the session is closed; its
+ * descriptor is the session's, and is not closed.
+ */
+int msntp_session_query_begin(struct msntp_session *session,
+                              struct msntp_query **query, int *fd);
+
+/**
+ * Closes a session's socket and frees it. It is safe to pass NULL.
+ */
+void msntp_session_close(struct msntp_session *session);
+
 #ifdef __cplusplus
 }
 #endif 
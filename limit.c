@@ -0,0 +1,179 @@
+/**
+ * libmsntp
+ * http://snarfed.org/libmsntp
+ *
+ * Copyright 2005, Ryan Barrett <libmsntp@ryanb.org>
+ *
+ * This includes the per-client rate limiting for the server. Each server
+ * socket (and so each server thread) has its own table of token buckets, keyed
+ * by the client's address, so that no locking is needed. The tables are fixed
+ * size, with open addressing: a client can only be in one of the LIMIT_PROBES
+ * slots after the one its address hashes to, which are one or two cache lines.
+ * When those are all taken by active clients, the eviction policy says whether
+ * the one seen least recently makes way or the new client is refused.
+ *
+ * Clients over their limit are either ignored or sent a Kiss-o'-Death packet
+ * with the code RATE (RFC 5905, section 7.4), which is no bigger than their
+ * request and costs next to nothing to build.
+ */
+
+#include "header.h"
+
+#define LIMIT
+#include "kludges.h"
+#undef LIMIT
+
+
+
+#define LIMIT_PROBES       8           /* Slots searched for each client */
+#define LIMIT_SLOTS_MIN   64           /* Smallest table */
+#define LIMIT_TICKS     1024.0         /* Clock ticks per second; see below */
+
+/* defined in libmsntp.c */
+extern double libmsntp_rate, libmsntp_burst;
+extern int libmsntp_rate_response, libmsntp_eviction, libmsntp_rate_slots;
+
+
+
+/* The time is kept in ticks of 1/1024 second, which is the top of an NTP
+timestamp's fraction and so costs only a shift, in 32 bits.  That wraps every
+48 days, which does not matter, because a client that has been away for more
+than a few seconds has a full bucket anyway. */
+
+typedef struct LIMIT_ENTRY {
+    uint64_t key;                      /* 0 for an empty slot */
+    uint32_t seen;                     /* Tick of the last request */
+    float tokens;                      /* Requests allowed now */
+} limit_entry;
+
+typedef struct LIMIT_TABLE {
+    limit_entry *entries;
+    uint64_t seed;
+    unsigned mask;
+} limit_table;
+
+static limit_table tables[MAX_SOCKETS];
+
+
+
+static limit_entry *limit_find (limit_table *table, uint64_t key,
+    uint32_t now, uint32_t idle) {
+
+/* Return the slot for key, or a slot to put it in (with key still 0), or NULL
+if there is no room.  A slot that has been idle long enough to refill its bucket
+is as good as empty. */
+
+    limit_entry *entry, *empty = NULL, *oldest = NULL;
+    unsigned start, k;
+
+    start = (unsigned)(((key^table->seed)*0x9e3779b97f4a7c15ull) >> 32);
+    for (k = 0; k < LIMIT_PROBES; ++k) {
+        entry = &table->entries[(start+k)&table->mask];
+        if (entry->key == key) return entry;
+        if (entry->key == 0 || now-entry->seen >= idle) {
+            if (empty == NULL) empty = entry;
+        } else if (oldest == NULL || now-entry->seen > now-oldest->seen)
+            oldest = entry;
+    }
+    if (empty == NULL && libmsntp_eviction == MSNTP_EVICT_OLDEST)
+        empty = oldest;
+    if (empty != NULL) empty->key = 0;
+    return empty;
+}
+
+
+
+static int limit_allow (int which, uint64_t key, ntp_stamp when) {
+
+/* Take a token from the client's bucket, returning 1 if it had one and 0 if
+it is over its limit (or cannot be tracked). */
+
+    limit_table *table = &tables[which];
+    limit_entry *entry;
+    uint32_t now = (uint32_t)(when >> 22), idle;
+    double rate = libmsntp_rate/LIMIT_TICKS, tokens;
+    unsigned slots;
+
+/* The table is allocated by the thread that uses it, the first time. */
+
+    if (table->entries == NULL) {
+        for (slots = LIMIT_SLOTS_MIN; slots < (unsigned)libmsntp_rate_slots &&
+                slots < (1u << 30); slots <<= 1)
+            ;
+        if ((table->entries = calloc(slots,sizeof(limit_entry))) == NULL)
+            return 1;
+        table->mask = slots-1;
+        table->seed = ((uint64_t)current_nanos() << 1)|1;
+    }
+
+    tokens = libmsntp_burst/rate;
+    idle = (tokens < 2147483647.0 ? (uint32_t)tokens+1 : 2147483647u);
+    if ((entry = limit_find(table,key,now,idle)) == NULL) return 0;
+    if (entry->key == 0) {
+        entry->key = key;
+        entry->seen = now;
+        entry->tokens = (float)(libmsntp_burst-1.0);
+        return 1;
+    }
+    tokens = entry->tokens+rate*(uint32_t)(now-entry->seen);
+    if (tokens > libmsntp_burst) tokens = libmsntp_burst;
+    entry->seen = now;
+    if (tokens < 1.0) {
+        entry->tokens = (float)tokens;
+        return 0;
+    }
+    entry->tokens = (float)(tokens-1.0);
+    return 1;
+}
+
+
+
+static void pack_kod (unsigned char *reply, const unsigned char *request) {
+
+/* Build a RATE Kiss-o'-Death reply to a client request: an unsynchronised
+stratum 0 packet, with the kiss code in the reference identifier and the
+client's transmit timestamp as its originate timestamp, so that the client
+can match it. */
+
+    memset(reply,0,NTP_PACKET_MIN);
+    reply[0] = (3<<6)|(request[0]&0x38)|NTP_SERVER;
+    reply[2] = request[2];
+    reply[3] = NTP_PRECISION;
+    memcpy(&reply[12],"RATE",4);
+    memcpy(&reply[NTP_ORIGINATE],&request[NTP_TRANSMIT],8);
+}
+
+
+
+extern int limit_packet (int which, int slot, unsigned char *request,
+                         int length, ntp_stamp now, unsigned char *reply) {
+
+/* Apply the rate limit to the packet in slot of the last read from server
+socket which.  This returns 0 to handle it as usual, 1 to drop it and 2 to send
+the Kiss-o'-Death packet that it has put in reply instead.  Only something
+that looks like a client request gets a reply; anything else is dropped. */
+
+    uint64_t key;
+
+    if (libmsntp_rate <= 0.0 || which < 0 || which >= MAX_SOCKETS ||
+            (key = socket_peer(which,slot)) == 0 ||
+            limit_allow(which,key,now))
+        return 0;
+    if (libmsntp_rate_response != MSNTP_RATE_KOD ||
+            length < NTP_PACKET_MIN || length > NTP_PACKET_MAX ||
+            (request[0]&0x07) != NTP_CLIENT)
+        return 1;
+    pack_kod(reply,request);
+    return 2;
+}
+
+
+
+extern void limit_close (int which) {
+
+/* Forget the clients of a server socket that is being closed. */
+
+    if (which < 0 || which >= MAX_SOCKETS) return;
+    free(tables[which].entries);
+    tables[which].entries = NULL;
+}
@@ -140,41 +140,19 @@ fiddle unless you really have to. */
 #include "kludges.h"
 #undef MAIN
 
+#ifndef ENDIAN_MISSING
+#include <endian.h>
+#endif
+
 /* defined in libmsntp.c */
-extern int libmsntp_errno;
-extern const char *libmsntp_strerror;
-
-
-/* NTP definitions.  Note that these assume 8-bit bytes - sigh.  There is
-little point in parameterising everything, as it is neither feasible nor
-useful.  It would be very useful if more fields could be defined as
-unspecified.  The NTP packet-handling routines contain a lot of extra
-assumptions. */
-
-#define JAN_1970   2208988800.0        /* 1970 - 1900 in seconds */
-#define NTP_SCALE  4294967296.0        /* 2^32, of course! */
-
-#define NTP_PACKET_MIN       48        /* Without authentication */
-#define NTP_PACKET_MAX       68        /* With authentication (ignored) */
-#define NTP_DISP_FIELD        8        /* Offset of dispersion field */
-#define NTP_REFERENCE        16        /* Offset of reference timestamp */
-#define NTP_ORIGINATE        24        /* Offset of originate timestamp */
-#define NTP_RECEIVE          32        /* Offset of receive timestamp */
-#define NTP_TRANSMIT         40        /* Offset of transmit timestamp */
-
-#define NTP_LI_FUDGE          0        /* The current 'status' */
-#define NTP_VERSION           3        /* The current version */
-#define NTP_VERSION_MAX       4        /* The maximum valid version */
-#define NTP_STRATUM          15        /* The current stratum as a server */
-#define NTP_STRATUM_MAX      15        /* The maximum valid stratum */
-#define NTP_POLLING           8        /* The current 'polling interval' */
-#define NTP_PRECISION         0        /* The current 'precision' - 1 sec. */
-
-#define NTP_ACTIVE            1        /* NTP symmetric active request */
-#define NTP_PASSIVE           2        /* NTP symmetric passive response */
-#define NTP_CLIENT            3        /* NTP client request */
-#define NTP_SERVER            4        /* NTP server response */
-#define NTP_BROADCAST         5        /* NTP server broadcast */
+extern THREAD_LOCAL int libmsntp_errno;
+extern THREAD_LOCAL const char *libmsntp_strerror;
+extern int libmsntp_port, libmsntp_pipeline, libmsntp_spacing, libmsntp_timeout,
+    libmsntp_wait, libmsntp_hedging;
+
+
+/* NTP definitions that are used only here.  The packet layout and the rest
+are in header.h. */
 
 #define NTP_INSANITY     3600.0        /* Errors beyond this are hopeless */
 #define RESET_MIN            15        /* Minimum period between resets */
@@ -191,63 +169,80 @@ int verbose = 0,                       /* Default = 0, -v = 1, -V = 2, -W = 3 */
     operation = 0;                     /* Defined in header.h - see action */
 const char *lockname = NULL;           /* The name of the lock file */
 
-#define COUNT_MAX          25          /* Do NOT increase this! */
 #define WEEBLE_FACTOR     1.2          /* See run_server() and run_daemon() */
 #define ETHERNET_MAX        5          /* See run_daemon() and run_client() */
 
-#define action_display      1          /* Just display the result */
-#define action_reset        2          /* Reset using 'settimeofday' */
-#define action_adjust       3          /* Reset using 'adjtime' */
-#define action_broadcast    4          /* Behave as a server, broadcasting */
-#define action_server       5          /* Behave as a server for clients */
-#define action_query        6          /* Query a daemon savefile */
-
 #define save_read_only      1          /* Read the saved state only */
 #define save_read_check     2          /* Read and check it */
 #define save_write          3          /* Write the saved state */
 #define save_clear          4          /* Clear the saved state */
 
 static const char version[] = VERSION; /* For reverse engineering :-) */
-int action = 0,                        /* Defined above - see operation */
+int action = 0,                        /* Defined in header.h - see operation */
     period = 0,                        /* -B value in seconds (broadcast) */
     count = 0,                         /* -c value in seconds */
+    samples = 0,                       /* Packets in daemon estimates */
     delay = 0,                         /* -d or -x value in seconds */
-    attempts = 0,                      /* Packets transmitted up to 2*count */
     waiting = 0,                       /* -d/-c except for in daemon mode */
     locked = 0;                        /* set_lock(1) has been called */
-double outgoing[2*COUNT_MAX],          /* Transmission timestamps */
-    minerr = 0.0,                      /* -e value in seconds */
+client_query client;                   /* The requests sent and the results */
+double minerr = 0.0,                   /* -e value in seconds */
     maxerr = 0.0,                      /* -E value in seconds */
     prompt = 0.0,                      /* -p value in seconds */
     dispersion = 0.0;                  /* The source dispersion in seconds */
-static FILE *savefile = NULL;          /* Holds the data to restart from */
-
-
+FILE *savefile = NULL;                 /* Holds the data to restart from */
+#ifdef __GNUC__
+__attribute__((aligned(CACHE_LINE)))
+#endif
+server_stats server_counters[MAX_SOCKETS];  /* See header.h */
+#ifdef __GNUC__
+__attribute__((aligned(CACHE_LINE)))
+#endif
+server_latency server_latencies[MAX_SOCKETS];  /* Ditto */
+double server_started = 0.0;           /* When the statistics were reset */
+static double weeble = 1.0;            /* When to report them next */
 
 
-/* The unpacked NTP data structure, with all the fields even remotely relevant
-to SNTP. */
-
-typedef struct NTP_DATA {
-    unsigned char status, version, mode, stratum, polling, precision;
-    double dispersion, reference, originate, receive, transmit, current;
-} ntp_data;
-
 
 
 /* The following structure is used to keep a record of packets in daemon mode;
 it contains only the information that is actually used for the drift and error
-calculations. */
+calculations.  It is a circular buffer of the last 'samples' packets, kept as
+separate arrays so that the few scans over them are cheap, together with the
+weighted sums that the regression needs, so that a packet costs the same
+however many are kept.  Clock corrections are not applied to the stored times
+and offsets, but accumulated in base, which is added to the times and taken
+from the offsets.  The sums are taken relative to a reference packet (when0,
+offset0), and are recalculated from scratch every 'samples' packets, so that
+neither rounding errors nor cancellation can build up.
+
+The packets whose dispersions are larger than those of all later ones are
+queued in peaks, so that the oldest of them is the maximum, and those whose
+errors are smaller than those of all later ones in lows, because no others can
+be the best to correct from.  Each packet joins and leaves a queue only once. */
 
 typedef struct {
-    double dispersion, weight, when, offset, error;
-} data_record;
+    int index[WINDOW_MAX];             /* A circular buffer of packets */
+    int first, length;
+} data_queue;
+
+typedef struct {
+    double dispersion[WINDOW_MAX], weight[WINDOW_MAX], when[WINDOW_MAX],
+        offset[WINDOW_MAX], error[WINDOW_MAX];
+    double base, when0, offset0, sum_w, sum_wt, sum_wo, sum_wd, sum_wtt,
+        sum_wto, sum_woo, sum_wee, sum_wdd;
+    data_queue peaks, lows;
+    int total, index, updates,
+        unsaved;                       /* Index, or -1 for none, -2 for all */
+} data_window;
+
+static data_window records;            /* Only one daemon runs at once */
 
 
 
 void fatal (int errnum, const char *message, const char *insert) {
 
-/* Set libmsntp_errno and libmsntp_strerror. */
+/* Set libmsntp_errno and libmsntp_strerror, which belong to the thread. */
 
     libmsntp_errno = errnum;
     if (message != NULL)
@@ -273,15 +268,84 @@ helpfully.  This is called before any files or sockets are opened. */
 
 
 
+double stamp_to_double (ntp_stamp stamp) {
+
+/* Convert a timestamp to seconds since 1900, for the places that need to do
+arithmetic on absolute times rather than differences. */
+
+    return (double)(stamp>>32)+(double)(stamp&0xffffffffu)/NTP_SCALE;
+}
+
+
+
+double stamp_diff (ntp_stamp later, ntp_stamp earlier) {
+
+/* Return later-earlier in seconds.  The difference is taken in integers first,
+so it is exact, and wraps correctly across the 2036 era boundary. */
+
+    return (double)(int64_t)(later-earlier)/NTP_SCALE;
+}
+
+
+
+uint64_t stamp_nanos (ntp_stamp value) {
+
+/* Convert a (non-negative) difference of timestamps to nanoseconds, in integers
+so that nothing is lost for long running totals. */
+
+    return (value>>32)*1000000000ull+
+        (((value&0xffffffffull)*1000000000ull)>>32);
+}
+
+
+
+ntp_stamp get_stamp (const unsigned char *field) {
+
+/* Load a big-endian 64-bit timestamp from a packet. */
+
+#ifdef ENDIAN_MISSING
+    return ((ntp_stamp)field[0]<<56)|((ntp_stamp)field[1]<<48)|
+        ((ntp_stamp)field[2]<<40)|((ntp_stamp)field[3]<<32)|
+        ((ntp_stamp)field[4]<<24)|((ntp_stamp)field[5]<<16)|
+        ((ntp_stamp)field[6]<<8)|(ntp_stamp)field[7];
+#else
+    uint64_t x;
+
+    memcpy(&x,field,8);
+    return be64toh(x);
+#endif
+}
+
+
+
+void put_stamp (unsigned char *field, ntp_stamp stamp) {
+
+/* Store a timestamp into a packet in big-endian order. */
+
+#ifdef ENDIAN_MISSING
+    int i;
+
+    for (i = 7; i >= 0; --i, stamp >>= 8) field[i] = (unsigned char)stamp;
+#else
+    uint64_t x = htobe64(stamp);
+
+    memcpy(field,&x,8);
+#endif
+}
+
+
+
 void display_data (ntp_data *data) {
 
 /* This formats the essential NTP data, as a debugging aid. */
 
     fprintf(stderr,"sta=%d ver=%d mod=%d str=%d pol=%d dis=%.6f ref=%.6f\n",
         data->status,data->version,data->mode,data->stratum,data->polling,
-        data->dispersion,data->reference);
-    fprintf(stderr,"ori=%.6f rec=%.6f\n",data->originate,data->receive);
-    fprintf(stderr,"tra=%.6f cur=%.6f\n",data->transmit,data->current);
+        data->dispersion,stamp_to_double(data->reference));
+    fprintf(stderr,"ori=%.6f rec=%.6f\n",stamp_to_double(data->originate),
+        stamp_to_double(data->receive));
+    fprintf(stderr,"tra=%.6f cur=%.6f\n",stamp_to_double(data->transmit),
+        stamp_to_double(data->current));
 }
 
 
@@ -310,66 +374,40 @@ void pack_ntp (unsigned char *packet, int length, ntp_data *data) {
 /* Pack the essential data into an NTP packet, bypassing struct layout and
 endian problems.  Note that it ignores fields irrelevant to SNTP. */
 
-    int i, k;
-    double d;
-
     memset(packet,0,(size_t)length);
     packet[0] = (data->status<<6)|(data->version<<3)|data->mode;
     packet[1] = data->stratum;
     packet[2] = data->polling;
     packet[3] = data->precision;
-    d = data->originate/NTP_SCALE;
-    for (i = 0; i < 8; ++i) {
-        if ((k = (int)(d *= 256.0)) >= 256) k = 255;
-        packet[NTP_ORIGINATE+i] = k;
-        d -= k;
-    }
-    d = data->receive/NTP_SCALE;
-    for (i = 0; i < 8; ++i) {
-        if ((k = (int)(d *= 256.0)) >= 256) k = 255;
-        packet[NTP_RECEIVE+i] = k;
-        d -= k;
-    }
-    d = data->transmit/NTP_SCALE;
-    for (i = 0; i < 8; ++i) {
-        if ((k = (int)(d *= 256.0)) >= 256) k = 255;
-        packet[NTP_TRANSMIT+i] = k;
-        d -= k;
-    }
+    put_stamp(&packet[NTP_ORIGINATE],data->originate);
+    put_stamp(&packet[NTP_RECEIVE],data->receive);
+    put_stamp(&packet[NTP_TRANSMIT],data->transmit);
 }
 
 
 
-void unpack_ntp (ntp_data *data, unsigned char *packet, int length) {
+void unpack_ntp (ntp_data *data, unsigned char *packet, int length,
+    ntp_stamp current) {
 
 /* Unpack the essential data from an NTP packet, bypassing struct layout and
-endian problems.  Note that it ignores fields irrelevant to SNTP. */
-
-    int i;
-    double d;
+endian problems.  Note that it ignores fields irrelevant to SNTP.  The time of
+arrival is current if the kernel recorded it, and is read now otherwise. */
 
-    data->current = current_time(JAN_1970);    /* Best to come first */
+    data->current = (current != 0 ? current : current_stamp());
     data->status = (packet[0] >> 6);
     data->version = (packet[0] >> 3)&0x07;
     data->mode = packet[0]&0x07;
     data->stratum = packet[1];
     data->polling = packet[2];
     data->precision = packet[3];
-    d = 0.0;
-    for (i = 0; i < 4; ++i) d = 256.0*d+packet[NTP_DISP_FIELD+i];
-    data->dispersion = d/65536.0;
-    d = 0.0;
-    for (i = 0; i < 8; ++i) d = 256.0*d+packet[NTP_REFERENCE+i];
-    data->reference = d/NTP_SCALE;
-    d = 0.0;
-    for (i = 0; i < 8; ++i) d = 256.0*d+packet[NTP_ORIGINATE+i];
-    data->originate = d/NTP_SCALE;
-    d = 0.0;
-    for (i = 0; i < 8; ++i) d = 256.0*d+packet[NTP_RECEIVE+i];
-    data->receive = d/NTP_SCALE;
-    d = 0.0;
-    for (i = 0; i < 8; ++i) d = 256.0*d+packet[NTP_TRANSMIT+i];
-    data->transmit = d/NTP_SCALE;
+    data->dispersion = ((unsigned long)packet[NTP_DISP_FIELD]<<24|
+        (unsigned long)packet[NTP_DISP_FIELD+1]<<16|
+        (unsigned long)packet[NTP_DISP_FIELD+2]<<8|
+        (unsigned long)packet[NTP_DISP_FIELD+3])/NTP_SHORT;
+    data->reference = get_stamp(&packet[NTP_REFERENCE]);
+    data->originate = get_stamp(&packet[NTP_ORIGINATE]);
+    data->receive = get_stamp(&packet[NTP_RECEIVE]);
+    data->transmit = get_stamp(&packet[NTP_TRANSMIT]);
 }
 
 
@@ -384,7 +422,8 @@ designing an alternative protocol (however much better it might be). */
 
     data->status = NTP_LI_FUDGE<<6;
     data->stratum = NTP_STRATUM;
-    data->reference = data->dispersion = 0.0;
+    data->reference = 0;
+    data->dispersion = 0.0;
     if (mode == NTP_SERVER) {
         data->mode = (data->mode == NTP_CLIENT ? NTP_SERVER : NTP_PASSIVE);
         data->originate = data->transmit;
@@ -394,28 +433,32 @@ designing an alternative protocol (however much better it might be). */
         data->mode = mode;
         data->polling = NTP_POLLING;
         data->precision = NTP_PRECISION;
-        data->receive = data->originate = 0.0;
+        data->receive = data->originate = 0;
     }
-    data->current = data->transmit = current_time(JAN_1970);
+    data->current = data->transmit = current_stamp();
 }
 
 
 
-int read_packet (int which, ntp_data *data, double *off, double *err) {
+int check_packet (int which, client_query *query, ntp_data *data,
+    unsigned char *receive, int length, ntp_stamp current, double *off,
+    double *err) {
 
 /* Check the packet and work out the offset and optionally the error.  Note
 that this contains more checking than xntp does.  This returns 0 for success, 1
-for failure and 2 for an ignored broadcast packet (a kludge for servers).  Note
- that it must not change its arguments if it fails. */
+for failure and 2 for a packet to be ignored: a broadcast (a kludge for
+servers) or a second reply to a hedged request.  Note that it must not change
+its arguments if it fails.  Responses are matched with the requests recorded in
+query, which servers do not need; a query says what it is doing itself, so that
+clients in other threads do not depend on the globals. */
 
-    unsigned char receive[NTP_PACKET_MAX+1];
     double delay1, delay2, x, y;
-    int ret, response = 0, failed, length, i, k;
+    ntp_stamp sent = 0;
+    int role = (query == NULL ? operation : query->operation),
+        response = 0, failed, i, k;
 
-/* Read the packet and deal with diagnostics. */
+/* Deal with diagnostics. */
 
-    if (ret = read_socket(which,receive,NTP_PACKET_MAX+1,waiting,&length))
-        return ret;
     if (length < NTP_PACKET_MIN || length > NTP_PACKET_MAX) {
         if (verbose)
             fprintf(stderr,"%s: bad length %d for NTP packet on socket %d\n",
@@ -426,16 +469,16 @@ for failure and 2 for an ignored broadcast packet (a kludge for servers).  Note
         fprintf(stderr,"Incoming packet on socket %d:\n",which);
         display_packet(receive,length);
     }
-    unpack_ntp(data,receive,length);
+    unpack_ntp(data,receive,length,current);
     if (verbose > 2) display_data(data);
 
 /* Start by checking that the packet looks reasonable.  Be a little paranoid,
 but allow for version 1 semantics and sick clients. */
 
-    if (operation == op_server) {
+    if (role == op_server) {
         if (data->mode == NTP_BROADCAST) return 2;
         failed = (data->mode != NTP_CLIENT && data->mode != NTP_ACTIVE);
-    } else if (operation == op_listen)
+    } else if (role == op_listen)
         failed = (data->mode != NTP_BROADCAST);
     else {
         failed = (data->mode != NTP_SERVER && data->mode != NTP_PASSIVE);
@@ -455,14 +498,15 @@ but allow for version 1 semantics and sick clients. */
 have to guess.  Any full NTP server perpetrating completely unsynchronised
 packets is an abomination, anyway, so reject it. */
 
-    delay1 = data->transmit-data->receive;
-    delay2 = data->current-data->originate;
+    delay1 = stamp_diff(data->transmit,data->receive);
+    delay2 = stamp_diff(data->current,data->originate);
     failed = ((data->stratum != 0 && data->stratum != NTP_STRATUM_MAX &&
-                data->reference == 0.0) ||
-            (operation != op_server && data->transmit == 0.0));
+                data->reference == 0) ||
+            (role != op_server && data->transmit == 0));
     if (response &&
-            (data->originate == 0.0 || data->receive == 0.0 ||
-                (data->reference != 0.0 && data->receive < data->reference) ||
+            (data->originate == 0 || data->receive == 0 ||
+                (data->reference != 0 &&
+                    stamp_diff(data->receive,data->reference) < 0.0) ||
                 delay1 < 0.0 || delay1 > NTP_INSANITY || delay2 < 0.0 ||
                 data->dispersion > NTP_INSANITY))
         failed = 1;
@@ -475,16 +519,30 @@ packets is an abomination, anyway, so reject it. */
     }
 
 /* If it is a response, check that it corresponds to one of our requests and
-has got here in a reasonable length of time. */
+has got here in a reasonable length of time.  If the kernel said when the
+request actually left, use that rather than the time in the packet, which was
+read before it was even built.  Both copies of a hedged request are settled by
+the first reply to either, so a reply to the other is ignored. */
 
     if (response) {
         k = 0;
-        for (i = 0; i < attempts; ++i)
-            if (data->originate == outgoing[i]) {
-                outgoing[i] = 0.0;
+        for (i = 0; i < query->attempts; ++i)
+            if (data->originate == query->outgoing[i]) {
+                query->outgoing[i] = 0;
+                if (query->twins[i] > 0 &&
+                        query->outgoing[query->twins[i]-1] == 0) {
+                    if (verbose > 2)
+                        fprintf(stderr,"Late reply to hedged request\n");
+                    return 2;
+                }
+                sent = query->departures[i];
                 ++k;
             }
-        if (k != 1 || delay2 > NTP_INSANITY) {
+        if (k == 1 && sent != 0) {
+            data->originate = sent;
+            delay2 = stamp_diff(data->current,sent);
+        }
+        if (k != 1 || delay2 < 0.0 || delay2 > NTP_INSANITY) {
             if (verbose)
                 fprintf(stderr,
                     "%s: bad response from NTP server rejected on socket %d\n",
@@ -496,18 +554,26 @@ has got here in a reasonable length of time. */
 /* Now return the time information.  If it is a server response, it contains
 enough information that we can be almost certain that we have not been fooled
 too badly.  Heaven help us with broadcasts - make a wild kludge here, and see
-elsewhere for other kludges. */
-
-    if (dispersion < data->dispersion) dispersion = data->dispersion;
-    if (operation == op_listen || operation == op_server) {
-        *off = data->transmit-data->current;
+elsewhere for other kludges.  Servers have no use for the dispersion, and may
+be running in several threads at once, so they leave it alone; so do queries,
+which keep their own, along with the round trip. */
+
+    if (query != NULL) {
+        if (query->dispersion < data->dispersion)
+            query->dispersion = data->dispersion;
+        if (response) query->roundtrip = delay2;
+    } else if (role != op_server && dispersion < data->dispersion)
+        dispersion = data->dispersion;
+    if (role == op_listen || role == op_server) {
+        *off = stamp_diff(data->transmit,data->current);
         *err = NTP_INSANITY;
     } else {
-        x = data->receive-data->originate;
-        y = (data->transmit == 0.0 ? 0.0 : data->transmit-data->current);
+        x = stamp_diff(data->receive,data->originate);
+        y = (data->transmit == 0 ? 0.0 :
+            stamp_diff(data->transmit,data->current));
         *off = 0.5*(x+y);
         *err = x-y;
-        x = data->current-data->originate;
+        x = delay2;
         if (0.5*x > *err) *err = 0.5*x;
     }
     return 0;
@@ -515,6 +581,56 @@ elsewhere for other kludges. */
 
 
 
+int read_packet (int which, client_query *query, ntp_data *data, double *off,
+    double *err) {
+
+/* Read a packet from the socket and pass it to check_packet(), along with the
+kernel's time of arrival if there is one.  Clients also pick up when the kernel
+sent the last request, which is known by the time a reply comes back.  This
+returns the same values as check_packet(), or the error from read_socket().
+Servers apply the rate limit first, and return 3 for a packet that it stopped,
+after sending any Kiss-o'-Death reply.  The callers use the global dispersion,
+so it is kept up to date here.  A daemon that can be woken waits in slices of
+at most libmsntp_wait, and gives up as if it had timed out once woken. */
+
+    unsigned char receive[NTP_PACKET_MAX+1], reply[NTP_PACKET_MIN];
+    int ret, length, slice;
+    int64_t deadline;
+
+    deadline = monotonic_nanos()+(int64_t)waiting*1000000000;
+    while (1) {
+        slice = millis_left(deadline);
+        if (operation == op_client && can_wake() && slice > libmsntp_wait)
+            slice = libmsntp_wait;
+        ret = read_socket(which,receive,NTP_PACKET_MAX+1,slice,&length);
+        if (ret != -1 || errno != 0 || operation != op_client ||
+                ! can_wake() || millis_left(deadline) == 0 || do_nothing(0))
+            break;
+    }
+    if (ret) return ret;
+    if (operation == op_server) {
+        STAT_ADD(which,batches,1);
+        STAT_ADD(which,bytes_received,length);
+        if ((ret = limit_packet(which,0,receive,length,current_stamp(),
+                reply)) != 0) {
+            STAT_ADD(which,limited,1);
+            if (ret == 2 && (ret = write_socket(which,reply,NTP_PACKET_MIN)))
+                return ret;
+            return 3;
+        }
+    }
+    if (operation == op_client && query->latest >= 0 &&
+            query->departures[query->latest] == 0)
+        query->departures[query->latest] = socket_departure(which);
+    if ((ret = check_packet(which,query,data,receive,length,
+            socket_arrival(which,0),off,err)) == 0 && query != NULL &&
+            dispersion < data->dispersion)
+        dispersion = data->dispersion;
+    return ret;
+}
+
+
+
 void format_time (char *text, int length, double offset, double error,
     double drift, double drifterr) {
 
@@ -642,6 +758,78 @@ correction not having completed, but it will rarely help much. */
 
 
 
+void record_latency (int which, uint64_t nanos) {
+
+/* Count a reply that took nanos to send in the histogram of socket which.  The
+bucket is found from the top three bits of the value, in the same way as a
+floating-point number. */
+
+    uint64_t *bucket;
+    int top, index;
+
+    if (nanos < 4)
+        index = (int)nanos;
+    else {
+#ifdef __GNUC__
+        top = 63-__builtin_clzll(nanos);
+#else
+        for (top = 2; (nanos >> (top+1)) != 0; ++top)
+            ;
+#endif
+        index = 4*(top-1)+(int)((nanos >> (top-2))&3);
+        if (index >= LATENCY_BUCKETS) index = LATENCY_BUCKETS-1;
+    }
+    bucket = &server_latencies[which].buckets[index];
+#ifdef __GNUC__
+    __atomic_store_n(bucket,__atomic_load_n(bucket,__ATOMIC_RELAXED)+1,
+        __ATOMIC_RELAXED);
+#else
+    ++*bucket;
+#endif
+}
+
+
+
+uint64_t latency_quantile (double fraction) {
+
+/* Return the reply time below which that fraction of the replies from all
+sockets fell, as the middle of its bucket, or 0 if there are none. */
+
+    uint64_t totals[LATENCY_BUCKETS], total = 0, sum = 0, low;
+    int which, index;
+
+    memset(totals,0,sizeof(totals));
+    for (which = 0; which < MAX_SOCKETS; ++which)
+        for (index = 0; index < LATENCY_BUCKETS; ++index)
+#ifdef __GNUC__
+            totals[index] += __atomic_load_n(
+                &server_latencies[which].buckets[index],__ATOMIC_RELAXED);
+#else
+            totals[index] += server_latencies[which].buckets[index];
+#endif
+    for (index = 0; index < LATENCY_BUCKETS; ++index) total += totals[index];
+    if (total == 0) return 0;
+    for (index = 0; index < LATENCY_BUCKETS-1; ++index)
+        if ((sum += totals[index]) >= fraction*(double)total) break;
+    if (index < 4) return (uint64_t)index;
+    low = (uint64_t)(4+(index&3)) << (index/4-1);
+    return low+((uint64_t)1 << (index/4-1))/2;
+}
+
+
+
+void reset_server_stats (void) {
+
+/* Clear the statistics, when a server starts. */
+
+    memset(server_counters,0,sizeof(server_counters));
+    memset(server_latencies,0,sizeof(server_latencies));
+    server_started = current_time(JAN_1970);
+    weeble = 1.0;
+}
+
+
+
 int run_server (void) {
 
 /* In op_server mode, serves SNTP client requests; in op_broadcast mode,
@@ -653,16 +841,20 @@ connections until it receives one and replies, or it times out. In broadcast
 mode, it sends a broadcast packet and returns immediately. */
 
 /* In server mode, provide some tracing of normal running (but not too much,
-except when debugging!) */
+except when debugging!)  The counts are the statistics kept since the server
+started, which libmsntp also reports. */
 
     unsigned char transmit[NTP_PACKET_MIN];
     ntp_data data;
-    double started = current_time(JAN_1970), successes = 0.0, failures = 0.0,
-        broadcasts = 0.0, weeble = 1.0, x, y;
+    ntp_stamp now;
+    double successes, failures, broadcasts, x, y;
     int i, j;
 
     if (operation == op_server) {
-        x = current_time(JAN_1970)-started;
+        successes = (double)STAT_READ(0,accepted);
+        failures = (double)STAT_READ(0,rejected);
+        broadcasts = (double)STAT_READ(0,broadcasts);
+        x = current_time(JAN_1970)-server_started;
         if (verbose && x/3600.0+successes+failures >= weeble) {
             weeble *= WEEBLE_FACTOR;
             x -= 3600.0*(i = (int)(x/3600.0));
@@ -682,15 +874,17 @@ we could skip almost all of the decoding, but it provides a healthy amount of
 error detection.  We could print some information on incoming packets, but the
 code is not structured to do this very helpfully. */
 
-        i = read_packet(0,&data,&x,&y);
+        i = read_packet(0,NULL,&data,&x,&y);
         if (i == 2) {
-            ++broadcasts;
+            STAT_ADD(0,broadcasts,1);
+            return 0;
+        } else if (i == 3)
             return 0;
-        } else if (i != 0) {
-            ++failures;
+        else if (i != 0) {
+            if (i == 1) STAT_ADD(0,rejected,1);
             return i;
         } else {
-            ++successes;
+            STAT_ADD(0,accepted,1);
             make_packet(&data,NTP_SERVER);
         }
     } else {
@@ -703,13 +897,240 @@ code is not structured to do this very helpfully. */
     }
     pack_ntp(transmit,NTP_PACKET_MIN,&data);
     if (verbose > 2) display_packet(transmit,NTP_PACKET_MIN);
-    return write_socket(0,transmit,NTP_PACKET_MIN);
+
+/* Take the transmit time again at the last moment, so that the time spent
+building the reply does not count against its accuracy. */
+
+    put_stamp(&transmit[NTP_TRANSMIT],now = current_stamp());
+    if (operation != op_server) return write_socket(0,transmit,NTP_PACKET_MIN);
+    if (now > data.receive) {
+        STAT_ADD(0,service_ns,stamp_nanos(now-data.receive));
+        record_latency(0,stamp_nanos(now-data.receive));
+    }
+    if (i = write_socket(0,transmit,NTP_PACKET_MIN))
+        STAT_ADD(0,send_failures,1);
+    else
+        STAT_ADD(0,bytes_sent,NTP_PACKET_MIN);
+    return i;
+}
+
+
+
+int run_server_batch (int which, int max, int timeout) {
+
+/* This is the batched form of run_server() in op_server mode, used only by
+libmsntp.  It waits up to timeout milliseconds for requests, drains up to max
+of them from socket which in one go, and sends all of the replies together.
+The replies are exactly what run_server() would send.  It returns 0 if any
+requests were read, and -1 if it timed out.
+
+The packets are checked, unpacked and packed by the batch code in codec.c,
+except when diagnostics are wanted, when check_packet() explains what it
+rejects.  As in run_server(), the receive times come from the kernel if
+possible and the transmit times are taken just before sending. */
+
+    unsigned char receive[BATCH_MAX][NTP_PACKET_MAX+1],
+        transmit[BATCH_MAX][NTP_PACKET_MIN], kisses[BATCH_MAX][NTP_PACKET_MIN];
+    int lengths[BATCH_MAX], slots[BATCH_MAX], kissed[BATCH_MAX], number,
+        replies = 0, limited = 0, kisses_out = 0, i, ret;
+    char verdicts[BATCH_MAX];
+    ntp_data data[BATCH_MAX];
+    ntp_stamp now, service = 0;
+    uint64_t bytes = 0, broadcasts = 0;
+    double x, y;
+
+    if (ret = read_socket_batch(which,receive,NTP_PACKET_MAX+1,lengths,max,
+            timeout,&number))
+        return ret;
+
+/* Apply the rate limit before doing anything else with the packets.  Those it
+stops get verdict 3, and any Kiss-o'-Death replies are sent separately. */
+
+    now = current_stamp();
+    memset(verdicts,0,(size_t)number);
+    for (i = 0; i < number; ++i)
+        if ((ret = limit_packet(which,i,receive[i],lengths[i],now,
+                kisses[kisses_out])) != 0) {
+            verdicts[i] = 3;
+            ++limited;
+            if (ret == 2) kissed[kisses_out++] = i;
+        }
+    if (verbose) {
+        for (i = 0; i < number; ++i)
+            if (verdicts[i] == 3)
+                continue;
+            else if ((ret = check_packet(which,NULL,&data[replies],
+                    receive[i],lengths[i],socket_arrival(which,i),&x,&y)) == 0)
+                slots[replies++] = i;
+            else if (ret == 2)
+                ++broadcasts;
+    } else {
+        if (limited == 0)
+            check_batch(verdicts,receive,NTP_PACKET_MAX+1,lengths,number);
+        else
+            for (i = 0; i < number; ++i)
+                if (verdicts[i] != 3)
+                    check_batch(&verdicts[i],receive[i],NTP_PACKET_MAX+1,
+                        &lengths[i],1);
+        for (i = 0; i < number; ++i)
+            if (verdicts[i] == 0)
+                slots[replies++] = i;
+            else if (verdicts[i] == 2)
+                ++broadcasts;
+        unpack_batch(data,receive,NTP_PACKET_MAX+1,slots,replies,now);
+        for (i = 0; i < replies; ++i)
+            if ((now = socket_arrival(which,slots[i])) != 0)
+                data[i].current = now;
+    }
+
+/* Keep the statistics in local variables, and update the shared ones once per
+batch. */
+
+    for (i = 0; i < number; ++i) bytes += lengths[i];
+    STAT_ADD(which,batches,1);
+    STAT_ADD(which,bytes_received,bytes);
+    STAT_ADD(which,accepted,replies);
+    STAT_ADD(which,broadcasts,broadcasts);
+    STAT_ADD(which,limited,limited);
+    STAT_ADD(which,rejected,number-replies-broadcasts-limited);
+    if (kisses_out > 0 &&
+            (ret = write_socket_batch(which,kisses,NTP_PACKET_MIN,kissed,
+                kisses_out)))
+        return ret;
+    if (replies == 0) return 0;
+    for (i = 0; i < replies; ++i) {
+        make_packet(&data[i],NTP_SERVER);
+        if (verbose > 2) {
+            fprintf(stderr,"Outgoing packet:\n");
+            display_data(&data[i]);
+        }
+    }
+    pack_batch(transmit,NTP_PACKET_MIN,data,replies);
+    if (verbose > 2)
+        for (i = 0; i < replies; ++i)
+            display_packet(transmit[i],NTP_PACKET_MIN);
+    now = current_stamp();
+    for (i = 0; i < replies; ++i) {
+        put_stamp(&transmit[i][NTP_TRANSMIT],now);
+        if (now > data[i].receive) {
+            service += now-data[i].receive;
+            record_latency(which,stamp_nanos(now-data[i].receive));
+        }
+    }
+    STAT_ADD(which,service_ns,stamp_nanos(service));
+    if (ret = write_socket_batch(which,transmit,NTP_PACKET_MIN,slots,replies))
+        STAT_ADD(which,send_failures,replies);
+    else
+        STAT_ADD(which,bytes_sent,replies*NTP_PACKET_MIN);
+    return ret;
+}
+
+
+
+void clear_window (data_window *record) {
+
+/* Empty the record of packets, without touching the packets themselves. */
+
+    record->base = record->when0 = record->offset0 = 0.0;
+    record->sum_w = record->sum_wt = record->sum_wo = record->sum_wd = 0.0;
+    record->sum_wtt = record->sum_wto = record->sum_woo = 0.0;
+    record->sum_wee = record->sum_wdd = 0.0;
+    record->total = record->index = record->updates = 0;
+    record->peaks.first = record->peaks.length = 0;
+    record->lows.first = record->lows.length = 0;
+    record->unsaved = -1;
+}
+
+
+
+void sum_record (data_window *record, int i, double sign) {
+
+/* Add packet i to the sums, or take it away again if sign is -1. */
+
+    double w = sign*record->weight[i], t = record->when[i]-record->when0,
+        o = record->offset[i]-record->offset0, d = record->dispersion[i],
+        e = record->error[i];
+
+    record->sum_w += w;
+    record->sum_wt += w*t;
+    record->sum_wo += w*o;
+    record->sum_wd += w*d;
+    record->sum_wtt += w*t*t;
+    record->sum_wto += w*t*o;
+    record->sum_woo += w*o*o;
+    record->sum_wee += w*e*e;
+    record->sum_wdd += w*d*d;
+}
+
+
+
+void join_queue (data_queue *queue, const double *values, double sign,
+    int i) {
+
+/* Add packet i, which must be the latest, to a queue of the largest values if
+sign is 1, or the smallest if it is -1.  Any earlier ones that it is at least
+as good as can never be the best again, so they leave. */
+
+    int last;
+
+    while (queue->length > 0) {
+        if ((last = queue->first+queue->length-1) >= samples) last -= samples;
+        if (sign*values[queue->index[last]] > sign*values[i]) break;
+        --queue->length;
+    }
+    if ((last = queue->first+queue->length++) >= samples) last -= samples;
+    queue->index[last] = i;
 }
 
 
 
-double estimate_stats (int *a_total, int *a_index, data_record *record,
-    double correction, double *a_disp, double *a_when, double *a_offset,
+void leave_queue (data_queue *queue, int i) {
+
+/* Remove packet i, which must be the oldest, from a queue if it is there. */
+
+    if (queue->length > 0 && queue->index[queue->first] == i) {
+        if (++queue->first >= samples) queue->first = 0;
+        --queue->length;
+    }
+}
+
+
+
+void rebuild_window (data_window *record) {
+
+/* Fold the base into the packets, so that it does not grow without limit, and
+recalculate the sums and queues from scratch, relative to the oldest packet.
+This is the only place where the cost depends on the number of packets, and it
+is done only once every 'samples' packets.  The packets all need saving again
+afterwards. */
+
+    int i, j;
+
+    if ((j = record->index-record->total) < 0) j += samples;
+    record->when0 = record->when[j]+record->base;
+    record->offset0 = record->offset[j]-record->base;
+    record->sum_w = record->sum_wt = record->sum_wo = record->sum_wd = 0.0;
+    record->sum_wtt = record->sum_wto = record->sum_woo = 0.0;
+    record->sum_wee = record->sum_wdd = 0.0;
+    record->peaks.first = record->peaks.length = 0;
+    record->lows.first = record->lows.length = 0;
+    for (i = 0; i < record->total; ++i) {
+        record->when[j] += record->base;
+        record->offset[j] -= record->base;
+        sum_record(record,j,1.0);
+        join_queue(&record->peaks,record->dispersion,1.0,j);
+        join_queue(&record->lows,record->error,-1.0,j);
+        if (++j >= samples) j = 0;
+    }
+    record->base = 0.0;
+    record->updates = 0;
+    record->unsaved = -2;
+}
+
+
+
+double estimate_stats (data_window *record, double correction,
+    double *a_disp, double *a_when, double *a_offset,
     double *a_error, double *a_drift, double *a_drifterr, int *a_wait,
     int update) {
 
@@ -718,53 +1139,73 @@ do now.  It returns the timestamp relevant to the correction.  If broadcasts
 are rare and the drift is large, it will fail - you should then use a better
 synchronisation method.  It will also fail if something goes severely wrong
 (e.g. if the local clock is reset by another process or the transmission errors
-are beyond reason).
+are beyond reason), in which case it returns a negative value.
 
 There is a kludge for synchronisation loss during down time.  If it detects
 this, it will update only the history data and return zero; this is then
 handled specially in run_daemon().  While it could correct the offset, this
-might not always be the right thing to do. */
+might not always be the right thing to do.
+
+Updating the sums and queues does not depend on the number of packets kept,
+except for the occasional recalculation of the sums (see data_window).  The
+final choice of packet looks at every one in the lows queue, which is usually
+only a few, but is all of them if the errors rise steadily; so the cost is
+usually constant, but O(n) in the number of packets kept at worst. */
 
-    double weight, disp, when, offset, error, drift, drifterr,
-        now, e, w, x, y, z;
-    int total = *a_total, index = *a_index, wait = *a_wait, i;
+    double weight, disp, when, offset, error, drift, drifterr, base,
+        now, e, x, y, z;
+    int total, index = record->index, wait = *a_wait, i, j;
     char text[50];
  
-/* Correct the previous data and store a new entry in the circular buffer. */
+/* Correct the previous data, by way of the base, and store a new entry in the
+circular buffer, replacing the oldest one in the sums and queues if it is full.
+The first entry is the reference for the sums until they are recalculated. */
 
-    for (i = 0; i < total; ++i) {
-        record[i].when += correction;
-        record[i].offset -= correction;
-    }
+    base = (record->base += correction);
     if (update) {
-        record[index].dispersion = *a_disp;
-        record[index].when = *a_when;
-        record[index].offset = *a_offset;
+        if (record->total >= samples) {
+            sum_record(record,index,-1.0);
+            leave_queue(&record->peaks,index);
+            leave_queue(&record->lows,index);
+        }
+        record->dispersion[index] = *a_disp;
+        record->when[index] = *a_when-base;
+        record->offset[index] = *a_offset+base;
         if (verbose > 1)
             fprintf(stderr,"%s: corr=%.3f when=%.3f disp=%.3f off=%.3f",
                 argv0,correction,*a_when,*a_disp,*a_offset); /* See below */
         if (operation == op_listen) {
             if (verbose > 1) fprintf(stderr,"\n");
-            record[index].error = minerr;
-            record[index].weight = 1.0;
+            record->error[index] = minerr;
+            record->weight[index] = 1.0;
         } else {
             if (verbose > 1) fprintf(stderr," err=%.3f\n",*a_error);
-            record[index].error = x = *a_error;
-            record[index].weight = 1.0/(x > minerr ? x*x : minerr*minerr);
+            record->error[index] = x = *a_error;
+            record->weight[index] = 1.0/(x > minerr ? x*x : minerr*minerr);
+        }
+        if (record->total == 0) {
+            record->when0 = record->when[index];
+            record->offset0 = record->offset[index];
         }
-        if (++index >= count) index = 0;
-        *a_index = index;
-        if (++total > count) total = count;
-        *a_total = total;
+        sum_record(record,index,1.0);
+        join_queue(&record->peaks,record->dispersion,1.0,index);
+        join_queue(&record->lows,record->error,-1.0,index);
+        record->unsaved = (record->unsaved == -1 ? index : -2);
+        if (++record->index >= samples) record->index = 0;
+        if (++record->total > samples) record->total = samples;
+        if (++record->updates >= samples) rebuild_window(record);
         if (verbose > 2)
-            fprintf(stderr,"corr=%.6f tot=%d ind=%d\n",correction,total,index);
+            fprintf(stderr,"corr=%.6f tot=%d ind=%d\n",
+                correction,record->total,record->index);
     }
+    total = record->total;
+    base = record->base;
 
 /* If there is insufficient data yet, use the latest estimates and return
 forthwith.  Note that this will not work for broadcasts, but they will be
 disabled in run_daemon(). */
 
-    if ((operation == op_listen && total < count && update) || total < 3) {
+    if ((operation == op_listen && total < samples && update) || total < 3) {
         *a_drift = 0.0;
         *a_drifterr = -1.0;
         *a_wait = delay;
@@ -775,34 +1216,26 @@ disabled in run_daemon(). */
 not subject to the central limit theorem.  Unfortunately, the variation in the
 source's dispersion is our only indication of how consistent its clock is. */
 
-    disp = weight = when = offset = y = 0.0;
-    for (i = 0; i < total; ++i) {
-        weight += w = record[i].weight;
-        when += w*record[i].when;
-        offset += w*record[i].offset;
-        y += w*record[i].dispersion;
-        if (disp < record[i].dispersion)
-            disp = record[i].dispersion;
-    }
-    when /= weight;
-    offset /= weight;
-    y /= weight;
+    weight = record->sum_w;
+    when = record->sum_wt/weight;
+    offset = record->sum_wo/weight;
+    y = record->sum_wd/weight;
+    disp = record->dispersion[record->peaks.index[record->peaks.first]];
     if (verbose > 2)
         fprintf(stderr,"disp=%.6f wgt=%.3f when=%.6f off=%.6f\n",
-            disp,weight,when,offset);
+            disp,weight,record->when0+base+when,record->offset0-base+offset);
 
 /* If there is enough data, estimate the drift and errors by regression.  Note
-that it is essential to calculate the mean square error, not the mean error. */
-
-    error = drift = x = z = 0.0;
-    for (i = 0; i < total; ++i) {
-        w = record[i].weight/weight;
-        x += w*(record[i].when-when)*(record[i].when-when);
-        drift += w*(record[i].when-when)*(record[i].offset-offset);
-        z += w*(record[i].offset-offset)*(record[i].offset-offset);
-        error += w*record[i].error*record[i].error+
-            2.0*w*(record[i].dispersion-y)*(record[i].dispersion-y);
-    }
+that it is essential to calculate the mean square error, not the mean error.
+The moments about the means come from the sums, which are about the reference
+packet, and are not affected by the base. */
+
+    x = record->sum_wtt/weight-when*when;
+    drift = record->sum_wto/weight-when*offset;
+    z = record->sum_woo/weight-offset*offset;
+    error = record->sum_wee/weight+2.0*(record->sum_wdd/weight-y*y);
+    when += record->when0+base;
+    offset += record->offset0-base;
     if (verbose > 2)
         fprintf(stderr,"X2=%.3f XY=%.6f Y2=%.9f E2=%.9f ",x,drift,z,error);
 
@@ -812,11 +1245,14 @@ glitches at this point are so common, log a reset even in non-verbose mode.
 There will be more thorough checks later.  Note that we cannot usefully check
 the error for broadcasts. */
 
-    z -= drift*drift/x;
+    if ((z -= drift*drift/x) < 0.0) z = 0.0;   /* Only by rounding */
     if (verbose > 2) fprintf(stderr,"S2=%.9f\n",z);
     if (! update) {
-        if (z > 1.0e6)
-            fatal(0,"stored data too unreliable for time estimation",NULL);
+        if (z > 1.0e6) {
+            fatal(EMSNTP_NTP_INSANITY,
+                "stored data too unreliable for time estimation",NULL);
+            return -1.0;
+        }
     } else if (operation == op_client) {
         e = error+disp*disp+minerr*minerr;
         if (z > e) {
@@ -831,23 +1267,32 @@ the error for broadcasts. */
                     sqrt(z),sqrt(e));
                 log_message(text);
                 return 0.0;
-            } else
-                fatal(0,"incompatible (i.e. erroneous) timestamps",NULL);
+            } else {
+                fatal(EMSNTP_NTP_INCONSISTENCY,
+                    "incompatible (i.e. erroneous) timestamps",NULL);
+                return -1.0;
+            }
         } else if (z > error && verbose)
             fprintf(stderr,
                 "%s: anomalously high error %.3f > %.3f, but < %.3f\n",
                 argv0,sqrt(z),sqrt(error),sqrt(e));
     } else {
-        if (z > maxerr*maxerr)
-            fatal(0,"broadcasts too unreliable for time estimation",NULL);
+        if (z > maxerr*maxerr) {
+            fatal(EMSNTP_NTP_INSANITY,
+                "broadcasts too unreliable for time estimation",NULL);
+            return -1.0;
+        }
     }
     drift /= x;
     drifterr = ABSCISSA*sqrt(z/(x*total));
     error = (operation == op_listen ? minerr : 0.0)+ABSCISSA*sqrt(z/total);
     if (verbose > 2)
         fprintf(stderr,"err=%.6f drift=%.6f+/-%.6f\n",error,drift,drifterr);
-    if (error+drifterr*delay > NTP_INSANITY)
-        fatal(0,"unable to get a reasonable drift estimate",NULL);
+    if (error+drifterr*delay > NTP_INSANITY) {
+        fatal(EMSNTP_NTP_INSANITY,"unable to get a reasonable drift estimate",
+            NULL);
+        return -1.0;
+    }
 
 /* Estimate the optimal short-loop period, checking it carefully.  Remember to
 check that this whole process is likely to be accurate enough and that the
@@ -866,32 +1311,42 @@ delay function may be inaccurate. */
         if ((z = drifterr*delay) < 0.5*minerr) z = 0.5*minerr;
         wait = (x < z/delay ? delay : (int)(z/x+0.5));
         wait = (int)(delay/(int)(delay/(double)wait+0.999)+0.999);
-        if (wait > delay)
-            fatal(0,"internal error in drift calculation",NULL);
+        if (wait > delay) {
+            fatal(EMSNTP_INTERNAL,"internal error in drift calculation",NULL);
+            return -1.0;
+        }
         if (drift*wait > maxerr || wait < RESET_MIN) {
             sprintf(text,"%.6f+/-%.6f",drift,drifterr);
-            fatal(0,"drift correction too large: %s",text);
+            fatal(EMSNTP_NTP_INSANITY,"drift correction too large: %s",text);
+            return -1.0;
         }
     }
     if (wait < *a_wait/2) wait = *a_wait/2;
     if (wait > *a_wait*2) wait = *a_wait*2;
 
 /* Now work out what the correction should be, as distinct from what it should
-have been, remembering that older times are less certain. */
+have been, remembering that older times are less certain.  Only the packets
+in lows need be looked at, as any other has a later one that is at least as
+accurate.  There are rarely more than a few of them, but this is a scan of the
+whole window when each packet is less accurate than the one before. */
 
     now = current_time(JAN_1970);
     x = now-when;
     offset += x*drift;
     error += x*drifterr;
-    for (i = 0; i < total; ++i) {
-        x = now-record[i].when;
-        z = record[i].error+x*drifterr;
-        if (z < error) {
-            when = record[i].when;
-            offset = record[i].offset+x*drift;
+    x = now-base;
+    for (j = 0, index = -1; j < record->lows.length; ++j) {
+        if ((i = record->lows.first+j) >= samples) i -= samples;
+        i = record->lows.index[i];
+        if ((z = record->error[i]+(x-record->when[i])*drifterr) < error) {
             error = z;
+            index = i;
         }
     }
+    if (index >= 0) {
+        when = record->when[index]+base;
+        offset = record->offset[index]-base+(now-when)*drift;
+    }
     if (verbose > 2)
         fprintf(stderr,"now=%.6f when=%.6f off=%.6f err=%.6f wait=%d\n",
             now,when,offset,error,wait);
@@ -937,29 +1392,49 @@ discrepancy, when appropriate. */
 
 
 
-void handle_saving (int operation, int *total, int *index, int *cycle,
-    data_record *record, double *previous, double *when, double *correction) {
+void publish_stats (double when, double offset, double error, double drift,
+    double drifterr) {
+
+/* Publish an estimate for msntp_shm_now().  While a correction is still being
+slewed, the part that is left is added to the offset, which assumes that it has
+been made, and to the error, as that part shrinks until the next estimate. */
+
+    double x = (action == action_adjust ? slew_left() : 0.0);
+
+    shm_publish(1,when,offset+x,error+(x < 0.0 ? -x : x),drift,drifterr);
+}
+
+
+
+void handle_saving (int mode, data_window *record, int *cycle,
+    double *previous, double *when, double *correction) {
 
 /* This handles the saving and restoring of the state to a file.  While it is
 subject to spoofing, this is not a major security problem.  But, out of general
 paranoia, check everything in sight when restoring.  Note that this function
-has no external effect if something goes wrong. */
+has no external effect if something goes wrong.
+
+The file holds a header, followed by the circular buffer of packets, slot by
+slot, so that a write need only change the header and any packets that have
+been stored since the last one.  The packets are saved as they are kept, with
+the base in the header. */
 
     struct {
-        data_record record[COUNT_MAX];
-        double previous, when, correction;
-        int operation, delay, count, total, index, cycle, waiting;
+        double previous, when, correction, base;
+        int operation, delay, count, samples, total, index, cycle, waiting;
     } buffer;
-    double x, y;
+    double slot[5], x, y;
     int i, j;
 
     if (savefile == NULL) return;
 
 /* Read the restart file and print its data in diagnostic mode.  Note that some
 care is necessary to avoid introducing a security exposure - but we trust the
-C library not to trash the stack on bad numbers! */
+C library not to trash the stack on bad numbers!  The packets are read straight
+into the record, which is empty, and it is set up only once they have all been
+checked. */
 
-    if (operation == save_read_only || operation == save_read_check) {
+    if (mode == save_read_only || mode == save_read_check) {
         if (fread(&buffer,sizeof(buffer),1,savefile) != 1 || ferror(savefile)) {
             if (ferror(savefile))
                 fatal(1,"unable to read record from daemon save file",NULL);
@@ -968,40 +1443,43 @@ C library not to trash the stack on bad numbers! */
             return;
         }
         if (verbose > 2) {
-            fprintf(stderr,"Reading prev=%.6f when=%.6f corr=%.6f\n",
-                buffer.previous,buffer.when,buffer.correction);
-            fprintf(stderr,"op=%d dly=%d cnt=%d tot=%d ind=%d cyc=%d wait=%d\n",
-                buffer.operation,buffer.delay,buffer.count,buffer.total,
-                buffer.index,buffer.cycle,buffer.waiting);
-            if (buffer.total < COUNT_MAX)
-                for (i = 0; i < buffer.total; ++i)
-                    fprintf(stderr,
-                        "disp=%.6f wgt=%.3f when=%.6f off=%.6f err=%.6f\n",
-                        buffer.record[i].dispersion,buffer.record[i].weight,
-                        buffer.record[i].when,buffer.record[i].offset,
-                        buffer.record[i].error);
+            fprintf(stderr,"Reading prev=%.6f when=%.6f corr=%.6f base=%.6f\n",
+                buffer.previous,buffer.when,buffer.correction,buffer.base);
+            fprintf(stderr,"op=%d dly=%d cnt=%d smp=%d tot=%d ind=%d cyc=%d ",
+                buffer.operation,buffer.delay,buffer.count,buffer.samples,
+                buffer.total,buffer.index,buffer.cycle);
+            fprintf(stderr,"wait=%d\n",buffer.waiting);
         }
 
 
-/* Start checking the data for sanity. */
+/* Start checking the data for sanity.  Even when only reading it, the buffer
+must fit. */
 
         if (buffer.operation == 0 && buffer.delay == 0 && buffer.count == 0) {
-            if (operation < 0)
+            if (mode < 0)
                 fatal(0,"the daemon save file has been cleared",NULL);
             if (verbose)
                 fprintf(stderr,"%s: restarting from a cleared file\n",argv0);
             return;
         }
-        if (operation == save_read_check) {
+        if (buffer.samples < 1 || buffer.samples > WINDOW_MAX ||
+                buffer.total < 0 || buffer.total > buffer.samples ||
+                buffer.index < 0 || buffer.index >= buffer.samples) {
+            if (verbose)
+                fprintf(stderr,"%s: corrupted restart information\n",argv0);
+            return;
+        }
+        if (mode == save_read_only)
+            samples = buffer.samples;
+        else {
             if (buffer.operation != operation || buffer.delay != delay ||
-                    buffer.count != count) {
+                    buffer.count != count || buffer.samples != samples) {
                 if (verbose)
                     fprintf(stderr,"%s: different parameters for restart\n",
                         argv0);
                 return;
             }
-            if (buffer.total < 1 || buffer.total > count || buffer.index < 0 ||
-                    buffer.index >= count || buffer.cycle < 0 ||
+            if (buffer.total < 1 || buffer.cycle < 0 ||
                     buffer.cycle >= count || buffer.correction < -maxerr ||
                     buffer.correction > maxerr || buffer.waiting < RESET_MIN ||
                     buffer.waiting > delay || buffer.previous > buffer.when ||
@@ -1011,30 +1489,49 @@ C library not to trash the stack on bad numbers! */
                     fprintf(stderr,"%s: corrupted restart information\n",argv0);
                 return;
             }
+        }
 
-/* Checking the record is even more tedious. */
-
-            x = *when;
-            y = 0.0;
-            for (i = 0; i < buffer.total; ++i) {
-                if (buffer.record[i].dispersion < 0.0 ||
-                        buffer.record[i].dispersion > maxerr ||
-                        buffer.record[i].weight <= 0.0 ||
-                        buffer.record[i].weight > 1.001/(minerr*minerr) ||
-                        buffer.record[i].offset < -count*maxerr ||
-                        buffer.record[i].offset > count*maxerr ||
-                        buffer.record[i].error < 0.0 ||
-                        buffer.record[i].error > maxerr) {
-                    if (verbose)
-                        fprintf(stderr,"%s: corrupted restart record\n",argv0);
-                    return;
-                }
-                if (buffer.record[i].when < x) x = buffer.record[i].when;
-                if (buffer.record[i].when > y) y = buffer.record[i].when;
+/* Checking the packets is even more tedious.  Only the first 'total' slots are
+in use, whether or not the buffer has wrapped round. */
+
+        x = *when;
+        y = 0.0;
+        for (i = 0; i < buffer.total; ++i) {
+            if (fread(slot,sizeof(slot),1,savefile) != 1 || ferror(savefile)) {
+                if (ferror(savefile))
+                    fatal(1,"unable to read record from daemon save file",
+                        NULL);
+                else if (verbose)
+                    fprintf(stderr,"%s: truncated restart record\n",argv0);
+                return;
             }
+            slot[2] += buffer.base;
+            slot[3] -= buffer.base;
+            if (verbose > 2)
+                fprintf(stderr,
+                    "disp=%.6f wgt=%.3f when=%.6f off=%.6f err=%.6f\n",
+                    slot[0],slot[1],slot[2],slot[3],slot[4]);
+            if (mode == save_read_check && (slot[0] < 0.0 ||
+                    slot[0] > maxerr || slot[1] <= 0.0 ||
+                    slot[1] > 1.001/(minerr*minerr) ||
+                    slot[3] < -count*maxerr || slot[3] > count*maxerr ||
+                    slot[4] < 0.0 || slot[4] > maxerr)) {
+                if (verbose)
+                    fprintf(stderr,"%s: corrupted restart record\n",argv0);
+                return;
+            }
+            if (slot[2] < x) x = slot[2];
+            if (slot[2] > y) y = slot[2];
+            record->dispersion[i] = slot[0];
+            record->weight[i] = slot[1];
+            record->when[i] = slot[2];
+            record->offset[i] = slot[3];
+            record->error[i] = slot[4];
+        }
 
 /* Check for consistency and, finally, whether this is too old. */
 
+        if (mode == save_read_check) {
             if (y > buffer.when || y-x < (buffer.total-1)*delay ||
                     y-x > (buffer.total-1)*count*delay) {
                 if (verbose)
@@ -1048,14 +1545,18 @@ C library not to trash the stack on bad numbers! */
             }
         }
 
-/* If we get here, just copy the data back. */
+/* If we get here, the packets are in place, with the base folded in, so just
+set up the rest of the record.  rebuild_window() marks every slot as unsaved,
+and that must stand, because the next write has a base of zero and would
+otherwise leave the other slots relative to the old one. */
 
-        memcpy(record,buffer.record,sizeof(buffer.record));
+        clear_window(record);
+        record->total = buffer.total;
+        record->index = buffer.index;
+        rebuild_window(record);
         *previous = buffer.previous;
         *when = buffer.when;
         *correction = buffer.correction;
-        *total = buffer.total;
-        *index = buffer.index;
         *cycle = buffer.cycle;
         waiting = buffer.waiting;
         memset(&buffer,0,sizeof(buffer));
@@ -1065,51 +1566,65 @@ C library not to trash the stack on bad numbers! */
         if (verbose > 1) {
             fprintf(stderr,"%s: prev=%.3f when=%.3f corr=%.3f\n",
                 argv0,*previous,*when,*correction);
-            for (i = 0; i < *total; ++i) {
-                if ((j = i+*index-*total) < 0) j += *total;
-                fprintf(stderr,"%s: when=%.3f disp=%.3f off=%.3f",
-                    argv0,record[j].when,record[j].dispersion,record[j].offset);
+            for (i = 0; i < record->total; ++i) {
+                if ((j = i+record->index-record->total) < 0) j += samples;
+                fprintf(stderr,"%s: when=%.3f disp=%.3f off=%.3f",argv0,
+                    record->when[j],record->dispersion[j],record->offset[j]);
                 if (operation == op_client)
-                    fprintf(stderr," err=%.3f\n",record[j].error);
+                    fprintf(stderr," err=%.3f\n",record->error[j]);
                 else
                     fprintf(stderr,"\n");
             }
         }
 
-/* All errors on output are fatal. */
+/* All errors on output are fatal.  Only the packets that have changed are
+written, each into its own slot. */
 
-    } else if (operation == save_write) {
-        memcpy(buffer.record,record,sizeof(buffer.record));
+    } else if (mode == save_write) {
         buffer.previous = *previous;
         buffer.when = *when;
         buffer.correction = *correction;
+        buffer.base = record->base;
         buffer.operation = operation;
         buffer.delay = delay;
         buffer.count = count;
-        buffer.total = *total;
-        buffer.index = *index;
+        buffer.samples = samples;
+        buffer.total = record->total;
+        buffer.index = record->index;
         buffer.cycle = *cycle;
         buffer.waiting = waiting;
         if (fseek(savefile,0l,SEEK_SET) != 0 ||
-                fwrite(&buffer,sizeof(buffer),1,savefile) != 1 ||
-                fflush(savefile) != 0 || ferror(savefile))
+                fwrite(&buffer,sizeof(buffer),1,savefile) != 1)
+            fatal(1,"unable to write record to daemon save file",NULL);
+        for (i = (record->unsaved == -2 ? 0 : record->unsaved);
+                i >= 0 && i < record->total; ++i) {
+            slot[0] = record->dispersion[i];
+            slot[1] = record->weight[i];
+            slot[2] = record->when[i];
+            slot[3] = record->offset[i];
+            slot[4] = record->error[i];
+            if (fseek(savefile,(long)(sizeof(buffer)+i*sizeof(slot)),
+                        SEEK_SET) != 0 ||
+                    fwrite(slot,sizeof(slot),1,savefile) != 1)
+                fatal(1,"unable to write record to daemon save file",NULL);
+            if (record->unsaved >= 0) break;
+        }
+        record->unsaved = -1;
+        if (fflush(savefile) != 0 || ferror(savefile))
             fatal(1,"unable to write record to daemon save file",NULL);
         if (verbose > 2) {
-            fprintf(stderr,"Writing prev=%.6f when=%.6f corr=%.6f\n",
-                *previous,*when,*correction);
-            fprintf(stderr,"op=%d dly=%d cnt=%d tot=%d ind=%d cyc=%d wait=%d\n",
-                operation,delay,count,*total,*index,*cycle,waiting);
-            if (*total < COUNT_MAX)
-                for (i = 0; i < *total; ++i)
-                    fprintf(stderr,
-                        "disp=%.6f wgt=%.3f when=%.6f off=%.6f err=%.6f\n",
-                        record[i].dispersion,record[i].weight,
-                        record[i].when,record[i].offset,record[i].error);
+            fprintf(stderr,"Writing prev=%.6f when=%.6f corr=%.6f base=%.6f\n",
+                *previous,*when,*correction,record->base);
+            fprintf(stderr,"op=%d dly=%d cnt=%d smp=%d tot=%d ind=%d cyc=%d ",
+                operation,delay,count,samples,record->total,record->index,
+                *cycle);
+            fprintf(stderr,"wait=%d\n",waiting);
         }
 
-/* Clearing the save file is similar. */
+/* Clearing the save file is similar, but only the header is cleared. */
 
-    } else if (operation == save_clear) {
+    } else if (mode == save_clear) {
+        memset(&buffer,0,sizeof(buffer));
         if (fseek(savefile,0l,SEEK_SET) != 0 ||
                 fwrite(&buffer,sizeof(buffer),1,savefile) != 1 ||
                 fflush(savefile) != 0 || ferror(savefile))
@@ -1126,20 +1641,19 @@ void query_savefile (void) {
 
     double previous, when, correction = 0.0, offset = 0.0, error = -1.0,
         drift = 0.0, drifterr = -1.0;
-    data_record record[COUNT_MAX];
-    int total = 0, index = 0, cycle = 0;
+    int cycle = 0;
     char text[100];
 
 /* This is a few lines stripped out of run_daemon() and slightly hacked. */
 
+    clear_window(&records);
     previous = when = current_time(JAN_1970);
     if (verbose > 2) {
         format_time(text,50,0.0,-1.0,0.0,-1.0);
         fprintf(stderr,"Started=%.6f %s\n",when,text);
     }
-    handle_saving(save_read_only,&total,&index,&cycle,record,&previous,&when,
-        &correction);
-    estimate_stats(&total,&index,record,correction,&dispersion,
+    handle_saving(save_read_only,&records,&cycle,&previous,&when,&correction);
+    estimate_stats(&records,correction,&dispersion,
         &when,&offset,&error,&drift,&drifterr,&waiting,0);
     format_time(text,100,offset,error,drift,drifterr);
     printf("%s\n",text);
@@ -1150,24 +1664,25 @@ void query_savefile (void) {
 
 
 
-void run_daemon (char *hostnames[], int nhosts, int initial) {
+int run_daemon (char *hostnames[], int nhosts, int initial) {
 
 /* This does not adjust the time between calls to the server, but it does
 adjust the time between clock resets.  This function will survive short periods
 of server inaccessibility or network glitches, but not long ones, and will then
-need restarting manually.
+need restarting manually.  It returns 0 when it should be called again to start
+afresh, -1 if it was woken up by wake_up(), and otherwise an error.
 
 It is far too complex for a single function, but could really only be
 simplified by making most of its variables global or by a similarly horrible
 trick.  Oh, for nested scopes as in Algol 68! */
 
-    double history[COUNT_MAX], started, previous, when, correction = 0.0,
+    ntp_stamp history[COUNT_MAX], stamp;
+    double started, previous, when, correction = 0.0,
         weeble = 1.0, accepts = 0.0, rejects = 0.0, flushes = 0.0,
         replicates = 0.0, skips = 0.0, offset = 0.0, error = -1.0,
         drift = 0.0, drifterr = -1.0, maxoff = 0.0, x;
-    data_record record[COUNT_MAX];
-    int total = 0, index = 0, item = 0, rej_level = 0, rep_level = 0,
-        cycle = 0, retry = 1, i, j, k, ret;
+    data_window *record = &records;
+    int item = 0, rej_level = 0, rep_level = 0, cycle = 0, retry = 1, i, j, k;
     unsigned char transmit[NTP_PACKET_MIN];
     ntp_data data;
     char text[100];
@@ -1176,31 +1691,36 @@ trick.  Oh, for nested scopes as in Algol 68! */
 only a few of the variables are actually needed to control the operation and
 the rest are mainly for diagnostics. */
 
+    clear_window(record);
     started = previous = when = current_time(JAN_1970);
     if (verbose > 2) {
         format_time(text,50,0.0,-1.0,0.0,-1.0);
         fprintf(stderr,"Started=%.6f %s\n",when,text);
     }
     if (initial) {
-        handle_saving(save_read_check,&total,&index,&cycle,record,
-            &previous,&when,&correction);
+        handle_saving(save_read_check,record,&cycle,&previous,&when,
+            &correction);
         cycle = (nhosts > 0 ? cycle%nhosts : 0);
-        if (total > 0 && started-previous < delay) {
+        if (record->total > 0 && started-previous < delay) {
             if (verbose > 2) fprintf(stderr,"Last packet too recent\n");
             retry = 0;
         }
         if (verbose > 2)
             fprintf(stderr,"prev=%.6f when=%.6f retry=%d\n",
                 previous,when,retry);
-        for (i = 0; i < nhosts; ++i) open_socket(i,hostnames[i],delay);
-        if (action != action_display) {
+        for (i = 0; i < nhosts; ++i)
+            if (k = open_socket(i,hostnames[i],1000*delay)) {
+                while (i >= 0) close_socket(i--);
+                return k;
+            }
+        if (changes_clock(action)) {
             set_lock(1);
             locked = 1;
         }
     }
     dispersion = 0.0;
-    attempts = 0;
-    for (i = 0; i < count; ++i) history[i] = 0.0;
+    start_query(&client,NULL,query_deadline(NULL));
+    for (i = 0; i < count; ++i) history[i] = 0;
     while (1) {
 
 /* Print out a reasonable amount of diagnostics, rather like a server.  Note
@@ -1232,8 +1752,9 @@ check that we aren't in a failing loop. */
         if (current_time(JAN_1970)-previous > count*delay) {
             if (verbose)
                 fprintf(stderr,"%s: no packets in too long a period\n",argv0);
-            return;
+            return 0;
         }
+        if (do_nothing(0)) return -1;
 
 /* Listen for the next broadcast packet.  This allows up to ETHERNET_MAX
 replications per packet, for systems with multiple addresses for receiving
@@ -1243,33 +1764,40 @@ servers always returning the same time. */
         if (operation == op_listen) {
             flush_socket(0, &k);
             flushes += k;
-            if (read_packet(0,&data,&offset,&error)) {
+            if (read_packet(0,&client,&data,&offset,&error)) {
+                if (do_nothing(0)) return -1;
                 ++rejects;
-                if (++rej_level > count)
-                    fatal(0,"too many bad or lost packets",NULL);
-                if (action != action_display && drifterr >= 0.0) {
+                if (++rej_level > count) {
+                    fatal(EMSNTP_TOO_FEW_RESPONSES,
+                        "too many bad or lost packets",NULL);
+                    return EMSNTP_TOO_FEW_RESPONSES;
+                }
+                if (changes_clock(action) && drifterr >= 0.0) {
                     correction += correct_drift(&when,&offset,drift);
-                    handle_saving(save_write,&total,&index,&cycle,record,
-                        &previous,&when,&correction);
+                    handle_saving(save_write,record,&cycle,&previous,&when,
+                        &correction);
                 }
                 continue;
             }
             if ((rej_level -= (count < 5 ? count : 5)) < 0) rej_level = 0;
-            x = data.transmit;
+            stamp = data.transmit;
             for (i = 0; i < count; ++i)
-                if (x == history[i]) {
+                if (stamp == history[i]) {
                     ++replicates;
-                    if (++rep_level > ETHERNET_MAX)
-                        fatal(0,"too many replicated packets",NULL);
+                    if (++rep_level > ETHERNET_MAX) {
+                        fatal(EMSNTP_BAD_RESPONSES,
+                            "too many replicated packets",NULL);
+                        return EMSNTP_BAD_RESPONSES;
+                    }
                     goto continue1;
                 }
             rep_level = 0;
-            history[item] = x;
+            history[item] = stamp;
             if (++item >= count) item = 0;
 
 /* Accept a packet only after a long enough period has elapsed. */
 
-            when = data.current;
+            when = stamp_to_double(data.current);
             if (! retry && when < previous+delay) {
                 if (verbose > 2) fprintf(stderr,"Skipping too recent packet\n");
                 ++skips;
@@ -1289,12 +1817,13 @@ restarting.  Running it under cron is the best approach. */
         } else {
             if (! retry) {
                if (verbose > 2) fprintf(stderr,"Sleeping for %d\n",waiting);
-               do_nothing(waiting);
+               if (do_nothing(waiting)) return -1;
             }
             make_packet(&data,NTP_CLIENT);
-            outgoing[item] = data.transmit;
+            client.outgoing[item] = data.transmit;
+            client.departures[client.latest = item] = 0;
             if (++item >= 2*count) item = 0;
-            if (attempts < 2*count) ++attempts;
+            if (client.attempts < 2*count) ++client.attempts;
             if (verbose > 2) {
                 fprintf(stderr,"Outgoing packet on socket %d:\n",cycle);
                 display_data(&data);
@@ -1310,14 +1839,15 @@ is rather more numerically sensitive than simple resynchronisation, reject all
 very inaccurate packets.  Be careful if you modify this, because the error
 handling is rather nasty to avoid replicating code. */
 
-            k = read_packet(cycle,&data,&offset,&error);
+            k = read_packet(cycle,&client,&data,&offset,&error);
             if (++cycle >= nhosts) cycle = 0;
             if (! k)
-                when = (data.originate+data.current)/2.0;
-            else if (action != action_display && drifterr >= 0.0) {
+                when = stamp_to_double(data.originate)+
+                    0.5*stamp_diff(data.current,data.originate);
+            else if (changes_clock(action) && drifterr >= 0.0) {
                 correction += correct_drift(&when,&offset,drift);
-                handle_saving(save_write,&total,&index,&cycle,record,
-                    &previous,&when,&correction);
+                handle_saving(save_write,record,&cycle,&previous,&when,
+                    &correction);
             }
             if (! k && ! retry && when < previous+delay-2) {
                 if (verbose)
@@ -1325,7 +1855,7 @@ handling is rather nasty to avoid replicating code. */
                         argv0,cycle);
                 k = 1;
             }
-            if (! k && data.current-data.originate > maxerr) {
+            if (! k && stamp_diff(data.current,data.originate) > maxerr) {
                 if (verbose)
                     fprintf(stderr,
                         "%s: very slow response rejected on socket %d\n",
@@ -1336,13 +1866,15 @@ handling is rather nasty to avoid replicating code. */
 /* Count the number of rejected packets and fail if there are too many. */
 
             if (k) {
+                if (do_nothing(0)) return -1;
                 ++rejects;
-                if (++rej_level > count)
-                    fatal(0,"too many bad or lost packets",NULL);
-                else {
-                    retry = 1;
-                    continue;
+                if (++rej_level > count) {
+                    fatal(EMSNTP_TOO_FEW_RESPONSES,
+                        "too many bad or lost packets",NULL);
+                    return EMSNTP_TOO_FEW_RESPONSES;
                 }
+                retry = 1;
+                continue;
             } else
                 retry = 0;
             if ((rej_level -= (count < 5 ? count : 5)) < 0) rej_level = 0;
@@ -1352,25 +1884,29 @@ handling is rather nasty to avoid replicating code. */
         }
    
 /* Calculate the statistics, and display the results or make the initial
-correction.  Note that estimate_stats() will return zero if a timestamp
-indicates synchronisation loss (usually due to down time or a change of server,
-somewhere upstream), and that the recovery operation is unstructured, so great
-care should be taken when modifying it.  Also, we want to clear the saved state
-is the statistics are bad. */
-
-        handle_saving(save_clear,&total,&index,&cycle,record,&previous,&when,
-            &correction);
+correction, and publish them for other processes if asked to.  Note that
+estimate_stats() will return zero if a timestamp indicates synchronisation loss
+(usually due to down time or a change of server, somewhere upstream), and that
+the recovery operation is unstructured, so great care should be taken when
+modifying it.  Also, we want to clear the saved state if the statistics are
+bad. */
+
+        handle_saving(save_clear,record,&cycle,&previous,&when,&correction);
         ++accepts;
         dispersion = data.dispersion;
         previous = when =
-            estimate_stats(&total,&index,record,correction,&dispersion,
+            estimate_stats(record,correction,&dispersion,
                 &when,&offset,&error,&drift,&drifterr,&waiting,1);
         if (verbose > 2) {
             fprintf(stderr,"tot=%d ind=%d dis=%.3f when=%.3f off=%.3f ",
-                total,index,dispersion,when,offset);
+                record->total,record->index,dispersion,when,offset);
             fprintf(stderr,"err=%.3f wait=%d\n",error,waiting);
         }
-        if (when == 0.0) return;
+        if (when < 0.0) return libmsntp_errno;
+        if (when == 0.0) {
+            shm_publish(0,0.0,0.0,0.0,0.0,0.0);
+            return 0;
+        }
         x = (maxoff < 0.0 ? -maxoff : maxoff);
         if ((offset < 0.0 ? -offset : offset) > x) maxoff = offset;
         correction = 0.0;
@@ -1378,27 +1914,28 @@ is the statistics are bad. */
             if (action == action_display) {
                 format_time(text,100,offset,error,drift,drifterr);
                 printf("%s\n",text);
-            } else {
+            } else if (changes_clock(action)) {
                 x = reset_clock(offset,error,1);
                 correction += x;
                 offset -= x;
             }
+            publish_stats(when,offset,error,drift,drifterr);
         } else
             waiting = delay;
-        handle_saving(save_write,&total,&index,&cycle,record,&previous,&when,
-            &correction);
+        handle_saving(save_write,record,&cycle,&previous,&when,&correction);
 
 /* Now correct the clock for a while, before getting another packet and
 updating the statistics. */
 
         while (when < previous+delay-waiting) {
-            do_nothing(waiting);
-            if (action == action_display)
+            if (do_nothing(waiting)) return -1;
+            if (! changes_clock(action))
                 when += waiting;
             else {
                 correction += correct_drift(&when,&offset,drift);
-                handle_saving(save_write,&total,&index,&cycle,record,
-                    &previous,&when,&correction);
+                handle_saving(save_write,record,&cycle,&previous,&when,
+                    &correction);
+                publish_stats(when,offset,error,drift,drifterr);
             }
         }
 continue1: ;
@@ -1407,38 +1944,255 @@ continue1: ;
 
 
 
+int64_t query_deadline (const struct msntp_ctx *ctx) {
+
+/* Return when an exchange started now must be over, on the monotonic clock,
+with the settings in ctx or the globals.  This is worked out before looking up
+the server, so that the lookup comes out of the same time. */
+
+    return monotonic_nanos()+
+        (int64_t)(ctx != NULL ? ctx->delay : libmsntp_timeout)*1000000;
+}
+
+
+
+void start_query (client_query *query, const struct msntp_ctx *ctx,
+    int64_t deadline) {
+
+/* Start an exchange with a server, using the settings in ctx, or the current
+global ones if it is NULL, which must be over by the deadline. */
+
+    memset(query,0,sizeof(*query));
+    if (ctx != NULL) {
+        query->operation = op_client;
+        query->count = ctx->count;
+        query->waiting = ctx->waiting;
+        query->burst = ctx->burst;
+        query->spacing = ctx->spacing;
+        query->hedging = ctx->hedging;
+        query->minerr = ctx->minerr;
+    } else {
+        query->operation = operation;
+        query->count = count;
+        query->waiting = libmsntp_wait;
+        query->burst = libmsntp_pipeline;
+        query->spacing = libmsntp_spacing;
+        query->hedging = libmsntp_hedging;
+        query->minerr = minerr;
+    }
+    query->deadline = deadline;
+    query->latest = -1;
+    query->offset = 0.0;
+    query->error = NTP_INSANITY;
+}
+
+
+
+int query_request (int which, client_query *query, unsigned char *transmit) {
+
+/* Build the next request of an exchange in transmit, to be sent on socket
+which, and record it.  This fails if the exchange has gone on too long, which
+happens when the replies are lost until the deadline, as the waits for them
+stop there. */
+
+    ntp_data data;
+
+    if (monotonic_nanos() >= query->deadline) {
+        fatal(EMSNTP_TOO_FEW_RESPONSES,
+              "not enough valid responses received in time",NULL);
+        return EMSNTP_TOO_FEW_RESPONSES;
+    }
+    make_packet(&data,NTP_CLIENT);
+    query->departures[query->latest = query->attempts] = 0;
+    query->outgoing[query->attempts++] = data.transmit;
+    if (verbose > 2) {
+        fprintf(stderr,"Outgoing packet on socket %d:\n",which);
+        display_data(&data);
+    }
+    pack_ntp(transmit,NTP_PACKET_MIN,&data);
+    if (verbose > 2) display_packet(transmit,NTP_PACKET_MIN);
+    return 0;
+}
+
+
+
+int query_burst (client_query *query) {
+
+/* Return how many requests to send next: one at a time, or in burst mode as
+many as are still needed, within the limit on attempts. */
+
+    int k;
+
+    if (! query->burst) return 1;
+    k = query->count-query->accepts;
+    if (k > 2*query->count-query->attempts)
+        k = 2*query->count-query->attempts;
+    return (k > 1 ? k : 1);
+}
+
+
+
+int query_duplicate (int which, client_query *query, unsigned char *transmit) {
+
+/* Build another request in transmit, to hedge against the latest one being
+lost or slow.  The two are linked, and count as a single request, so whichever
+is answered first settles it.  This returns -1 if there is no room or time
+for it, when the latest request must do, and otherwise the same as
+query_request(). */
+
+    int original = query->latest, ret;
+
+    if (query->attempts >= 2*query->count || original < 0 ||
+            monotonic_nanos() >= query->deadline)
+        return -1;
+    if ((ret = query_request(which,query,transmit)) == 0) {
+        ++query->hedges;
+        query->twins[original] = query->latest+1;
+        query->twins[query->latest] = original+1;
+    }
+    return ret;
+}
+
+
+
+int query_left (const client_query *query) {
+
+/* Return how many milliseconds to wait for a reply: the usual time, cut short
+by the deadline. */
+
+    int left = millis_left(query->deadline);
+
+    return (left < query->waiting ? left : query->waiting);
+}
+
+
+
+int query_reply (int which, client_query *query, unsigned char *receive,
+    int length, ntp_stamp arrival) {
+
+/* Handle what came back on socket which for the requests of an exchange: a
+packet that arrived at arrival (0 if the kernel did not say), or nothing if
+receive is NULL, in which case all of the requests still outstanding have been
+lost.  The departures of the requests should be filled in first, as far as the
+kernel knows them.  This returns -1 if more requests should be sent, -2 if
+replies are still expected, 0 if the exchange is over and an error if it has
+failed.  Only bursts leave replies outstanding; a hedged request and its
+duplicate are one request, so the reply to whichever is answered second is
+ignored, without counting it. */
+
+    ntp_data data;
+    double a, b, x, y;
+    int outstanding = query->attempts-query->hedges-query->accepts-
+        query->rejects, ret = 1;
+    char text[50];
+
+    if (receive != NULL && (ret = check_packet(which,query,&data,receive,
+            length,arrival,&x,&y)) == 2) {
+        if (outstanding > 0) return -2;
+        return (query->attempts < 2*query->count ? -1 : 0);
+    }
+    if (ret) {
+        query->rejects += (receive == NULL && outstanding > 1 ?
+            outstanding : 1);
+        if (query->rejects > query->count) {
+            fatal(EMSNTP_BAD_RESPONSES,"too many bad or lost packets",NULL);
+            return EMSNTP_BAD_RESPONSES;
+        }
+        if (receive != NULL && outstanding > 1) return -2;
+        return (query->attempts < 2*query->count ? -1 : 0);
+    }
+    ++query->accepts;
+
+/* Work out the most accurate time, and check that it isn't more accurate than
+the results warrant. */
+
+    if (verbose > 2)
+        fprintf(stderr,"Offset=%.6f+/-%.6f disp=%.6f\n",x,y,
+            query->dispersion);
+    else if (verbose > 1)
+        fprintf(stderr,"%s: offset=%.3f+/-%.3f disp=%.3f\n",
+            argv0,x,y,query->dispersion);
+    if ((a = x-query->offset) < 0.0) a = -a;
+    if (query->accepts <= 1) a = 0.0;
+    b = query->error+y;
+    if (y < query->error) {
+        query->offset = x;
+        query->error = y;
+    }
+    if (verbose > 2)
+        fprintf(stderr,"best=%.6f+/-%.6f\n",query->offset,query->error);
+    if (a > b) {
+        sprintf(text,"%d",which);
+        fatal(0,"inconsistent times got from NTP server on socket %s",text);
+        return EMSNTP_NTP_INCONSISTENCY;
+    }
+    if (query->error <= query->minerr || query->accepts >= query->count)
+        return 0;
+    if (outstanding > 1) return -2;
+    return (query->attempts < 2*query->count ? -1 : 0);
+}
+
+
+
+int finish_query (client_query *query) {
+
+/* Check the result of an exchange that is over. */
+
+    if (verbose > 2)
+        fprintf(stderr,"accepts=%d rejects=%d flushes=%d hedges=%d\n",
+            query->accepts,query->rejects,query->flushes,query->hedges);
+    if (query->accepts == 0) {
+        fatal(EMSNTP_NO_GOOD_RESPONSE,"no acceptable packets received",NULL);
+        return EMSNTP_NO_GOOD_RESPONSE;
+    }
+    if (query->error > NTP_INSANITY) {
+        fatal(EMSNTP_NTP_INSANITY,
+              "unable to get a reasonable time estimate",NULL);
+        return EMSNTP_NTP_INSANITY;
+    }
+    return 0;
+}
+
+
+
 int run_client (char *hostnames[], int nhosts, double *server_offset) {
 
 /* Get enough responses to do something with; or not, as the case may be.  Note
 that it allows for half of the packets to be bad, so may make up to twice as
-many attempts as specified by the -c value.  The deadline checking is merely
-paranoia, to protect against broken signal handling - it cannot easily be
-triggered if the signal handling works.
+many attempts as specified by the -c value.  The deadline covers looking up
+the servers as well as the exchange, and no wait for a reply goes beyond it.
 
 This call differs in libmsntp from normal msntp in that it returns the offset
 between the local time and the server's time, as seconds, with a fractional
-part.
+part.  The client/server exchange is done by the same steps as the msntp_query
+functions, one packet at a time, so that they behave identically.  Only they
+can hedge, so a hedging client goes through them even for a single server.
 */
 
-    double history[COUNT_MAX], guesses[COUNT_MAX], offset, error, deadline,
-        a, b, x, y;
+    ntp_stamp history[COUNT_MAX];
+    double guesses[COUNT_MAX], offset, error, x, y;
     int accepts = 0, rejects = 0, flushes = 0, replicates = 0, cycle = 0, k,
-        ret;
-    unsigned char transmit[NTP_PACKET_MIN];
+        length, ret = 0, parallel = (operation == op_client &&
+            (nhosts > 1 || libmsntp_hedging));
+    unsigned char transmit[NTP_PACKET_MIN], receive[NTP_PACKET_MAX+1];
     ntp_data data;
+    struct timespec gap;
     char text[100];
 
     if (verbose > 2) {
         format_time(text,50,0.0,-1.0,0.0,-1.0);
         fprintf(stderr,"Started=%.6f %s\n",current_time(JAN_1970),text);
     }
-    for (k = 0; k < nhosts; ++k) open_socket(k,hostnames[k],delay);
+    start_query(&client,NULL,query_deadline(NULL));
+    for (k = 0; k < nhosts && ! parallel; ++k)
+        if (ret = open_socket(k,hostnames[k],millis_left(client.deadline))) {
+            while (k >= 0) close_socket(k--);
+            return ret;
+        }
     if (action != action_display) {
         set_lock(1);
         locked = 1;
     }
-    attempts = 0;
-    deadline = current_time(JAN_1970)+delay;
 
 /* Listen to broadcast packets and select the best (i.e. earliest).  This will
 be sensitive to a bad NTP broadcaster, but I believe such things are very rare
@@ -1450,33 +2204,36 @@ the same time. */
 
     if (operation == op_listen) {
         while (accepts < count) {
-            if (current_time(JAN_1970) > deadline) {
+            if (monotonic_nanos() > client.deadline) {
                 fatal(EMSNTP_UNKNOWN,
                       "not enough valid broadcasts received in time",NULL);
-                return EMSNTP_UNKNOWN;
+                ret = EMSNTP_UNKNOWN;
+                break;
             }
             if (ret = flush_socket(0, &k))
-                return ret;
+                break;
             flushes += k;
-            if (read_packet(0,&data,&x,&y)) {
+            if (read_packet(0,&client,&data,&x,&y)) {
                 if (++rejects > count) {
                     fatal(EMSNTP_UNKNOWN,"too many bad or lost packets",NULL);
-                    return EMSNTP_UNKNOWN;
+                    ret = EMSNTP_UNKNOWN;
+                    break;
                 }
                 else
                     continue;
             } else {
-                a = data.transmit;
                 for (k = 0; k < accepts; ++k)
-                    if (a == history[k]) {
+                    if (data.transmit == history[k]) {
                         if (++replicates > ETHERNET_MAX*count) {
                             fatal(EMSNTP_UNKNOWN,
                                   "too many replicated packets",NULL);
-                            return EMSNTP_UNKNOWN;
+                            ret = EMSNTP_UNKNOWN;
+                            break;
                         }
                         goto continue1;
                     }
-                history[accepts] = a;
+                if (ret) break;
+                history[accepts] = data.transmit;
                 guesses[accepts++] = x;
             }
             if (verbose > 2)
@@ -1497,81 +2254,69 @@ the same time. */
                 }
 continue1:  ;
         }
-        offset = guesses[0];
-        error = minerr+guesses[count <= 5 ? count-1 : 5]-offset;
-        if (verbose > 2)
-            fprintf(stderr,"accepts=%d rejects=%d flushes=%d replicates=%d\n",
-                accepts,rejects,flushes,replicates);
+        if (ret == 0) {
+            offset = guesses[0];
+            error = minerr+guesses[count <= 5 ? count-1 : 5]-offset;
+            if (verbose > 2)
+                fprintf(stderr,
+                    "accepts=%d rejects=%d flushes=%d replicates=%d\n",
+                    accepts,rejects,flushes,replicates);
+        }
 
-/* Handle the client/server model.  It keeps a record of transmitted times,
-mainly out of paranoia. */
+/* Several servers are all queried at once, each with its own sockets and
+exchange, and the best answer taken.  This also does for one server, when the
+requests to it are hedged. */
+
+    } else if (parallel) {
+        ret = sample_servers(NULL,hostnames,nhosts,libmsntp_port,
+            client.deadline,NULL,NULL,NULL,&offset,&error);
+        accepts = (ret == 0);
+
+/* Handle the client/server model, a request and its response at a time.  It
+keeps a record of transmitted times, mainly out of paranoia.  A response that
+is lost or rejected is followed by another request at once. */
 
     } else {
-        offset = 0.0;
-        error = NTP_INSANITY;
-        while (accepts < count && attempts < 2*count) {
-            if (current_time(JAN_1970) > deadline) {
-                fatal(EMSNTP_TOO_FEW_RESPONSES,
-                      "not enough valid responses received in time",NULL);
-                return EMSNTP_TOO_FEW_RESPONSES;
-            }
-            make_packet(&data,NTP_CLIENT);
-            outgoing[attempts++] = data.transmit;
-            if (verbose > 2) {
-                fprintf(stderr,"Outgoing packet on socket %d:\n",cycle);
-                display_data(&data);
-            }
-            pack_ntp(transmit,NTP_PACKET_MIN,&data);
-            if (verbose > 2) display_packet(transmit,NTP_PACKET_MIN);
+        while (1) {
             if (ret = flush_socket(cycle, &k))
-                return ret;
-            flushes += k;
-            write_socket(cycle,transmit,NTP_PACKET_MIN);
-            if (read_packet(cycle,&data,&x,&y)) {
-                if (++rejects > count) {
-                    fatal(EMSNTP_BAD_RESPONSES,
-                          "too many bad or lost packets",NULL);
-                    return EMSNTP_BAD_RESPONSES;
+                break;
+            client.flushes += k;
+            for (k = query_burst(&client); k > 0; --k) {
+                if (ret = query_request(cycle,&client,transmit))
+                    break;
+                write_socket(cycle,transmit,NTP_PACKET_MIN);
+                if (k > 1 && client.spacing > 0) {
+                    gap.tv_sec = 0;
+                    gap.tv_nsec = 1000L*client.spacing;
+                    nanosleep(&gap,NULL);
                 }
-                else
-                    continue;
-            } else
-                ++accepts;
-            if (++cycle >= nhosts) cycle = 0;
-
-/* Work out the most accurate time, and check that it isn't more accurate than
-the results warrant. */
-
-            if (verbose > 2)
-                fprintf(stderr,"Offset=%.6f+/-%.6f disp=%.6f\n",x,y,dispersion);
-            else if (verbose > 1)
-                fprintf(stderr,"%s: offset=%.3f+/-%.3f disp=%.3f\n",
-                    argv0,x,y,dispersion);
-            if ((a = x-offset) < 0.0) a = -a;
-            if (accepts <= 1) a = 0.0;
-            b = error+y;
-            if (y < error) {
-                offset = x;
-                error = y;
-            }
-            if (verbose > 2)
-                fprintf(stderr,"best=%.6f+/-%.6f\n",offset,error);
-            if (a > b) {
-                sprintf(text,"%d",cycle);
-                fatal(0,"inconsistent times got from NTP server on socket %s",
-                        text);
-                return EMSNTP_NTP_INCONSISTENCY;
             }
-            if (error <= minerr) break;
+            if (ret) break;
+            do {
+                ret = read_socket(cycle,receive,NTP_PACKET_MAX+1,
+                    query_left(&client),&length);
+                socket_departures(cycle,client.departures,client.attempts);
+                ret = query_reply(cycle,&client,(ret == 0 ? receive : NULL),
+                    length,socket_arrival(cycle,0));
+            } while (ret == -2);
+            if (ret != -1)
+                break;
         }
-        if (verbose > 2)
-            fprintf(stderr,"accepts=%d rejects=%d flushes=%d\n",
-                accepts,rejects,flushes);
+        if (ret == 0) ret = finish_query(&client);
+        if (dispersion < client.dispersion) dispersion = client.dispersion;
+        accepts = client.accepts;
+        offset = client.offset;
+        error = client.error;
     }
 
-/* Tidy up the socket, issues diagnostics and perform the action. */
+/* Tidy up the socket, issues diagnostics and perform the action.  The sockets
+are closed whatever happened, so that the next call can open them again. */
 
-    for (k = 0; k < nhosts; ++k) close_socket(k);
+    for (k = 0; k < nhosts && ! parallel; ++k) close_socket(k);
+    if (ret != 0) {
+        if (locked) set_lock(0);
+        return ret;
+    }
     if (accepts == 0) {
         fatal(EMSNTP_NO_GOOD_RESPONSE,"no acceptable packets received",NULL);
         return EMSNTP_NO_GOOD_RESPONSE;
@@ -1738,6 +2483,7 @@ one of the specialised routines to do the work. */
         if (minerr <= 0.0) minerr = (operation == op_listen ? 0.5 : 0.1);
         if (maxerr <= 0.0) maxerr = 5.0;
         if (count == 0) count = (argc-1 < 5 ? 5 : argc-1);
+        samples = count;
         if ((argc == 1 || (daemon != 0 && action != action_query)) && count < 5)
             fatal(0,"at least 5 packets needed in this mode",NULL);
         if ((action == action_reset || action == action_adjust) &&
@@ -1802,8 +2548,9 @@ operation.  The calls do not return. */
                 (savefile = fopen(savename,"rb+")) == NULL &&
                 (savefile = fopen(savename,"wb+")) == NULL)
             fatal(0,"unable to open the daemon save file",NULL);
-        run_daemon(hostnames,nhosts,1);
-        while (1) run_daemon(hostnames,nhosts,0);
+        if (run_daemon(hostnames,nhosts,1) == 0)
+            while (run_daemon(hostnames,nhosts,0) == 0) ;
+        return EXIT_FAILURE;
     } else
         run_client(hostnames,nhosts,&offset);
     fatal(EXIT_FAILURE,"internal error at end of main",NULL);
@@ -0,0 +1,130 @@
+/**
+ * libmsntp
+ * http://snarfed.org/libmsntp
+ *
+ * Copyright 2005, Ryan Barrett <libmsntp@ryanb.org>
+ *
+ * The reader for the corrected time that an msntp daemon publishes in POSIX
+ * shared memory (see msntp_shm_open in libmsntp.h). It is complete in this
+ * header, so programs that only read the time need neither libmsntp nor a
+ * network connection: they attach to the segment once, and msntp_shm_now then
+ * costs one clock_gettime, which is handled in user space on Linux, and a few
+ * loads. There are no system calls or locks; the publisher guards its updates
+ * with a sequence number (a seqlock), and a reader that overlaps one simply
+ * reads the values again.
+ *
+ * It needs GCC or Clang, for the atomic builtins, and works from C or C++.
+ */
+
+#ifndef _MSNTP_SHM_H
+#define _MSNTP_SHM_H
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define MSNTP_SHM_MAGIC   0x544e534dU   /* "MSNT" */
+#define MSNTP_SHM_VERSION 1
+
+/**
+ * The layout of the segment. The estimate is that the server's time is the
+ * local CLOCK_REALTIME plus offset plus drift times the time since epoch, to
+ * within error plus drift_error times the time since epoch. Times are in
+ * nanoseconds since 1970 and the rest in seconds. valid is 0 until the first
+ * estimate, and again once the publisher has stopped.
+ */
+struct msntp_shm {
+    uint32_t magic, version;
+    uint32_t sequence;                  /* odd while it is being written */
+    uint32_t valid;
+    int64_t epoch;                      /* local time of the estimate */
+    int64_t offset;                     /* server minus local, at epoch */
+    int64_t updated;                    /* local time it was published */
+    double drift;                       /* of the server against local */
+    double error;
+    double drift_error;
+};
+
+/**
+ * Maps the segment with the given name, such as "/msntp", read-only. Returns
+ * NULL if it does not exist or is not an msntp segment.
+ */
+static inline const struct msntp_shm *msntp_shm_attach(const char *name) {
+    struct stat info;
+    void *map;
+    int fd;
+
+    if ((fd = shm_open(name, O_RDONLY, 0)) < 0)
+        return NULL;
+    if (fstat(fd, &info) < 0 ||
+            info.st_size < (off_t)sizeof(struct msntp_shm)) {
+        close(fd);
+        return NULL;
+    }
+    map = mmap(NULL, sizeof(struct msntp_shm), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return NULL;
+    if (((const struct msntp_shm *)map)->magic != MSNTP_SHM_MAGIC ||
+            ((const struct msntp_shm *)map)->version != MSNTP_SHM_VERSION) {
+        munmap(map, sizeof(struct msntp_shm));
+        return NULL;
+    }
+    return (const struct msntp_shm *)map;
+}
+
+/**
+ * Unmaps a segment mapped by msntp_shm_attach. It is safe to pass NULL.
+ */
+static inline void msntp_shm_detach(const struct msntp_shm *shm) {
+    if (shm)
+        munmap((void *)shm, sizeof(struct msntp_shm));
+}
+
+/**
+ * Puts the server's current time, as the publisher last estimated it, in now,
+ * and its estimated error in seconds in error if that is not NULL. Returns 0,
+ * or -1 if there is no estimate, in which case now is the local time. The
+ * error grows with the time since the estimate, so a publisher that has died
+ * shows up as a growing error, and updated says when it last wrote.
+ */
+static inline int msntp_shm_now(const struct msntp_shm *shm,
+                                struct timespec *now, double *error) {
+    uint32_t sequence, valid;
+    int64_t epoch, offset, local, elapsed;
+    double drift, bound, drift_error;
+
+    do {
+        sequence = __atomic_load_n(&shm->sequence, __ATOMIC_ACQUIRE);
+        valid = __atomic_load_n(&shm->valid, __ATOMIC_RELAXED);
+        epoch = __atomic_load_n(&shm->epoch, __ATOMIC_RELAXED);
+        offset = __atomic_load_n(&shm->offset, __ATOMIC_RELAXED);
+        __atomic_load(&shm->drift, &drift, __ATOMIC_RELAXED);
+        __atomic_load(&shm->error, &bound, __ATOMIC_RELAXED);
+        __atomic_load(&shm->drift_error, &drift_error, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((sequence & 1) ||
+             sequence != __atomic_load_n(&shm->sequence, __ATOMIC_RELAXED));
+
+    clock_gettime(CLOCK_REALTIME, now);
+    if (!valid)
+        return -1;
+    local = (int64_t)now->tv_sec * 1000000000 + now->tv_nsec;
+    elapsed = local - epoch;
+    local += offset + (int64_t)(drift * (double)elapsed);
+    now->tv_sec = (time_t)(local / 1000000000);
+    now->tv_nsec = (long)(local % 1000000000);
+    if (now->tv_nsec < 0) {
+        now->tv_nsec += 1000000000;
+        --now->tv_sec;
+    }
+    if (error)
+        *error = bound + drift_error * 1.0e-9 *
+                 (double)(elapsed < 0 ? -elapsed : elapsed);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,771 @@
+/**
+ * libmsntp
+ * http://snarfed.org/libmsntp
+ *
+ * Copyright 2005, Ryan Barrett <libmsntp@ryanb.org>
+ *
+ * This includes the non-blocking client, for programs with their own event
+ * loop. Each msntp_query has its own socket and its own client_query, and is
+ * stepped through the same exchange as run_client() one packet at a time:
+ * the caller waits for the socket to become readable or for the timeout to
+ * pass, and tells the query which happened. Nothing here blocks, apart from
+ * looking up the server's name, which the address cache makes cheap after the
+ * first time.
+ *
+ * Queries do not share any state with each other or with the sockets in
+ * socket.c, so any number can be in progress at once. They take their settings
+ * from an msntp_ctx when they start, or from the globals in main.c if there is
+ * none; with a context, they can run in any thread. Clients with several
+ * servers use queries to ask all of them at once, rather than in turn.
+ *
+ * The one thing that they do share is a record of the recent round trips to
+ * each server, behind a lock, for hedging: when a reply is slower than nearly
+ * all of the recent ones, the request is sent again, and the first answer
+ * taken, so that a lost or delayed packet costs little more than the usual
+ * round trip instead of the whole wait.
+ */
+
+#include "header.h"
+#include "internet.h"
+#include <fcntl.h>
+#include <errno.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+
+#define QUERY
+#include "kludges.h"
+#undef QUERY
+
+/* defined in libmsntp.c */
+extern int libmsntp_dns_ttl;
+
+/* defined in main.c */
+extern double dispersion;
+
+
+/* Room for the control data that comes with each reply, which is at most a
+kernel timestamp. */
+
+#define CONTROL_SIZE 128
+
+typedef union {
+    struct cmsghdr header;
+    char space[CONTROL_SIZE];
+} control_buffer;
+
+/* The round trips of the last few replies from each of the last few servers,
+in microseconds, to work out when a request is overdue.  Until there are
+enough of them, nothing is hedged.  The limit is so that a request is not sent
+again merely because the thread that was waiting for its reply was descheduled
+for a moment. */
+
+#define HEDGE_SERVERS      16          /* Servers remembered */
+#define HEDGE_SAMPLES      32          /* Round trips remembered for each */
+#define HEDGE_MINIMUM       8          /* Needed before hedging */
+#define HEDGE_PERCENTILE   95          /* Of the round trips, when overdue */
+#define HEDGE_LIMIT      1000          /* Microseconds; never hedge sooner */
+
+typedef struct {
+    struct sockaddr_storage address;
+    int length, count, next;
+    int64_t used;
+    int samples[HEDGE_SAMPLES];
+} round_trips;
+
+static round_trips histories[HEDGE_SERVERS];
+static pthread_mutex_t history_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct msntp_query {
+    client_query state;                /* The exchange, as in run_client() */
+    struct msntp_session *session;     /* Whose socket it uses, or NULL */
+    struct sockaddr_storage address;   /* The server's */
+    int length,                        /* Of the server's address */
+        descriptor,                    /* The query's socket */
+        which,                         /* Its server's index, for messages */
+        stamping,                      /* Whether the kernel timestamps it */
+        pending,                       /* Requests of the burst still to go */
+        status;                        /* -1 while running, else the result */
+    unsigned long base;                /* Requests sent on the socket before */
+    int64_t next,                      /* When to send the next of them */
+        expires,                       /* When to give up on the replies */
+        hedge;                         /* When to send one again, or 0 */
+    unsigned char transmit[NTP_PACKET_MIN];
+};
+
+/* A session keeps a connected socket to one server, and its address, for any
+number of queries, one at a time.  The address is looked up again once the
+cache may have a newer one, which it will have fetched in the background, and
+the socket is reopened if it changes or goes wrong. */
+
+struct msntp_session {
+    struct msntp_ctx settings;         /* Copied when it is opened */
+    char *hostname;
+    struct sockaddr_storage address;   /* The server's, if length > 0 */
+    int port, length, descriptor, stamping,
+        busy;                          /* Whether a query is using it */
+    unsigned long sent;                /* Requests sent on the socket */
+    int64_t resolved;                  /* When it was looked up, or 0 */
+};
+
+
+
+static void collect (struct msntp_query *query) {
+
+/* Keep the kernel's departure times of the requests.  Each request sent on
+the socket is one attempt, so they are numbered in the same way, after any that
+went before on a session's socket. */
+
+    ntp_stamp stamps[2*COUNT_MAX];
+    int k;
+
+    if (! query->stamping) return;
+    memset(stamps,0,sizeof(stamps));
+    collect_departures(query->descriptor,query->base,
+        query->base+query->state.attempts,stamps,2*COUNT_MAX);
+    for (k = 0; k < query->state.attempts; ++k)
+        if (stamps[(query->base+k)%(2*COUNT_MAX)] != 0)
+            query->state.departures[k] =
+                stamps[(query->base+k)%(2*COUNT_MAX)];
+}
+
+
+
+static round_trips *find_history (struct msntp_query *query, int create) {
+
+/* Find the record of a query's server, or if create is set, make one in place
+of the one used least recently.  The lock must be held. */
+
+    round_trips *entry = NULL;
+    int k;
+
+    for (k = 0; k < HEDGE_SERVERS; ++k) {
+        if (histories[k].length == query->length &&
+                memcmp(&histories[k].address,&query->address,
+                    query->length) == 0)
+            return &histories[k];
+        if (entry == NULL || histories[k].used < entry->used)
+            entry = &histories[k];
+    }
+    if (! create) return NULL;
+    memset(entry,0,sizeof(*entry));
+    memcpy(&entry->address,&query->address,query->length);
+    entry->length = query->length;
+    return entry;
+}
+
+
+
+static void record_trip (struct msntp_query *query) {
+
+/* Remember the round trip of the reply that a query has just accepted. */
+
+    round_trips *entry;
+
+    pthread_mutex_lock(&history_lock);
+    entry = find_history(query,1);
+    entry->samples[entry->next] = (int)(1.0e6*query->state.roundtrip);
+    entry->next = (entry->next+1)%HEDGE_SAMPLES;
+    if (entry->count < HEDGE_SAMPLES) ++entry->count;
+    entry->used = monotonic_nanos();
+    pthread_mutex_unlock(&history_lock);
+}
+
+
+
+static int64_t overdue (struct msntp_query *query) {
+
+/* Return how long after it is sent a request to the query's server is overdue,
+in nanoseconds, or 0 if that is not known. */
+
+    round_trips *entry;
+    int sorted[HEDGE_SAMPLES], count = 0, x, j, k;
+
+    pthread_mutex_lock(&history_lock);
+    if ((entry = find_history(query,0)) != NULL &&
+            (count = entry->count) >= HEDGE_MINIMUM)
+        memcpy(sorted,entry->samples,count*sizeof(int));
+    pthread_mutex_unlock(&history_lock);
+    if (count < HEDGE_MINIMUM) return 0;
+
+/* Note that insertion sort IS a good method for this amount of data. */
+
+    for (k = 1; k < count; ++k) {
+        x = sorted[k];
+        for (j = k; j > 0 && sorted[j-1] > x; --j) sorted[j] = sorted[j-1];
+        sorted[j] = x;
+    }
+    x = sorted[(HEDGE_PERCENTILE*count+99)/100-1];
+    return 1000*(int64_t)(x > HEDGE_LIMIT ? x : HEDGE_LIMIT);
+}
+
+
+
+static int send_packet (struct msntp_query *query) {
+
+/* Send the request in transmit to the server.  Returns 0, or an error. */
+
+    errno = 0;
+    if ((query->session != NULL ?
+            send(query->descriptor,query->transmit,NTP_PACKET_MIN,0) :
+            sendto(query->descriptor,query->transmit,NTP_PACKET_MIN,0,
+                (struct sockaddr *)&query->address,query->length)) !=
+            NTP_PACKET_MIN) {
+        fatal(errno,"unable to send NTP packet",NULL);
+        return errno;
+    }
+    return 0;
+}
+
+
+
+static int send_due (struct msntp_query *query) {
+
+/* Send the requests of the burst that are due, and restart the timer after
+each.  When hedging, the last of them is sent again if it is overdue, unless
+it is answered first.  Returns 0, or an error. */
+
+    int64_t now = monotonic_nanos(), late;
+    int ret;
+
+    if (query->hedge != 0 && now >= query->hedge && query->pending == 0) {
+        query->hedge = 0;
+        if ((ret = query_duplicate(query->which,&query->state,
+                query->transmit)) > 0)
+            return ret;
+        if (ret == 0) {
+            if (verbose > 1)
+                fprintf(stderr,"%s: hedging overdue request\n",argv0);
+            return send_packet(query);
+        }
+    }
+    while (query->pending > 0 && now >= query->next) {
+        if ((ret = query_request(query->which,&query->state,
+                query->transmit)) || (ret = send_packet(query)))
+            return ret;
+        --query->pending;
+        query->expires = now+(int64_t)query->state.waiting*1000000;
+        if (query->expires > query->state.deadline)
+            query->expires = query->state.deadline;
+        query->hedge = 0;
+        if (query->state.hedging && (late = overdue(query)) > 0 &&
+                now+late < query->expires)
+            query->hedge = now+late;
+        if (query->state.spacing > 0) {
+            query->next = now+(int64_t)query->state.spacing*1000;
+            break;
+        }
+    }
+    return 0;
+}
+
+
+
+static int send_burst (struct msntp_query *query) {
+
+/* Start sending the next requests of the exchange, one or a burst, throwing
+away anything queued on the socket first, as flush_socket() does.  Returns 0,
+or an error. */
+
+    char buffer[256];
+
+    while (recv(query->descriptor,buffer,sizeof(buffer),MSG_DONTWAIT) >= 0)
+        ++query->state.flushes;
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        fatal(errno,"unable to flush socket",NULL);
+        return errno;
+    }
+    query->pending = query_burst(&query->state);
+    query->next = 0;
+    return send_due(query);
+}
+
+
+
+static int advance (struct msntp_query *query, unsigned char *receive,
+    int length, ntp_stamp arrival) {
+
+/* Hand a reply (or the loss of the outstanding ones, if receive is NULL) to
+the exchange, and either wait for more, send the next requests or settle the
+result.  Requests of a burst that are still to go are sent by the timer.  Any
+reply that counts puts off hedging, and a good one is added to the round trips.
+A late reply to the other copy of a hedged request does neither. */
+
+    int accepts = query->state.accepts, rejects = query->state.rejects, ret;
+
+    collect(query);
+    ret = query_reply(query->which,&query->state,receive,length,arrival);
+    if (receive != NULL && (query->state.accepts > accepts ||
+            query->state.rejects > rejects))
+        query->hedge = 0;
+    if (query->state.hedging && query->state.accepts > accepts)
+        record_trip(query);
+    if (ret == -2 || (ret == -1 && query->pending > 0))
+        return -1;
+    if (ret == -1 && (ret = send_burst(query)) == 0)
+        return -1;
+    query->status = (ret == 0 ? finish_query(&query->state) : ret);
+    return query->status;
+}
+
+
+
+static int client_socket (struct sockaddr_storage *address, int length,
+    int connected, int *descriptor) {
+
+/* Open a non-blocking socket for talking to a server, bound to any port and,
+for sessions, connected to the server.  Returns 0, or an error. */
+
+    struct sockaddr_storage here;
+    int size, flags, ret;
+
+    wildcard_address(&here,&size,address->ss_family,0,0);
+    errno = 0;
+    if ((*descriptor = socket(address->ss_family,SOCK_DGRAM,0)) < 0 ||
+            bind(*descriptor,(struct sockaddr *)&here,size) < 0 ||
+            (connected &&
+                connect(*descriptor,(struct sockaddr *)address,length) < 0) ||
+            (flags = fcntl(*descriptor,F_GETFL,0)) < 0 ||
+            fcntl(*descriptor,F_SETFL,flags|O_NONBLOCK) < 0) {
+        ret = errno;
+        fatal(ret,"unable to allocate socket for NTP",NULL);
+        if (*descriptor >= 0) close(*descriptor);
+        *descriptor = -1;
+        return ret;
+    }
+    return 0;
+}
+
+
+
+static int begin_query (struct msntp_query **result, struct msntp_query *query,
+    const struct msntp_ctx *ctx, int64_t deadline) {
+
+/* Start the exchange of a query whose socket is ready, and send the first
+request.  The query is returned even if that fails, so that the error can be
+read back. */
+
+    int ret;
+
+    start_query(&query->state,ctx,deadline);
+    query->status = -1;
+    *result = query;
+    if ((ret = send_burst(query)))
+        query->status = ret;
+    return ret;
+}
+
+
+
+extern int open_query (struct msntp_query **result, char *hostname, int port,
+    const struct msntp_ctx *ctx, int64_t deadline) {
+
+/* Look up the server, open a non-blocking socket for the exchange and send the
+first request, with the settings in ctx or the globals.  All of that must be
+done by the deadline, from query_deadline() or earlier.  The query is NULL only
+if it could not be set up at all. */
+
+    struct msntp_query *query;
+    int ret;
+
+    *result = NULL;
+    if ((query = malloc(sizeof(*query))) == NULL) {
+        fatal(errno,"unable to allocate query",NULL);
+        return errno ? errno : ENOMEM;
+    }
+    memset(query,0,sizeof(*query));
+    if ((ret = find_address(&query->address,&query->length,hostname,port,
+            millis_left(deadline))) ||
+            (ret = client_socket(&query->address,query->length,0,
+                &query->descriptor))) {
+        free(query);
+        return ret;
+    }
+    query->stamping = client_stamping(query->descriptor);
+    return begin_query(result,query,ctx,deadline);
+}
+
+
+
+extern int query_readable (struct msntp_query *query) {
+
+/* Take whatever has arrived on the socket.  If nothing has, the kernel may
+have queued the departure time of the request instead, so keep that. */
+
+    struct msghdr message;
+    struct iovec vector;
+    struct sockaddr_storage sender;
+    control_buffer control;
+    unsigned char receive[NTP_PACKET_MAX+1];
+    int k;
+
+    if (query->status != -1)
+        return query->status;
+    while (1) {
+        memset(&message,0,sizeof(message));
+        vector.iov_base = receive;
+        vector.iov_len = sizeof(receive);
+        message.msg_name = &sender;
+        message.msg_namelen = sizeof(sender);
+        message.msg_iov = &vector;
+        message.msg_iovlen = 1;
+        message.msg_control = &control;
+        message.msg_controllen = sizeof(control);
+        errno = 0;
+        if ((k = recvmsg(query->descriptor,&message,MSG_DONTWAIT)) < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                fatal(errno,"unable to receive NTP packet from server",NULL);
+                return query->status = errno;
+            }
+            collect(query);
+            errno = 0;
+            return -1;
+        }
+        if (verbose > 2)
+            fprintf(stderr,"Packet of length %d received\n",k);
+        if (advance(query,receive,k,arrival_stamp(&message)) != -1)
+            return query->status;
+    }
+}
+
+
+
+extern int query_timer (struct msntp_query *query) {
+
+/* Send any requests of a burst that are due, or a hedge, and count the
+outstanding ones as lost if their time is up.  Anything waiting on the socket
+is taken first: the departure times of the requests make it report an error,
+and so does a refusal on a connected socket, and the caller's poll would never
+sleep otherwise. */
+
+    int ret;
+
+    if ((ret = query_readable(query)) != -1)
+        return ret;
+    if ((ret = send_due(query)))
+        return query->status = ret;
+    if (monotonic_nanos() < query->expires)
+        return -1;
+    if (verbose > 1)
+        fprintf(stderr,"%s: receive timed out after %d ms\n",
+            argv0,query->state.waiting);
+    return advance(query,NULL,0,0);
+}
+
+
+
+extern int query_timeout (struct msntp_query *query) {
+
+/* Return the milliseconds until query_timer() should be called, rounded up,
+or -1 if the query is over. */
+
+    int64_t when;
+
+    if (query->status != -1)
+        return -1;
+    when = query->expires;
+    if (query->pending > 0 && query->next < when) when = query->next;
+    if (query->hedge != 0 && query->hedge < when) when = query->hedge;
+    return millis_left(when);
+}
+
+
+
+extern int query_descriptor (struct msntp_query *query) {
+    return query->descriptor;
+}
+
+
+
+extern int query_result (struct msntp_query *query, double *offset,
+    double *error) {
+
+/* Return the result of a query, which is -1 if it is still running. */
+
+    if (query->status == 0) {
+        *offset = query->state.offset;
+        *error = query->state.error;
+    }
+    return query->status;
+}
+
+
+
+static void reset_session (struct msntp_session *session) {
+    if (session->descriptor >= 0) close(session->descriptor);
+    session->descriptor = -1;
+    session->resolved = 0;
+}
+
+
+
+extern void close_query (struct msntp_query *query) {
+
+/* Free a query, and close its socket unless it belongs to a session.  After
+a failure, a session looks its server up again before the next query, and
+opens a new socket if the socket itself went wrong. */
+
+    if (query == NULL) return;
+    if (query->session == NULL) {
+        if (query->descriptor >= 0) close(query->descriptor);
+    } else {
+        query->session->sent += query->state.attempts;
+        query->session->busy = 0;
+        if (query->status > 0)
+            reset_session(query->session);
+        else if (query->status != 0)
+            query->session->resolved = 0;
+    }
+    free(query);
+}
+
+
+
+extern int sample_servers (const struct msntp_ctx *ctx, char *hostnames[],
+    int nhosts, int port, int64_t deadline, double *offsets, double *errors,
+    int *results, double *offset, double *error) {
+
+/* Query all of the servers at once, each with its own exchange, so that a
+round costs one round trip however many there are.  The replies are told apart
+by their sockets, and then matched with their requests by originate timestamp,
+as usual.  The per-server results go in the arrays, which may be NULL, even if
+this fails.  The combined estimate is the most accurate one, as in run_client(),
+provided that none of the others is inconsistent with it.  If they all fail, so
+does this, with the first one's error.  They all share the deadline, so the
+servers are looked up one after another within it.  Without a context, the
+settings and the dispersion are the globals, as for run_client(). */
+
+    struct msntp_query *queries[MAX_SOCKETS];
+    struct pollfd fds[MAX_SOCKETS];
+    double x[MAX_SOCKETS], y[MAX_SOCKETS];
+    int status[MAX_SOCKETS], running = 0, best = -1, ret = 0, timeout, t, k;
+    char text[50];
+
+    if (nhosts < 1 || nhosts > MAX_SOCKETS) {
+        fatal(EMSNTP_INTERNAL,"number of servers out of range",NULL);
+        return EMSNTP_INTERNAL;
+    }
+    for (k = 0; k < nhosts; ++k) {
+        status[k] = open_query(&queries[k],hostnames[k],port,ctx,deadline);
+        fds[k].fd = -1;
+        fds[k].events = POLLIN;
+        if (status[k] == 0) {
+            status[k] = -1;
+            queries[k]->which = k;
+            fds[k].fd = queries[k]->descriptor;
+            ++running;
+        }
+    }
+
+/* Wait for whichever is next, reply or timeout, and step that query on. */
+
+    while (running > 0) {
+        timeout = -1;
+        for (k = 0; k < nhosts; ++k)
+            if (status[k] == -1 && (t = query_timeout(queries[k])) >= 0 &&
+                    (timeout < 0 || t < timeout))
+                timeout = t;
+        errno = 0;
+        if (poll(fds,nhosts,timeout) < 0 && errno != EINTR) {
+            ret = errno;
+            fatal(ret,"unable to wait for NTP packets",NULL);
+            break;
+        }
+        for (k = 0; k < nhosts; ++k) {
+            if (status[k] != -1) continue;
+            status[k] = ((fds[k].revents & POLLIN) ?
+                query_readable(queries[k]) : query_timer(queries[k]));
+            if (status[k] != -1) {
+                fds[k].fd = -1;
+                --running;
+            }
+        }
+    }
+
+/* Collect the results and pick the best. */
+
+    for (k = 0; k < nhosts; ++k) {
+        if (status[k] == -1) status[k] = ret;
+        if (status[k] == 0) {
+            query_result(queries[k],&x[k],&y[k]);
+            if (best < 0 || y[k] < y[best]) best = k;
+        }
+        if (offsets != NULL && status[k] == 0) offsets[k] = x[k];
+        if (errors != NULL && status[k] == 0) errors[k] = y[k];
+        if (results != NULL) results[k] = status[k];
+        if (ctx == NULL && queries[k] != NULL &&
+                dispersion < queries[k]->state.dispersion)
+            dispersion = queries[k]->state.dispersion;
+        close_query(queries[k]);
+    }
+    if (ret != 0)
+        return ret;
+    if (best < 0)
+        return status[0];
+    for (k = 0; k < nhosts; ++k)
+        if (status[k] == 0 && fabs(x[k]-x[best]) > y[k]+y[best]) {
+            sprintf(text,"%d",k);
+            fatal(0,"inconsistent times got from NTP server %s",text);
+            return EMSNTP_NTP_INCONSISTENCY;
+        }
+    *offset = x[best];
+    *error = y[best];
+    return 0;
+}
+
+
+
+static int connect_session (struct msntp_session *session, int64_t deadline) {
+
+/* Look the server up again if it is time, and (re)open the socket if there is
+none or the address has changed.  Only a session without an address waits for
+the lookup, up to the deadline; otherwise the refresh happens in the background
+and the old address stays in use until it has an answer, or if it fails. */
+
+    struct sockaddr_storage address;
+    int64_t now = monotonic_nanos();
+    int length, ret;
+
+    if (session->descriptor < 0 || session->resolved == 0 ||
+            now-session->resolved >= (int64_t)libmsntp_dns_ttl*1000000000) {
+        if ((ret = find_address(&address,&length,session->hostname,
+                session->port,(session->length > 0 ? -1 :
+                    millis_left(deadline)))) == 0) {
+            session->resolved = now;
+            if (length != session->length ||
+                    memcmp(&address,&session->address,length) != 0) {
+                reset_session(session);
+                session->resolved = now;
+                memcpy(&session->address,&address,sizeof(address));
+                session->length = length;
+            }
+        } else if (session->length == 0)
+            return ret;
+        else if (verbose)
+            fprintf(stderr,"%s: keeping the old address of %s\n",argv0,
+                session->hostname);
+    }
+    if (session->descriptor < 0) {
+        if ((ret = client_socket(&session->address,session->length,1,
+                &session->descriptor)))
+            return ret;
+        session->stamping = client_stamping(session->descriptor);
+        session->sent = 0;
+    }
+    return 0;
+}
+
+
+
+extern int open_session (struct msntp_session **result, char *hostname,
+    int port, const struct msntp_ctx *ctx) {
+
+/* Look up the server and connect a socket to it, with the settings in ctx. */
+
+    struct msntp_session *session;
+    int ret;
+
+    *result = NULL;
+    if ((session = calloc(1,sizeof(*session))) == NULL ||
+            (session->hostname = strdup(hostname)) == NULL) {
+        free(session);
+        fatal(ENOMEM,"unable to allocate session",NULL);
+        return ENOMEM;
+    }
+    session->settings = *ctx;
+    session->port = port;
+    session->descriptor = -1;
+    if ((ret = connect_session(session,query_deadline(ctx)))) {
+        close_session(session);
+        return ret;
+    }
+    *result = session;
+    return 0;
+}
+
+
+
+extern int session_query (struct msntp_query **result,
+    struct msntp_session *session) {
+
+/* Start a query on a session's socket, checking the address first. */
+
+    struct msntp_query *query;
+    int64_t deadline = query_deadline(&session->settings);
+    int ret;
+
+    *result = NULL;
+    if (session->busy) {
+        fatal(EMSNTP_INTERNAL,"session already has a query running",NULL);
+        return EMSNTP_INTERNAL;
+    }
+    if ((ret = connect_session(session,deadline)))
+        return ret;
+    if ((query = malloc(sizeof(*query))) == NULL) {
+        fatal(ENOMEM,"unable to allocate query",NULL);
+        return ENOMEM;
+    }
+    memset(query,0,sizeof(*query));
+    query->session = session;
+    memcpy(&query->address,&session->address,sizeof(session->address));
+    query->length = session->length;
+    query->descriptor = session->descriptor;
+    query->stamping = session->stamping;
+    query->base = session->sent;
+    session->busy = 1;
+    return begin_query(result,query,&session->settings,deadline);
+}
+
+
+
+static int wait_query (struct msntp_query *query) {
+
+/* Run a query to the end, for the blocking functions. */
+
+    struct pollfd fd;
+    int ret = -1;
+
+    fd.fd = query->descriptor;
+    fd.events = POLLIN;
+    while (ret == -1) {
+        errno = 0;
+        if (poll(&fd,1,query_timeout(query)) < 0 && errno != EINTR) {
+            fatal(errno,"unable to wait for NTP packets",NULL);
+            return errno;
+        }
+        ret = query_timer(query);
+    }
+    return ret;
+}
+
+
+
+extern int session_offset (struct msntp_session *session, double *offset,
+    double *error) {
+
+/* Run an exchange on a session.  If the socket itself fails, which for a
+connected socket includes the server refusing it, it is tried once more with a
+new socket, in case the address has changed. */
+
+    struct msntp_query *query;
+    int ret, tries;
+
+    for (tries = 0; tries < 2; ++tries) {
+        if ((ret = session_query(&query,session)) == 0)
+            ret = wait_query(query);
+        if (ret == 0)
+            query_result(query,offset,error);
+        close_query(query);
+        if (ret <= 0) break;
+    }
+    return ret;
+}
+
+
+
+extern void close_session (struct msntp_session *session) {
+    if (session == NULL) return;
+    reset_session(session);
+    free(session->hostname);
+    free(session);
+}
@@ -0,0 +1,134 @@
+/**
+ * libmsntp
+ * http://snarfed.org/libmsntp
+ *
+ * Copyright 2005, Ryan Barrett <libmsntp@ryanb.org>
+ *
+ * This includes the publisher of the daemon's estimates, for other processes
+ * on the same host to read with msntp_shm_now (see msntp_shm.h). There is one
+ * POSIX shared memory segment per process, written only by the thread running
+ * the daemon, under a seqlock: the sequence number is made odd before the
+ * values are changed and even again afterwards, so a reader that sees it odd,
+ * or changed, knows to read them again. The publisher never waits for readers.
+ * A mutex stops the segment being unmapped by msntp_shm_close while the daemon
+ * thread is publishing in it; only the publishers take it.
+ */
+
+#include "header.h"
+
+#define SHM
+#include "kludges.h"
+#undef SHM
+
+#ifndef SHM_MISSING
+#include "msntp_shm.h"
+
+#include <pthread.h>
+
+static struct msntp_shm *segment = NULL;
+static pthread_mutex_t segment_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+
+static void publish (int valid, double when, double offset, double error,
+    double drift, double drifterr) {
+
+/* Publish an estimate in the segment, which must exist, with the lock held. */
+
+    uint32_t sequence;
+
+    if (drifterr < 0.0) drifterr = 0.0;
+    sequence = segment->sequence;
+    __atomic_store_n(&segment->sequence,sequence+1,__ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&segment->valid,(uint32_t)valid,__ATOMIC_RELAXED);
+    __atomic_store_n(&segment->epoch,convert_nanos(when-JAN_1970),
+        __ATOMIC_RELAXED);
+    __atomic_store_n(&segment->offset,convert_nanos(offset),__ATOMIC_RELAXED);
+    __atomic_store_n(&segment->updated,current_nanos(),__ATOMIC_RELAXED);
+    __atomic_store(&segment->drift,&drift,__ATOMIC_RELAXED);
+    __atomic_store(&segment->error,&error,__ATOMIC_RELAXED);
+    __atomic_store(&segment->drift_error,&drifterr,__ATOMIC_RELAXED);
+    __atomic_store_n(&segment->sequence,sequence+2,__ATOMIC_RELEASE);
+}
+#endif
+
+
+
+int shm_attach (const char *name) {
+
+/* Create the segment (or take over an existing one) and map it for writing.
+Nothing is valid in it until the first estimate is published. */
+
+#ifdef SHM_MISSING
+    fatal(EMSNTP_INTERNAL,"shared memory is not supported",NULL);
+    return EMSNTP_INTERNAL;
+#else
+    void *map = MAP_FAILED;
+    int fd, ret;
+
+    pthread_mutex_lock(&segment_lock);
+    if (segment != NULL) {
+        pthread_mutex_unlock(&segment_lock);
+        fatal(EMSNTP_INTERNAL,"already publishing in shared memory",NULL);
+        return EMSNTP_INTERNAL;
+    }
+    errno = 0;
+    if ((fd = shm_open(name,O_RDWR|O_CREAT,0644)) < 0 ||
+            ftruncate(fd,sizeof(struct msntp_shm)) < 0 ||
+            (map = mmap(NULL,sizeof(struct msntp_shm),PROT_READ|PROT_WRITE,
+                MAP_SHARED,fd,0)) == MAP_FAILED) {
+        ret = errno;
+        pthread_mutex_unlock(&segment_lock);
+        fatal(ret,"unable to set up shared memory segment %s",name);
+        if (fd >= 0) close(fd);
+        return ret;
+    }
+    close(fd);
+    segment = map;
+
+/* A reader may be looking at an old segment, so it is marked invalid under the
+seqlock before anything else is changed. */
+
+    publish(0,0.0,0.0,0.0,0.0,0.0);
+    segment->magic = MSNTP_SHM_MAGIC;
+    segment->version = MSNTP_SHM_VERSION;
+    pthread_mutex_unlock(&segment_lock);
+    return 0;
+#endif
+}
+
+
+
+void shm_publish (int valid, double when, double offset, double error,
+    double drift, double drifterr) {
+
+/* Publish an estimate, made at when (in seconds since 1900, as the daemon keeps
+it), if there is a segment to publish it in.  A negative drift error means that
+the drift is not known yet, and goes in as 0. */
+
+#ifndef SHM_MISSING
+    pthread_mutex_lock(&segment_lock);
+    if (segment != NULL) publish(valid,when,offset,error,drift,drifterr);
+    pthread_mutex_unlock(&segment_lock);
+#endif
+}
+
+
+
+void shm_detach (void) {
+
+/* Mark the estimate invalid, so that readers stop trusting it, and unmap the
+segment.  It is left in place, so that readers need not attach again if the
+publisher is restarted. */
+
+#ifndef SHM_MISSING
+    pthread_mutex_lock(&segment_lock);
+    if (segment != NULL) {
+        publish(0,0.0,0.0,0.0,0.0,0.0);
+        munmap(segment,sizeof(struct msntp_shm));
+        segment = NULL;
+    }
+    pthread_mutex_unlock(&segment_lock);
+#endif
+}
@@ -8,6 +8,8 @@ the only system that the author uses that has it is Linux. */
 
 
 
+#define _GNU_SOURCE                    /* For recvmmsg and sendmmsg */
+
 #include "header.h"
 #include "internet.h"
 #include <fcntl.h>
@@ -17,14 +19,62 @@ the only system that the author uses that has it is Linux. */
 #include "kludges.h"
 #undef SOCKET
 
+#ifndef TIMESTAMPING_MISSING
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#endif
+
+/* defined in libmsntp.c */
+extern int libmsntp_port, libmsntp_reuseport, libmsntp_backend,
+    libmsntp_busy_poll;
+
+/* Busy-polling servers ask the kernel to poll the device queue for this long
+in each read, rather than wait for an interrupt.  The newer options are missing
+from older headers, but the numbers are fixed. */
+
+#define BUSY_POLL_USEC     50
+
+#ifndef BUSY_POLL_MISSING
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+#ifndef SO_BUSY_POLL_BUDGET
+#define SO_BUSY_POLL_BUDGET 70
+#endif
+#endif
+
 
 
 /* The code needs to set some variables during the open, for use by later
 functions. */
 
 static int initial = 1,
-    descriptors[MAX_SOCKETS];
-static struct sockaddr_in here[MAX_SOCKETS], there[MAX_SOCKETS];
+    descriptors[MAX_SOCKETS], here_size[MAX_SOCKETS], there_size[MAX_SOCKETS];
+static struct sockaddr_storage here[MAX_SOCKETS], there[MAX_SOCKETS],
+    senders[MAX_SOCKETS][BATCH_MAX];
+static ntp_stamp arrivals[MAX_SOCKETS][BATCH_MAX];
+
+/* Clients ask the kernel to timestamp their requests as they leave, and count
+them so that they can tell which timestamp is for which.  The last few are
+kept, since requests may be sent in bursts, before any replies. */
+
+#define DEPARTURES (2*COUNT_MAX)
+
+static int stamping[MAX_SOCKETS];
+static unsigned long requests[MAX_SOCKETS];
+static ntp_stamp sent_stamps[MAX_SOCKETS][DEPARTURES];
+
+
+
+/* Room for the control data that comes with each packet, which is at most a
+kernel timestamp, or a transmit timestamp and the error that carries it. */
+
+#define CONTROL_SIZE 128
+
+typedef union {
+    struct cmsghdr header;
+    char space[CONTROL_SIZE];
+} control_buffer;
 
 
 
@@ -37,16 +87,80 @@ void display_in_hex (const void *data, int length) {
 
 
 
+void display_address (const struct sockaddr_storage *address) {
+
+/* Show an address and port in hex, for either version of IP. */
+
+    const struct sockaddr_in *in4 = (const struct sockaddr_in *)address;
+    const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)address;
+
+    if (address->ss_family == AF_INET6) {
+        display_in_hex(&in6->sin6_addr,sizeof(in6->sin6_addr));
+        fputc('/',stderr);
+        display_in_hex(&in6->sin6_port,sizeof(in6->sin6_port));
+    } else {
+        display_in_hex(&in4->sin_addr,sizeof(in4->sin_addr));
+        fputc('/',stderr);
+        display_in_hex(&in4->sin_port,sizeof(in4->sin_port));
+    }
+}
+
+
+
+extern int address_size (const struct sockaddr_storage *address) {
+
+/* Return the length of an address, as the socket calls want it. */
+
+    return (address->ss_family == AF_INET6 ? sizeof(struct sockaddr_in6) :
+        sizeof(struct sockaddr_in));
+}
+
+
+
+extern uint64_t address_key (const struct sockaddr_storage *address) {
+
+/* Return a key for a client's address, for the rate limiter.  For IPv4 (and
+IPv4 mapped into IPv6 by a dual-stack socket), it is the address with bit 32
+set.  For IPv6, it is the /64 prefix, because that is what a single site or
+host is normally given.  Real prefixes never have the top 31 bits clear, but
+the ones that would clash with IPv4 keys get the top bit set. */
+
+    const struct in6_addr *in6;
+    const unsigned char *bytes;
+    uint64_t key;
+    uint32_t v4;
+    int k;
+
+    if (address->ss_family == AF_INET) {
+        v4 = ((const struct sockaddr_in *)address)->sin_addr.s_addr;
+        return (uint64_t)1 << 32|v4;
+    } else if (address->ss_family != AF_INET6)
+        return 0;
+    in6 = &((const struct sockaddr_in6 *)address)->sin6_addr;
+    bytes = in6->s6_addr;
+    if (IN6_IS_ADDR_V4MAPPED(in6)) {
+        memcpy(&v4,&bytes[12],sizeof(v4));
+        return (uint64_t)1 << 32|v4;
+    }
+    for (key = 0, k = 0; k < 8; ++k) key = key << 8|bytes[k];
+    if ((key >> 33) == 0) key |= (uint64_t)1 << 63;
+    return key;
+}
+
+
+
 int open_socket (int which, char *hostname, int timespan) {
 
-/* Locate the specified NTP server, set up a couple of addresses and open a
-socket. */
+/* Locate the specified NTP server, taking up to timespan milliseconds to look
+it up, set up a couple of addresses and open a socket.  Servers (and listening
+clients) use a single IPv6 socket that also accepts IPv4, as mapped addresses,
+unless the system has no IPv6, when they fall back to IPv4.  Clients use the
+family of the server's address. */
 
-    int port, k;
-    struct in_addr address, anywhere, everywhere;
+    int listening = (operation == op_listen || operation == op_server),
+        family, k, ret;
 
-/* Initialise and find out the server and port number.  Note that the port
-number is in network format. */
+/* Initialise and find out the server's address and port. */
 
     if (initial) for (k = 0; k < MAX_SOCKETS; ++k) descriptors[k] = -1;
     initial = 0;
@@ -55,65 +169,321 @@ number is in network format. */
         return EMSNTP_INTERNAL;
     }
     if (verbose > 2) fprintf(stderr,"Looking for the socket addresses\n");
-    find_address(&address,&anywhere,&everywhere,&port,hostname,timespan);
-    if (verbose > 2) {
-        fprintf(stderr,"Internet address: address=");
-        display_in_hex(&address,sizeof(struct in_addr));
-        fprintf(stderr," anywhere=");
-        display_in_hex(&anywhere,sizeof(struct in_addr));
-        fprintf(stderr," everywhere=");
-        display_in_hex(&everywhere,sizeof(struct in_addr));
-        fputc('\n',stderr);
+    if (listening || operation == op_broadcast) hostname = NULL;
+    if (ret = find_address(&there[which],&there_size[which],hostname,
+            libmsntp_port,timespan))
+        return ret;
+    family = (operation == op_broadcast ? AF_INET : there[which].ss_family);
+
+/* Allocate a local UDP socket, falling back to IPv4 if that is all there is
+(the wildcard address is the only one that could be IPv6 on such a system). */
+
+    errno = 0;
+    if ((descriptors[which] = socket(family,SOCK_DGRAM,0)) < 0 &&
+            family == AF_INET6 && hostname == NULL &&
+            (errno == EAFNOSUPPORT || errno == EPROTONOSUPPORT)) {
+        wildcard_address(&there[which],&there_size[which],family = AF_INET,
+            libmsntp_port,0);
+        errno = 0;
+        descriptors[which] = socket(family,SOCK_DGRAM,0);
+    }
+    if (descriptors[which] < 0) {
+        fatal(errno,"unable to allocate socket for NTP",NULL);
+        return errno;
     }
 
 /* Set up our own and the target addresses.  Note that the target address will
 be reset before use in server mode. */
 
-    memset(&here[which],0,sizeof(struct sockaddr_in));
-    here[which].sin_family = AF_INET;
-    here[which].sin_port =
-        (operation == op_listen || operation == op_server ? port : 0);
-    here[which].sin_addr = anywhere;
-    memset(&there[which],0,sizeof(struct sockaddr_in));
-    there[which].sin_family = AF_INET;
-    there[which].sin_port = port;
-    there[which].sin_addr = (operation == op_broadcast ? everywhere : address);
+    wildcard_address(&here[which],&here_size[which],family,
+        (listening ? libmsntp_port : 0),0);
+    if (operation == op_broadcast)
+        wildcard_address(&there[which],&there_size[which],AF_INET,
+            libmsntp_port,1);
     if (verbose > 2) {
         fprintf(stderr,"Initial sockets: here=");
-        display_in_hex(&here[which].sin_addr,sizeof(struct in_addr));
-        fputc('/',stderr);
-        display_in_hex(&here[which].sin_port,sizeof(here[which].sin_port));
+        display_address(&here[which]);
         fprintf(stderr," there=");
-        display_in_hex(&there[which].sin_addr,sizeof(struct in_addr));
-        fputc('/',stderr);
-        display_in_hex(&there[which].sin_port,sizeof(there[which].sin_port));
+        display_address(&there[which]);
         fputc('\n',stderr);
     }
 
-/* Allocate a local UDP socket and configure it. */
+/* Configure the socket.  The IPv6 wildcard takes IPv4 as well only if
+IPV6_V6ONLY is clear, which is the usual default, but that can be changed.
+Multi-threaded servers open one socket per thread on the same port, and let
+the kernel share out the requests between them. */
 
+#ifdef IPV6_V6ONLY
+    if (family == AF_INET6 && listening) {
+        k = 0;
+        errno = 0;
+        if (setsockopt(descriptors[which],IPPROTO_IPV6,IPV6_V6ONLY,
+                (void *)&k,sizeof(k)) != 0 && verbose)
+            fprintf(stderr,"%s: unable to accept IPv4 on IPv6 socket (%s)\n",
+                argv0,strerror(errno));
+    }
+#endif
+    if (operation == op_server && libmsntp_reuseport) {
+#ifdef SO_REUSEPORT
+        k = 1;
+        errno = 0;
+        if (setsockopt(descriptors[which],SOL_SOCKET,SO_REUSEPORT,
+                (void *)&k,sizeof(k)) != 0) {
+            fatal(errno,"unable to share NTP port between sockets",NULL);
+            return errno;
+        }
+#else
+        fatal(EMSNTP_INTERNAL,"SO_REUSEPORT is not supported",NULL);
+        return EMSNTP_INTERNAL;
+#endif
+    }
     errno = 0;
-    if ((descriptors[which] = socket(AF_INET,SOCK_DGRAM,0)) < 0 ||
-            bind(descriptors[which],(struct sockaddr *)&here[which],
-                    sizeof(here[which]))  < 0) {
+    if (bind(descriptors[which],(struct sockaddr *)&here[which],
+            here_size[which]) < 0) {
         fatal(errno,"unable to allocate socket for NTP",NULL);
         return errno;
     }
+
+/* Servers may ask for io_uring, but quietly use the ordinary code if it isn't
+available for whatever reason (old kernel, seccomp, locked memory limits).  It
+is not used for busy polling, which spins on the socket itself. */
+
+    if (operation == op_server && libmsntp_backend == MSNTP_BACKEND_IO_URING &&
+            libmsntp_busy_poll == 0 &&
+            (k = uring_open(which,descriptors[which])) != 0 && verbose)
+        fprintf(stderr,"%s: io_uring unavailable (%s), using sockets\n",
+            argv0,(k > 0 ? strerror(k) : "unsupported"));
     if (operation == op_broadcast) {
+        k = 1;
         errno = 0;
-        k = setsockopt(descriptors[which],SOL_SOCKET,SO_BROADCAST,
-                (void *)&k,sizeof(k));
-        if (k != 0) {
+        if (setsockopt(descriptors[which],SOL_SOCKET,SO_BROADCAST,
+                (void *)&k,sizeof(k)) != 0) {
             fatal(errno,"unable to set permission to broadcast",NULL);
             return errno;
         }
     }
 
+
+/* Servers ask the kernel to timestamp requests as they arrive, so that the
+replies do not include the time spent queued.  It does not matter much if the
+kernel cannot do it, because the code then reads the clock itself as before. */
+
+#ifdef SO_TIMESTAMPNS
+    if (operation == op_server) {
+        k = 1;
+        if (setsockopt(descriptors[which],SOL_SOCKET,SO_TIMESTAMPNS,
+                (void *)&k,sizeof(k)) != 0 && verbose)
+            fprintf(stderr,"%s: kernel timestamps unavailable (%s)\n",
+                argv0,strerror(errno));
+    }
+#endif
+
+/* Busy-polling servers also want the kernel to spin in the driver on their
+behalf, and to prefer that to interrupts while the server keeps reading.  These
+need privileges or recent kernels, and the server only loses a little latency
+without them. */
+
+#ifndef BUSY_POLL_MISSING
+    if (operation == op_server && libmsntp_busy_poll != 0) {
+        k = BUSY_POLL_USEC;
+        if (setsockopt(descriptors[which],SOL_SOCKET,SO_BUSY_POLL,
+                (void *)&k,sizeof(k)) != 0 && verbose)
+            fprintf(stderr,"%s: busy polling unavailable (%s)\n",
+                argv0,strerror(errno));
+        k = 1;
+        setsockopt(descriptors[which],SOL_SOCKET,SO_PREFER_BUSY_POLL,
+            (void *)&k,sizeof(k));
+        k = BATCH_MAX;
+        setsockopt(descriptors[which],SOL_SOCKET,SO_BUSY_POLL_BUDGET,
+            (void *)&k,sizeof(k));
+    }
+#endif
+
+/* Clients want both ends of the exchange. */
+
+    stamping[which] = (operation == op_client &&
+        client_stamping(descriptors[which]));
+    requests[which] = 0;
+    memset(sent_stamps[which],0,sizeof(sent_stamps[which]));
+
     return 0;
 }
 
 
 
+extern ntp_stamp arrival_stamp (struct msghdr *message) {
+
+/* Return the kernel's time of arrival from the control data of a received
+packet, or 0 if there is none.  Servers get it from SO_TIMESTAMPNS and clients
+from SO_TIMESTAMPING, where the software timestamp is the first of three.  This
+also reads the transmit timestamps from the error queue, which come the same
+way. */
+
+    struct cmsghdr *control;
+    struct timespec stamp[3];
+
+    if (message->msg_controllen == 0 || (message->msg_flags & MSG_CTRUNC))
+        return 0;
+    for (control = CMSG_FIRSTHDR(message); control != NULL;
+            control = CMSG_NXTHDR(message,control)) {
+        if (control->cmsg_level != SOL_SOCKET) continue;
+#ifdef SO_TIMESTAMPNS
+        if (control->cmsg_type == SCM_TIMESTAMPNS) {
+            memcpy(&stamp[0],CMSG_DATA(control),sizeof(stamp[0]));
+            return convert_timespec(&stamp[0]);
+        }
+#endif
+#ifndef TIMESTAMPING_MISSING
+        if (control->cmsg_type == SCM_TIMESTAMPING) {
+            memcpy(stamp,CMSG_DATA(control),sizeof(stamp));
+            if (stamp[0].tv_sec != 0 || stamp[0].tv_nsec != 0)
+                return convert_timespec(&stamp[0]);
+        }
+#endif
+    }
+    return 0;
+}
+
+
+
+extern int client_stamping (int descriptor) {
+
+/* Ask the kernel to timestamp a client socket's packets, returning 1 if it
+will.  The transmit timestamps come back on the error queue, numbered, and
+without a copy of the packet. */
+
+#ifndef TIMESTAMPING_MISSING
+    int k = SOF_TIMESTAMPING_TX_SOFTWARE|SOF_TIMESTAMPING_RX_SOFTWARE|
+        SOF_TIMESTAMPING_SOFTWARE|SOF_TIMESTAMPING_OPT_ID|
+        SOF_TIMESTAMPING_OPT_TSONLY;
+
+    if (setsockopt(descriptor,SOL_SOCKET,SO_TIMESTAMPING,(void *)&k,
+            sizeof(k)) == 0)
+        return 1;
+    if (verbose)
+        fprintf(stderr,"%s: kernel timestamps unavailable (%s)\n",
+            argv0,strerror(errno));
+#endif
+    return 0;
+}
+
+
+
+extern void collect_departures (int descriptor, unsigned long first,
+    unsigned long last, ntp_stamp *departures, int size) {
+
+/* Empty the error queue of a client socket, keeping the transmit timestamps of
+requests first to last-1 (counting from 0) that are there, indexed by request
+number modulo size.  Anything else there is stale or not for us. */
+
+#ifndef TIMESTAMPING_MISSING
+    struct msghdr message;
+    control_buffer control;
+    struct cmsghdr *header;
+    struct sock_extended_err error;
+    ntp_stamp stamp;
+    unsigned long request;
+    int found;
+
+    while (1) {
+        memset(&message,0,sizeof(message));
+        message.msg_control = &control;
+        message.msg_controllen = sizeof(control);
+        if (recvmsg(descriptor,&message,MSG_ERRQUEUE|MSG_DONTWAIT) < 0)
+            break;
+        found = 0;
+        for (header = CMSG_FIRSTHDR(&message); header != NULL;
+                header = CMSG_NXTHDR(&message,header))
+            if ((header->cmsg_level == SOL_IP &&
+                    header->cmsg_type == IP_RECVERR) ||
+                    (header->cmsg_level == SOL_IPV6 &&
+                    header->cmsg_type == IPV6_RECVERR)) {
+                memcpy(&error,CMSG_DATA(header),sizeof(error));
+                request = error.ee_data;
+                found = (error.ee_origin == SO_EE_ORIGIN_TIMESTAMPING &&
+                    request-first < last-first);
+            }
+        if (found && (stamp = arrival_stamp(&message)) != 0)
+            departures[request%size] = stamp;
+    }
+    errno = 0;
+#endif
+}
+
+
+
+static void collect_socket (int which) {
+    collect_departures(descriptors[which],
+        (requests[which] > DEPARTURES ? requests[which]-DEPARTURES : 0),
+        requests[which],sent_stamps[which],DEPARTURES);
+}
+
+
+
+extern ntp_stamp socket_departure (int which) {
+
+/* Return when the kernel sent the last packet written to client socket which,
+or 0 if it is not known. */
+
+    if (which < 0 || which >= MAX_SOCKETS || descriptors[which] < 0 ||
+            ! stamping[which] || requests[which] == 0)
+        return 0;
+    collect_socket(which);
+    return sent_stamps[which][(requests[which]-1)%DEPARTURES];
+}
+
+
+
+extern void socket_departures (int which, ntp_stamp *stamps, int number) {
+
+/* Fill in when the kernel sent each of the last number packets written to
+client socket which, oldest first, where stamps does not already say and the
+kernel does. */
+
+    unsigned long request;
+    int k;
+
+    if (which < 0 || which >= MAX_SOCKETS || descriptors[which] < 0 ||
+            ! stamping[which])
+        return;
+    collect_socket(which);
+    for (k = 0; k < number; ++k)
+        if (stamps[k] == 0 && number-k <= requests[which] &&
+                number-k <= DEPARTURES) {
+            request = requests[which]-(number-k);
+            stamps[k] = sent_stamps[which][request%DEPARTURES];
+        }
+}
+
+
+
+extern ntp_stamp socket_arrival (int which, int slot) {
+
+/* Return the kernel's time of arrival of the packet in slot of the last read
+from socket which (slot 0 for read_socket()), or 0 if it is not known. */
+
+    if (which < 0 || which >= MAX_SOCKETS || slot < 0 || slot >= BATCH_MAX)
+        return 0;
+    if (uring_active(which)) return uring_arrival(which,slot);
+    return arrivals[which][slot];
+}
+
+
+
+extern uint64_t socket_peer (int which, int slot) {
+
+/* Return a key for the sender of the packet in slot of the last read from
+server socket which, for the rate limiter, or 0 if there is none.  See
+address_key(). */
+
+    if (which < 0 || which >= MAX_SOCKETS || slot < 0 || slot >= BATCH_MAX)
+        return 0;
+    if (uring_active(which)) return uring_peer(which,slot);
+    return address_key(&senders[which][slot]);
+}
+
+
+
 extern int write_socket (int which, void *packet, int length) {
 
 /* Any errors in doing this are fatal - including blocking.  Yes, this leaves a
@@ -125,13 +495,20 @@ server vulnerable to a denial of service attack. */
         fatal(EMSNTP_INTERNAL,"socket index out of range or not open",NULL);
         return EMSNTP_INTERNAL;
     }
+    if (uring_active(which)) {
+        k = 0;
+        return uring_write_batch(which,packet,length,&k,1);
+    }
     errno = 0;
     k = sendto(descriptors[which],packet,(size_t)length,0,
-            (struct sockaddr *)&there[which],sizeof(there[which]));
+            (struct sockaddr *)&there[which],address_size(&there[which]));
     if (k != length) {
         fatal(errno,"unable to send NTP packet",NULL);
         return errno;
     }
+    if (stamping[which]) {
+        sent_stamps[which][requests[which]++%DEPARTURES] = 0;
+    }
 
     return 0;
 }
@@ -143,11 +520,14 @@ extern int read_socket (int which, void *packet, int length, int waiting,
 
 /* Read a packet and returns (in a parameter) the number of bytes written. Only
 incorrect length and timeout are not fatal. Note that in msntp, this used
-SIGALRM to handle timeouts, but in libmsntp, it uses select(). Also, a timeout
-is only set in client mode; in server mode, read_socket is non-blocking. */
-
-    struct sockaddr_in scratch, *ptr;
-    int n;
+SIGALRM to handle timeouts, but in libmsntp, it uses select(), waiting up to
+waiting milliseconds. Also, a timeout is only set in client mode; in server
+mode, read_socket is non-blocking. */
+
+    struct sockaddr_storage scratch, *ptr;
+    struct msghdr message;
+    struct iovec vector;
+    control_buffer control;
     int k;
     int ret;
     struct timeval timeout = { 0, 0 };
@@ -155,7 +535,8 @@ is only set in client mode; in server mode, read_socket is non-blocking. */
 
     *written = 0;
     if (operation == op_client) {
-      timeout.tv_sec = waiting;
+      timeout.tv_sec = waiting/1000;
+      timeout.tv_usec = 1000l*(waiting%1000);
     }
 
 /* Under normal circumstances, select on the socket for the given timeout. */
@@ -164,37 +545,58 @@ is only set in client mode; in server mode, read_socket is non-blocking. */
         fatal(EMSNTP_INTERNAL,"socket index out of range or not open",NULL);
         return EMSNTP_INTERNAL;
     }
+    if (uring_active(which))
+        return uring_read_batch(which,packet,length,written,1,
+            1000*(int)timeout.tv_sec,&k);
 
-    FD_ZERO(&fd);
-    FD_SET(descriptors[which], &fd);
+/* Transmit timestamps on the error queue also make the socket readable, so
+clients that ask for them collect them and wait again for the rest of the time,
+which select() leaves in timeout on Linux. */
 
-    ret = select(descriptors[which] + 1, &fd, NULL, NULL, &timeout);
-
-    if (ret == 0) {
-        if (verbose > 2)
-          fprintf(stderr,"Receive timed out\n");
-        else if (verbose > 1)
-          fprintf(stderr,"%s: receive timed out after %d seconds\n",
-                  argv0,waiting);
-        errno = 0;
-        return -1;
-    } else if (ret < 0) {
-        if (verbose > 1)
-          fprintf(stderr,"select returned error: %s", strerror(errno));
-        return -1;
-    }
+    while (1) {
+        FD_ZERO(&fd);
+        FD_SET(descriptors[which], &fd);
+
+        ret = select(descriptors[which] + 1, &fd, NULL, NULL, &timeout);
+
+        if (ret == 0) {
+            if (verbose > 2)
+              fprintf(stderr,"Receive timed out\n");
+            else if (verbose > 1)
+              fprintf(stderr,"%s: receive timed out after %d ms\n",
+                      argv0,waiting);
+            errno = 0;
+            return -1;
+        } else if (ret < 0) {
+            if (verbose > 1)
+              fprintf(stderr,"select returned error: %s", strerror(errno));
+            return -1;
+        }
 
 /* select returned 1, so we have a packet waiting. get the packet and clear the
    timeout, if any.  */
 
-    if (operation == op_server)
-        memcpy(ptr = &there[which],&here[which],sizeof(struct sockaddr_in));
-    else
-        memcpy(ptr = &scratch,&there[which],sizeof(struct sockaddr_in));
-    n = sizeof(struct sockaddr_in);
-    errno = 0;
-    k = recvfrom(descriptors[which],packet,(size_t)length,0,
-        (struct sockaddr *)ptr,&n);
+        if (operation == op_server)
+            memcpy(ptr = &there[which],&here[which],sizeof(here[which]));
+        else
+            memcpy(ptr = &scratch,&there[which],sizeof(there[which]));
+        memset(&message,0,sizeof(message));
+        vector.iov_base = packet;
+        vector.iov_len = (size_t)length;
+        message.msg_name = ptr;
+        message.msg_namelen = sizeof(*ptr);
+        message.msg_iov = &vector;
+        message.msg_iovlen = 1;
+        message.msg_control = &control;
+        message.msg_controllen = sizeof(control);
+        errno = 0;
+        k = recvmsg(descriptors[which],&message,
+            (stamping[which] ? MSG_DONTWAIT : 0));
+        if (k >= 0 || ! stamping[which] ||
+                (errno != EAGAIN && errno != EWOULDBLOCK))
+            break;
+        collect_socket(which);
+    }
 
 /* Now issue some low-level diagnostics. */
 
@@ -204,25 +606,199 @@ is only set in client mode; in server mode, read_socket is non-blocking. */
     }
     if (verbose > 2) {
         fprintf(stderr,"Packet of length %d received from ",k);
-        display_in_hex(&ptr->sin_addr,sizeof(struct in_addr));
-        fputc('/',stderr);
-        display_in_hex(&ptr->sin_port,sizeof(ptr->sin_port));
+        display_address(ptr);
         fputc('\n',stderr);
     }
 
+    arrivals[which][0] = arrival_stamp(&message);
+    if (operation == op_server)
+        memcpy(&senders[which][0],ptr,sizeof(*ptr));
     *written = k;
     return 0;
 }
 
 
 
+extern int read_socket_batch (int which, void *packets, int length,
+                              int *lengths, int max, int waiting,
+                              int *received) {
+
+/* Read up to max packets, each into a slot of the given length, and return
+(in a parameter) the number of slots used.  The sender of each slot is kept
+for write_socket_batch() and socket_peer(), and its time of arrival for
+socket_arrival().  This waits up to waiting milliseconds for the first packet
+and then takes only what is already queued, so that a server can answer a burst
+of requests with one system call each way.  If waiting is negative, it does not
+wait at all, for callers that already know the socket is readable.  As with
+read_socket(), only a timeout (or nothing queued) is not fatal. */
+
+    struct timeval timeout;
+    fd_set fd;
+    int k, ret;
+#ifdef MMSG_MISSING
+    int n;
+#else
+    struct mmsghdr headers[BATCH_MAX];
+    struct iovec vectors[BATCH_MAX];
+    control_buffer controls[BATCH_MAX];
+#endif
+
+    *received = 0;
+    if (which < 0 || which >= MAX_SOCKETS || descriptors[which] < 0) {
+        fatal(EMSNTP_INTERNAL,"socket index out of range or not open",NULL);
+        return EMSNTP_INTERNAL;
+    }
+    if (uring_active(which))
+        return uring_read_batch(which,packets,length,lengths,max,waiting,
+            received);
+    if (max < 1 || max > BATCH_MAX) max = BATCH_MAX;
+
+    if (waiting >= 0) {
+        timeout.tv_sec = waiting/1000;
+        timeout.tv_usec = 1000l*(waiting%1000);
+        FD_ZERO(&fd);
+        FD_SET(descriptors[which], &fd);
+        ret = select(descriptors[which] + 1, &fd, NULL, NULL, &timeout);
+        if (ret == 0) {
+            if (verbose > 2) fprintf(stderr,"Receive timed out\n");
+            errno = 0;
+            return -1;
+        } else if (ret < 0) {
+            if (verbose > 1)
+              fprintf(stderr,"select returned error: %s", strerror(errno));
+            return -1;
+        }
+    }
+
+/* The first packet is waiting, so nothing here should block. */
+
+#ifdef MMSG_MISSING
+    for (k = 0; k < max; ++k) {
+        n = sizeof(struct sockaddr_storage);
+        errno = 0;
+        ret = recvfrom(descriptors[which],(char *)packets+k*length,
+            (size_t)length,MSG_DONTWAIT,(struct sockaddr *)&senders[which][k],
+            &n);
+        if (ret < 0) break;
+        lengths[k] = ret;
+        arrivals[which][k] = 0;
+    }
+#else
+    memset(headers,0,max*sizeof(struct mmsghdr));
+    for (k = 0; k < max; ++k) {
+        vectors[k].iov_base = (char *)packets+k*length;
+        vectors[k].iov_len = (size_t)length;
+        headers[k].msg_hdr.msg_name = &senders[which][k];
+        headers[k].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+        headers[k].msg_hdr.msg_iov = &vectors[k];
+        headers[k].msg_hdr.msg_iovlen = 1;
+        headers[k].msg_hdr.msg_control = &controls[k];
+        headers[k].msg_hdr.msg_controllen = sizeof(control_buffer);
+    }
+    errno = 0;
+    k = recvmmsg(descriptors[which],headers,(unsigned int)max,MSG_DONTWAIT,
+        NULL);
+    for (ret = 0; ret < k; ++ret) {
+        lengths[ret] = headers[ret].msg_len;
+        arrivals[which][ret] = arrival_stamp(&headers[ret].msg_hdr);
+    }
+#endif
+    if (k <= 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            errno = 0;
+            return -1;
+        }
+        fatal(errno,"unable to receive NTP packets from clients",NULL);
+        return errno;
+    }
+    if (verbose > 2) fprintf(stderr,"Batch of %d packets received\n",k);
+
+    *received = k;
+    return 0;
+}
+
+
+
+extern int write_socket_batch (int which, void *packets, int length,
+                               int *slots, int number) {
+
+/* Send number packets of the given length, the k'th one to the sender of slot
+slots[k] of the last read_socket_batch().  As with write_socket(), any errors
+are fatal, but a partial send is retried from where it stopped. */
+
+    int k, done;
+#ifndef MMSG_MISSING
+    struct mmsghdr headers[BATCH_MAX];
+    struct iovec vectors[BATCH_MAX];
+#endif
+
+    if (which < 0 || which >= MAX_SOCKETS || descriptors[which] < 0 ||
+            number < 0 || number > BATCH_MAX) {
+        fatal(EMSNTP_INTERNAL,"socket index out of range or not open",NULL);
+        return EMSNTP_INTERNAL;
+    }
+    if (uring_active(which))
+        return uring_write_batch(which,packets,length,slots,number);
+
+#ifdef MMSG_MISSING
+    for (k = 0; k < number; ++k) {
+        errno = 0;
+        done = sendto(descriptors[which],(char *)packets+k*length,
+            (size_t)length,0,(struct sockaddr *)&senders[which][slots[k]],
+            address_size(&senders[which][slots[k]]));
+        if (done != length) {
+            fatal(errno,"unable to send NTP packet",NULL);
+            return errno;
+        }
+    }
+#else
+    memset(headers,0,number*sizeof(struct mmsghdr));
+    for (k = 0; k < number; ++k) {
+        vectors[k].iov_base = (char *)packets+k*length;
+        vectors[k].iov_len = (size_t)length;
+        headers[k].msg_hdr.msg_name = &senders[which][slots[k]];
+        headers[k].msg_hdr.msg_namelen =
+            address_size(&senders[which][slots[k]]);
+        headers[k].msg_hdr.msg_iov = &vectors[k];
+        headers[k].msg_hdr.msg_iovlen = 1;
+    }
+    for (k = 0; k < number; k += done) {
+        errno = 0;
+        done = sendmmsg(descriptors[which],&headers[k],
+            (unsigned int)(number-k),0);
+        if (done <= 0) {
+            fatal(errno,"unable to send NTP packets",NULL);
+            return errno;
+        }
+    }
+#endif
+    if (verbose > 2) fprintf(stderr,"Batch of %d packets sent\n",number);
+
+    return 0;
+}
+
+
+
+extern int socket_descriptor (int which) {
+
+/* Return the descriptor to wait on for packets on an open socket, for callers
+that want to wait themselves, or -1 if it is not open.  With io_uring, that is
+the ring, because the kernel reads the socket itself. */
+
+    if (which < 0 || which >= MAX_SOCKETS || initial) return -1;
+    if (uring_active(which)) return uring_descriptor(which);
+    return descriptors[which];
+}
+
+
+
 extern int flush_socket (int which, int *count) {
 
 /* Get rid of any outstanding input, because it may have been hanging around
 for a while.  Ignore packet length oddities and return the number of packets
 skipped. */
 
-    struct sockaddr_in scratch;
+    struct sockaddr_storage scratch;
     int n;
     char buffer[256];
     int flags, total = 0, k;
@@ -243,7 +819,7 @@ skipped. */
         return errno;
     }
     while (1) {
-        n = sizeof(struct sockaddr_in);
+        n = sizeof(struct sockaddr_storage);
         errno = 0;
         k = recvfrom(descriptors[which],buffer,256,0,
             (struct sockaddr *)&scratch,&n);
@@ -278,6 +854,8 @@ been opened, so ignore that case. */
         return EMSNTP_INTERNAL;
     }
     if (descriptors[which] < 0) return;
+    uring_close(which);
+    limit_close(which);
     errno = 0;
     if (close(descriptors[which])) {
         fatal(errno,"unable to close NTP socket",NULL);
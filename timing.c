@@ -11,6 +11,8 @@ more than is defined by POSIX, unfortunately.  Systems that do not have the
 
 #include <sys/types.h>
 #include <sys/time.h>
+#include <limits.h>
+#include <math.h>
 
 #define TIMING
 #include "kludges.h"
@@ -20,6 +22,35 @@ more than is defined by POSIX, unfortunately.  Systems that do not have the
 
 #define MILLION_L    1000000l          /* For conversion to/from timeval */
 #define MILLION_D       1.0e6          /* Must be equal to MILLION_L */
+#define BILLION_L    1000000000l       /* For conversion to/from timespec */
+#define JAN_1970_L  2208988800ul       /* 1970 - 1900 in seconds */
+
+
+
+void read_clock (struct timespec *current) {
+
+/* Get the current UTC time since the Epoch to the nearest nanosecond, if the
+system can.  clock_gettime() is usually handled in user space (by the vDSO on
+Linux), so this is no slower than gettimeofday(). */
+
+#ifdef CLOCK_REALTIME
+    errno = 0;
+    if (clock_gettime(CLOCK_REALTIME,current)) {
+        fatal(errno,"unable to read current machine/system time",NULL);
+        exit(errno);
+    }
+#else
+    struct timeval now;
+
+    errno = 0;
+    if (gettimeofday(&now,NULL)) {
+        fatal(errno,"unable to read current machine/system time",NULL);
+        exit(errno);
+    }
+    current->tv_sec = now.tv_sec;
+    current->tv_nsec = 1000l*now.tv_usec;
+#endif
+}
 
 
 
@@ -28,14 +59,104 @@ double current_time (double offset) {
 /* Get the current UTC time in seconds since the Epoch plus an offset (usually
 the time from the beginning of the century to the Epoch!) */
 
-    struct timeval current;
+    struct timespec current;
+
+    read_clock(&current);
+    return offset+current.tv_sec+1.0e-9*current.tv_nsec;
+}
+
+
+
+ntp_stamp current_stamp (void) {
+
+/* Get the current UTC time as an NTP timestamp, without going through floating
+point. */
+
+    struct timespec current;
+
+    read_clock(&current);
+    return convert_timespec(&current);
+}
+
+
+
+int64_t current_nanos (void) {
+
+/* Get the current UTC time in nanoseconds since the Epoch, which is good for
+a few hundred years either way. */
+
+    struct timespec current;
+
+    read_clock(&current);
+    return (int64_t)current.tv_sec*BILLION_L+current.tv_nsec;
+}
+
+
+
+int64_t monotonic_nanos (void) {
+
+/* Get a time in nanoseconds that only ever goes forwards, for measuring
+intervals and deadlines that should not be upset by the clock being set. */
+
+#ifdef CLOCK_MONOTONIC
+    struct timespec current;
 
     errno = 0;
-    if (gettimeofday(&current,NULL)) {
-        fatal(errno,"unable to read current machine/system time",NULL);
-        exit(errno);
+    if (clock_gettime(CLOCK_MONOTONIC,&current) == 0)
+        return (int64_t)current.tv_sec*BILLION_L+current.tv_nsec;
+#endif
+    return current_nanos();
+}
+
+
+
+int millis_left (int64_t deadline) {
+
+/* Return the whole milliseconds from now until a monotonic deadline, rounded
+up so that a wait for them does not end early, or 0 if it has passed. */
+
+    int64_t left = deadline-monotonic_nanos();
+
+    if (left <= 0) return 0;
+    if (left >= (int64_t)INT_MAX*1000000) return INT_MAX;
+    return (int)((left+999999)/1000000);
+}
+
+
+
+int64_t convert_nanos (double value) {
+
+/* Convert a time or difference in seconds to the nearest nanosecond. */
+
+    return (int64_t)floor(1.0e9*value+0.5);
+}
+
+
+
+void split_nanos (int64_t value, struct timespec *result) {
+
+/* Convert nanoseconds to a timespec, normalised so that tv_nsec is between 0
+and 999999999 even when the value is negative. */
+
+    int64_t seconds = value/BILLION_L, nanos = value%BILLION_L;
+
+    if (nanos < 0) {
+        nanos += BILLION_L;
+        --seconds;
     }
-    return offset+current.tv_sec+1.0e-6*current.tv_usec;
+    result->tv_sec = (time_t)seconds;
+    result->tv_nsec = (long)nanos;
+}
+
+
+
+ntp_stamp convert_timespec (const struct timespec *value) {
+
+/* Convert a UTC time since the Epoch, such as a kernel timestamp, to an NTP
+timestamp.  The fraction is scaled from nanoseconds exactly, rounding down. */
+
+    return ((ntp_stamp)(value->tv_sec+JAN_1970_L)<<32)|
+        (((ntp_stamp)value->tv_nsec<<32)/BILLION_L);
 }
 
 
@@ -117,4 +238,18 @@ negative, unsigned values. */
                     argv0,text);
         }
     }
+    return 0;
+}
+
+
+
+double slew_left (void) {
+
+/* Return how much of the adjustment started by adjust_time() the system still
+has to make, in seconds, or 0 if it won't say. */
+
+    struct timeval left;
+
+    if (adjtime(NULL,&left)) return 0.0;
+    return left.tv_sec+left.tv_usec/MILLION_D;
 }
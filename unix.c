@@ -11,6 +11,8 @@ the get_lock() and log_message() functions. */
 
 #include <sys/types.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <syslog.h>
 
 #define UNIX
@@ -19,12 +21,80 @@ the get_lock() and log_message() functions. */
 
 
 
-void do_nothing (int seconds) {
+static int wake_descriptors[2] = {-1, -1};  /* See set_waking() */
+
+
+
+int set_waking (int enable) {
+
+/* Make do_nothing() interruptible by wake_up(), for a daemon running in a
+thread of another program, or stop doing so.  The two ends of a pipe are used,
+because poll() can wait on it with a timeout. */
+
+    if (! enable) {
+        if (wake_descriptors[0] >= 0) {
+            close(wake_descriptors[0]);
+            close(wake_descriptors[1]);
+        }
+        wake_descriptors[0] = wake_descriptors[1] = -1;
+        return 0;
+    }
+    if (wake_descriptors[0] >= 0) return 0;
+    errno = 0;
+    if (pipe(wake_descriptors) < 0 ||
+            fcntl(wake_descriptors[1],F_SETFL,O_NONBLOCK) < 0) {
+        fatal(errno,"unable to create daemon wake-up pipe",NULL);
+        set_waking(0);
+        return errno;
+    }
+    return 0;
+}
+
+
+
+void wake_up (void) {
+
+/* Make the current wait in do_nothing() return early, along with any after
+it.  This may be called from any thread. */
+
+    if (wake_descriptors[1] >= 0)
+        while (write(wake_descriptors[1],"",1) < 0 && errno == EINTR) ;
+}
+
+
+
+int can_wake (void) {
+
+/* Return whether waits can be interrupted by wake_up(), so that anything that
+waits for long in some other way should do so in short slices. */
+
+    return wake_descriptors[0] >= 0;
+}
+
+
+
+int do_nothing (int seconds) {
 
 /* Wait for a fixed period, possibly uninterruptibly.  This should not wait
-for less than the specified period, if that can be avoided. */
+for less than the specified period, if that can be avoided.  If it can be
+interrupted, it returns 1 as soon as wake_up() has been called, and a period of
+0 just checks for that; otherwise it returns 0. */
+
+    struct pollfd wake;
+    int64_t deadline;
 
-    sleep((unsigned int)(seconds+2));          /* +2 is enough for POSIX */
+    if (wake_descriptors[0] < 0) {
+        if (seconds > 0)
+            sleep((unsigned int)(seconds+2));  /* +2 is enough for POSIX */
+        return 0;
+    }
+    deadline = monotonic_nanos()+(int64_t)seconds*1000000000;
+    wake.fd = wake_descriptors[0];
+    wake.events = POLLIN;
+    do
+        if (poll(&wake,1,millis_left(deadline)) > 0) return 1;
+    while (monotonic_nanos() < deadline);
+    return 0;
 }
 
 
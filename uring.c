@@ -0,0 +1,578 @@
+/**
+ * libmsntp
+ * http://snarfed.org/libmsntp
+ *
+ * Copyright 2005, Ryan Barrett <libmsntp@ryanb.org>
+ *
+ * This includes all of the code needed to serve SNTP requests through Linux's
+ * io_uring interface, as an alternative to the recvmmsg/sendmmsg code in
+ * socket.c. It talks to the kernel directly rather than through liburing, so
+ * that there are no extra dependencies.
+ *
+ * Each server socket gets its own ring. A single multishot recvmsg request
+ * stays armed on the socket, and the kernel fills buffers from a registered
+ * buffer ring as packets arrive, so reading a batch of requests is usually
+ * just a matter of looking at the completion queue. Replies are copied into
+ * slots owned by the ring and queued as sendmsg requests, which are submitted
+ * together once the batch has been queued. In the steady state, that is one
+ * system call per batch, not per packet.
+ *
+ * The functions here are called only from socket.c. If the ring can't be set
+ * up, for any reason, uring_open fails and socket.c carries on without it.
+ * Kernels from 5.19 to 6.0 register the buffer ring but refuse multishot
+ * recvmsg, so that is checked when the ring is armed and again on its first
+ * completion, and a refusal drops the ring in the same way.
+ */
+
+#include "header.h"
+#include "internet.h"
+
+#define URING
+#include "kludges.h"
+#undef URING
+
+#ifndef URING_MISSING
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+
+#define URING_ENTRIES     256  /* submission queue size */
+#define URING_BUFFERS     256  /* receive buffers; a power of two */
+#define URING_BUFFER_SIZE 256  /* header, address, control and packet */
+#define URING_SENDS       (4*BATCH_MAX)  /* replies that may be in flight */
+#define URING_SEND_SIZE   128  /* largest reply */
+#define URING_GROUP       0    /* buffer group id */
+#define URING_CONTROL_SIZE CMSG_SPACE(sizeof(struct timespec))  /* timestamp */
+
+#define URING_RECV_TAG    ((__u64)-1)  /* user_data of the recvmsg request */
+
+struct uring_send {
+    struct msghdr message;
+    struct iovec vector;
+    struct sockaddr_storage to;
+    unsigned char packet[URING_SEND_SIZE];
+};
+
+struct uring {
+    int descriptor, socket, armed, pending, failure, received, refused;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_size, cq_size, sqes_size;
+    struct io_uring_buf_ring *buffers;
+    unsigned char *memory;
+    size_t buffers_size;
+    struct msghdr receive;
+    struct sockaddr_storage from[BATCH_MAX];
+    ntp_stamp arrivals[BATCH_MAX];
+    struct uring_send sends[URING_SENDS];
+    int free_sends[URING_SENDS], nfree;
+};
+
+static struct uring *rings[MAX_SOCKETS];
+
+
+
+static int uring_setup (unsigned entries, struct io_uring_params *params) {
+    return (int)syscall(__NR_io_uring_setup,entries,params);
+}
+
+static int uring_enter (int descriptor, unsigned submit, unsigned complete,
+        unsigned flags, void *arg, size_t size) {
+    return (int)syscall(__NR_io_uring_enter,descriptor,submit,complete,flags,
+        arg,size);
+}
+
+static int uring_register (int descriptor, unsigned opcode, void *arg,
+        unsigned number) {
+    return (int)syscall(__NR_io_uring_register,descriptor,opcode,arg,number);
+}
+
+
+
+static void uring_free (struct uring *ring) {
+
+/* Release everything that uring_open() allocated, in any state. */
+
+    struct io_uring_buf_reg reg;
+
+    if (ring->buffers != NULL) {
+        memset(&reg,0,sizeof(reg));
+        reg.bgid = URING_GROUP;
+        uring_register(ring->descriptor,IORING_UNREGISTER_PBUF_RING,&reg,1);
+        munmap(ring->buffers,ring->buffers_size);
+    }
+    if (ring->sqes != NULL) munmap(ring->sqes,ring->sqes_size);
+    if (ring->cq_ring != NULL && ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring,ring->cq_size);
+    if (ring->sq_ring != NULL) munmap(ring->sq_ring,ring->sq_size);
+    if (ring->descriptor >= 0) close(ring->descriptor);
+    free(ring);
+}
+
+
+
+static void uring_recycle (struct uring *ring, int id) {
+
+/* Hand receive buffer id back to the kernel. */
+
+    struct io_uring_buf *buf;
+    unsigned short tail = ring->buffers->tail;
+
+    buf = &ring->buffers->bufs[tail&(URING_BUFFERS-1)];
+    buf->addr = (unsigned long)(ring->memory+id*URING_BUFFER_SIZE);
+    buf->len = URING_BUFFER_SIZE;
+    buf->bid = (unsigned short)id;
+    __atomic_store_n(&ring->buffers->tail,(unsigned short)(tail+1),
+        __ATOMIC_RELEASE);
+}
+
+
+
+static struct io_uring_sqe *uring_get_sqe (struct uring *ring) {
+
+/* Return the next free submission queue entry, cleared, or NULL if the queue
+is full.  It is not visible to the kernel until the tail is published. */
+
+    unsigned head = __atomic_load_n(ring->sq_head,__ATOMIC_ACQUIRE),
+        tail = *ring->sq_tail+ring->pending;
+    struct io_uring_sqe *sqe;
+
+    if (tail-head >= URING_ENTRIES) return NULL;
+    ring->sq_array[tail&*ring->sq_mask] = tail&*ring->sq_mask;
+    sqe = &ring->sqes[tail&*ring->sq_mask];
+    memset(sqe,0,sizeof(*sqe));
+    ++ring->pending;
+    return sqe;
+}
+
+
+
+static void uring_arm (struct uring *ring) {
+
+/* Queue the multishot recvmsg request, if it isn't already armed. */
+
+    struct io_uring_sqe *sqe;
+
+    if (ring->armed || (sqe = uring_get_sqe(ring)) == NULL) return;
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = ring->socket;
+    sqe->addr = (unsigned long)&ring->receive;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_GROUP;
+    sqe->user_data = URING_RECV_TAG;
+    ring->armed = 1;
+}
+
+
+
+static int uring_submit (struct uring *ring, int waiting) {
+
+/* Publish any queued requests and enter the kernel to submit them, waiting up
+to waiting milliseconds for a completion if waiting is positive.  Returns 0 or
+an errno value; a timeout is not an error. */
+
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned submit = ring->pending;
+    int k;
+
+    if (submit == 0 && waiting <= 0) return 0;
+    __atomic_store_n(ring->sq_tail,*ring->sq_tail+submit,__ATOMIC_RELEASE);
+    ring->pending = 0;
+    if (waiting > 0) {
+        memset(&arg,0,sizeof(arg));
+        ts.tv_sec = waiting/1000;
+        ts.tv_nsec = 1000000l*(waiting%1000);
+        arg.ts = (unsigned long)&ts;
+        k = uring_enter(ring->descriptor,submit,1,
+            IORING_ENTER_GETEVENTS|IORING_ENTER_EXT_ARG,&arg,sizeof(arg));
+    } else
+        k = uring_enter(ring->descriptor,submit,0,0,NULL,0);
+    if (k < 0 && errno != ETIME && errno != EINTR && errno != EBUSY)
+        return errno;
+    return 0;
+}
+
+
+
+extern int uring_open (int which, int descriptor) {
+
+/* Set up a ring for socket which, with the given descriptor, and arm it.  Any
+failure leaves nothing behind and returns an error, which the caller should
+treat as 'use the ordinary code'. */
+
+    struct uring *ring;
+    struct io_uring_params params;
+    struct io_uring_buf_reg reg;
+    unsigned char *base;
+    int k;
+
+    if (which < 0 || which >= MAX_SOCKETS || rings[which] != NULL)
+        return EMSNTP_INTERNAL;
+    if ((ring = calloc(1,sizeof(struct uring))) == NULL) return ENOMEM;
+    ring->descriptor = -1;
+    ring->socket = descriptor;
+
+/* Create the ring and map its queues.  Insist on the features used later,
+rather than coping with every kernel since 5.1. */
+
+    memset(&params,0,sizeof(params));
+    errno = 0;
+    if ((ring->descriptor = uring_setup(URING_ENTRIES,&params)) < 0 ||
+            ! (params.features & IORING_FEAT_SINGLE_MMAP) ||
+            ! (params.features & IORING_FEAT_EXT_ARG) ||
+            ! (params.features & IORING_FEAT_NODROP)) {
+        k = (errno ? errno : EMSNTP_INTERNAL);
+        uring_free(ring);
+        return k;
+    }
+    ring->sq_size = params.sq_off.array+params.sq_entries*sizeof(unsigned);
+    ring->cq_size = params.cq_off.cqes+
+        params.cq_entries*sizeof(struct io_uring_cqe);
+    if (ring->cq_size > ring->sq_size) ring->sq_size = ring->cq_size;
+    ring->sqes_size = params.sq_entries*sizeof(struct io_uring_sqe);
+    base = mmap(NULL,ring->sq_size,PROT_READ|PROT_WRITE,
+        MAP_SHARED|MAP_POPULATE,ring->descriptor,IORING_OFF_SQ_RING);
+    if (base == MAP_FAILED) {
+        k = errno;
+        uring_free(ring);
+        return k;
+    }
+    ring->sq_ring = ring->cq_ring = base;
+    ring->sqes = mmap(NULL,ring->sqes_size,PROT_READ|PROT_WRITE,
+        MAP_SHARED|MAP_POPULATE,ring->descriptor,IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        k = errno;
+        ring->sqes = NULL;
+        uring_free(ring);
+        return k;
+    }
+    ring->sq_head = (unsigned *)(base+params.sq_off.head);
+    ring->sq_tail = (unsigned *)(base+params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(base+params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(base+params.sq_off.array);
+    ring->cq_head = (unsigned *)(base+params.cq_off.head);
+    ring->cq_tail = (unsigned *)(base+params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(base+params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(base+params.cq_off.cqes);
+
+/* Register the receive buffers.  The ring of buffer descriptors and the
+buffers themselves share one page-aligned mapping. */
+
+    ring->buffers_size = URING_BUFFERS*sizeof(struct io_uring_buf)+
+        URING_BUFFERS*URING_BUFFER_SIZE;
+    ring->buffers = mmap(NULL,ring->buffers_size,PROT_READ|PROT_WRITE,
+        MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+    if (ring->buffers == MAP_FAILED) {
+        k = errno;
+        ring->buffers = NULL;
+        uring_free(ring);
+        return k;
+    }
+    ring->memory = (unsigned char *)ring->buffers+
+        URING_BUFFERS*sizeof(struct io_uring_buf);
+    memset(&reg,0,sizeof(reg));
+    reg.ring_addr = (unsigned long)ring->buffers;
+    reg.ring_entries = URING_BUFFERS;
+    reg.bgid = URING_GROUP;
+    errno = 0;
+    if (uring_register(ring->descriptor,IORING_REGISTER_PBUF_RING,&reg,1)) {
+        k = errno;
+        munmap(ring->buffers,ring->buffers_size);
+        ring->buffers = NULL;
+        uring_free(ring);
+        return k;
+    }
+    for (k = 0; k < URING_BUFFERS; ++k) uring_recycle(ring,k);
+
+/* The template for the multishot recvmsg only says how much room to leave for
+the address and control data in each buffer.  The address is at most an IPv6
+one, even on a dual-stack socket. */
+
+    ring->receive.msg_namelen = sizeof(struct sockaddr_in6);
+    ring->receive.msg_controllen = URING_CONTROL_SIZE;
+    for (k = 0; k < URING_SENDS; ++k) ring->free_sends[k] = k;
+    ring->nfree = URING_SENDS;
+
+/* A kernel that does not support multishot recvmsg fails it while submitting
+it, so its completion is already there. */
+
+    uring_arm(ring);
+    if ((k = uring_submit(ring,0)) == 0 && *ring->cq_head !=
+            __atomic_load_n(ring->cq_tail,__ATOMIC_ACQUIRE) &&
+            ring->cqes[*ring->cq_head&*ring->cq_mask].res < 0)
+        k = -ring->cqes[*ring->cq_head&*ring->cq_mask].res;
+    if (k != 0) {
+        uring_free(ring);
+        return k;
+    }
+    rings[which] = ring;
+    if (verbose > 2) fprintf(stderr,"Using io_uring on socket %d\n",which);
+    return 0;
+}
+
+
+
+extern int uring_active (int which) {
+    return (which >= 0 && which < MAX_SOCKETS && rings[which] != NULL);
+}
+
+
+
+extern int uring_descriptor (int which) {
+    return (uring_active(which) ? rings[which]->descriptor : -1);
+}
+
+
+
+extern int uring_read_batch (int which, void *packets, int length,
+                             int *lengths, int max, int waiting,
+                             int *received) {
+
+/* This has the same interface as read_socket_batch(), which calls it.  It
+collects completed receives, recycles their buffers and frees the slots of
+completed sends, entering the kernel only when there is nothing to collect or
+when there are queued replies to submit.  If the kernel refuses the multishot
+receive before anything has been received, the ring is dropped and this returns
+as if nothing were queued, so that socket.c carries on without it. */
+
+    struct uring *ring = rings[which];
+    struct io_uring_cqe *cqe;
+    struct io_uring_recvmsg_out *out;
+    struct msghdr control;
+    unsigned head, tail;
+    unsigned char *buffer;
+    int number = 0, entered = 0, id, k;
+
+    *received = 0;
+    if (max < 1 || max > BATCH_MAX) max = BATCH_MAX;
+    while (1) {
+        head = *ring->cq_head;
+        tail = __atomic_load_n(ring->cq_tail,__ATOMIC_ACQUIRE);
+        for ( ; head != tail && number < max; ++head) {
+            cqe = &ring->cqes[head&*ring->cq_mask];
+            if (cqe->user_data != URING_RECV_TAG) {
+                ring->free_sends[ring->nfree++] = (int)cqe->user_data;
+                if (cqe->res < 0 && ring->failure == 0)
+                    ring->failure = -cqe->res;
+                continue;
+            }
+            if (! (cqe->flags & IORING_CQE_F_MORE)) ring->armed = 0;
+            if (cqe->res == -EINVAL && ! ring->received) {
+                ring->refused = 1;
+                continue;
+            }
+            if (cqe->res < 0 || ! (cqe->flags & IORING_CQE_F_BUFFER)) {
+                if (cqe->res != -ENOBUFS && ring->failure == 0)
+                    ring->failure = -cqe->res;
+                continue;
+            }
+
+/* The buffer holds a header, the sender's address, any control data (the
+kernel's timestamp) and then the packet itself.  Copy out what the caller needs
+and give it straight back. */
+
+            id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+            buffer = ring->memory+id*URING_BUFFER_SIZE;
+            out = (struct io_uring_recvmsg_out *)buffer;
+            k = out->payloadlen;
+            if (k > length) k = length;
+            memset(&ring->from[number],0,sizeof(ring->from[number]));
+            memcpy(&ring->from[number],buffer+sizeof(*out),
+                (out->namelen < ring->receive.msg_namelen ? out->namelen :
+                    ring->receive.msg_namelen));
+            memcpy((char *)packets+number*length,
+                buffer+sizeof(*out)+ring->receive.msg_namelen+
+                    ring->receive.msg_controllen,(size_t)k);
+            memset(&control,0,sizeof(control));
+            control.msg_control = buffer+sizeof(*out)+
+                ring->receive.msg_namelen;
+            control.msg_controllen = out->controllen;
+            control.msg_flags = (int)out->flags;
+            ring->arrivals[number] = arrival_stamp(&control);
+            lengths[number++] = ((out->flags & MSG_TRUNC) ? length : k);
+            uring_recycle(ring,id);
+            ring->received = 1;
+        }
+        __atomic_store_n(ring->cq_head,head,__ATOMIC_RELEASE);
+        if (ring->refused) {
+            if (verbose > 2)
+                fprintf(stderr,"No multishot io_uring on socket %d\n",which);
+            uring_close(which);
+            errno = 0;
+            return -1;
+        }
+
+/* Report any failure, keeping the same errors as the ordinary code. */
+
+        if (ring->failure != 0) {
+            k = ring->failure;
+            ring->failure = 0;
+            fatal(k,"unable to send or receive NTP packets via io_uring",NULL);
+            return k;
+        }
+        if (number > 0 || entered) break;
+        uring_arm(ring);
+        if ((k = uring_submit(ring,waiting)) != 0) {
+            fatal(k,"unable to enter io_uring",NULL);
+            return k;
+        }
+        entered = 1;
+    }
+
+/* Re-arm the receive if the kernel has dropped it (e.g. on running out of
+buffers), and push out any replies queued since the last call. */
+
+    uring_arm(ring);
+    if ((k = uring_submit(ring,0)) != 0) {
+        fatal(k,"unable to enter io_uring",NULL);
+        return k;
+    }
+    if (number == 0) {
+        errno = 0;
+        return -1;
+    }
+    if (verbose > 2) fprintf(stderr,"Batch of %d packets received\n",number);
+    *received = number;
+    return 0;
+}
+
+
+
+extern ntp_stamp uring_arrival (int which, int slot) {
+
+/* The kernel's time of arrival of slot of the last uring_read_batch(), for
+socket_arrival(). */
+
+    return rings[which]->arrivals[slot];
+}
+
+
+
+extern uint64_t uring_peer (int which, int slot) {
+
+/* The sender of slot of the last uring_read_batch(), for socket_peer(). */
+
+    return address_key(&rings[which]->from[slot]);
+}
+
+
+
+extern int uring_write_batch (int which, void *packets, int length,
+                              int *slots, int number) {
+
+/* This has the same interface as write_socket_batch(), which calls it.  The
+replies are copied and queued, and then submitted together (or earlier if the
+queue fills up), so that none is left waiting for a later call that may never
+come.  If every reply slot is in flight, which can happen only under extreme
+load, fall back to sendto(). */
+
+    struct uring *ring = rings[which];
+    struct uring_send *send;
+    struct io_uring_sqe *sqe;
+    int k, id, ret;
+
+    if (length > URING_SEND_SIZE) {
+        fatal(EMSNTP_INTERNAL,"NTP packet too long for io_uring",NULL);
+        return EMSNTP_INTERNAL;
+    }
+    for (k = 0; k < number; ++k) {
+        if (ring->nfree == 0 || (sqe = uring_get_sqe(ring)) == NULL) {
+            if (ring->pending > 0 && (ret = uring_submit(ring,0)) != 0) {
+                fatal(ret,"unable to enter io_uring",NULL);
+                return ret;
+            }
+            errno = 0;
+            if (sendto(ring->socket,(char *)packets+k*length,(size_t)length,
+                    0,(struct sockaddr *)&ring->from[slots[k]],
+                    address_size(&ring->from[slots[k]])) != length) {
+                fatal(errno,"unable to send NTP packet",NULL);
+                return errno;
+            }
+            continue;
+        }
+        id = ring->free_sends[--ring->nfree];
+        send = &ring->sends[id];
+        memcpy(send->packet,(char *)packets+k*length,(size_t)length);
+        memcpy(&send->to,&ring->from[slots[k]],sizeof(send->to));
+        send->vector.iov_base = send->packet;
+        send->vector.iov_len = (size_t)length;
+        memset(&send->message,0,sizeof(send->message));
+        send->message.msg_name = &send->to;
+        send->message.msg_namelen = address_size(&send->to);
+        send->message.msg_iov = &send->vector;
+        send->message.msg_iovlen = 1;
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = ring->socket;
+        sqe->addr = (unsigned long)&send->message;
+        sqe->len = 1;
+        sqe->user_data = (__u64)id;
+    }
+    if (ring->pending > 0 && (ret = uring_submit(ring,0)) != 0) {
+        fatal(ret,"unable to enter io_uring",NULL);
+        return ret;
+    }
+    if (verbose > 2) fprintf(stderr,"Batch of %d packets sent\n",number);
+    return 0;
+}
+
+
+
+extern void uring_close (int which) {
+
+/* Tear down the ring, which also cancels the outstanding requests. */
+
+    if (! uring_active(which)) return;
+    uring_free(rings[which]);
+    rings[which] = NULL;
+}
+
+
+
+#else
+
+/* Without io_uring, there is never a ring, so socket.c always uses its own
+code. */
+
+extern int uring_open (int which, int descriptor) {
+    return EMSNTP_INTERNAL;
+}
+
+extern int uring_active (int which) {
+    return 0;
+}
+
+extern int uring_descriptor (int which) {
+    return -1;
+}
+
+extern int uring_read_batch (int which, void *packets, int length,
+                             int *lengths, int max, int waiting,
+                             int *received) {
+    return EMSNTP_INTERNAL;
+}
+
+extern ntp_stamp uring_arrival (int which, int slot) {
+    return 0;
+}
+
+extern uint64_t uring_peer (int which, int slot) {
+    return 0;
+}
+
+extern int uring_write_batch (int which, void *packets, int length,
+                              int *slots, int number) {
+    return EMSNTP_INTERNAL;
+}
+
+extern void uring_close (int which) {
+}
+
+#endif